@@ -0,0 +1,64 @@
+# PlatformIO post-build script.
+# Writes firmware.bin.gz and firmware.json next to firmware.bin. The .gz is what the
+# device downloads (inflated on the fly); firmware.json is the OTA manifest it checks
+# before it makes a downloaded image bootable (see OTA STATUS & REQUEST in main.cpp).
+#   {"version": FW_VERSION, "build": "<UTC stamp>", "sha256": "<hex>", "size": <bytes>,
+#    "gzSize": <bytes>, "url": "<image url>"}
+# sha256 / size are of the uncompressed image. Deploy all three files to
+# public/devices/<deviceId>/ on Firebase Hosting.
+#
+# Can also be run by hand:    python scripts/build_ota_manifest.py <path/to/firmware.bin> [deviceId]
+
+import datetime
+import gzip
+import hashlib
+import json
+import os
+import re
+import sys
+
+HOSTING_URL = "https://aidoser.web.app/devices/%s/firmware.bin"
+
+
+def source_value(project_dir, name):
+    with open(os.path.join(project_dir, "src", "main.cpp"), encoding="utf-8") as f:
+        m = re.search(r'const char\*\s+%s\s*=\s*"([^"]*)"' % name, f.read())
+    return m.group(1) if m else ""
+
+
+def write_manifest(bin_path, project_dir, device_id=None):
+    with open(bin_path, "rb") as f:
+        image = f.read()
+    # mtime 0 and no file name: the same image always gives the same .gz
+    packed = gzip.compress(image, compresslevel=9, mtime=0)
+    with open(bin_path + ".gz", "wb") as f:
+        f.write(packed)
+    device_id = device_id or source_value(project_dir, "DEVICE_ID")
+    manifest = {
+        "version": source_value(project_dir, "FW_VERSION"),
+        "build": datetime.datetime.now(datetime.timezone.utc).strftime("%Y-%m-%d.%H%M%S"),
+        "url": HOSTING_URL % device_id,
+        "sha256": hashlib.sha256(image).hexdigest(),
+        "size": len(image),
+        "gzSize": len(packed),
+    }
+    out = os.path.join(os.path.dirname(bin_path), "firmware.json")
+    with open(out, "w") as f:
+        json.dump(manifest, f, indent=2)
+        f.write("\n")
+    print("ota manifest: %s %s %d bytes (gz %d) sha256 %s" % (
+        out, manifest["version"], manifest["size"], manifest["gzSize"], manifest["sha256"]))
+
+
+try:
+    Import("env")  # noqa: F821 (provided by PlatformIO/SCons)
+
+    def after_build(source, target, env):  # noqa: ARG001
+        write_manifest(target[0].get_abspath(), env["PROJECT_DIR"])
+
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", after_build)  # noqa: F821
+except NameError:
+    if len(sys.argv) < 2:
+        sys.exit("usage: build_ota_manifest.py <firmware.bin> [deviceId]")
+    write_manifest(sys.argv[1], os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                   sys.argv[2] if len(sys.argv) > 2 else None)
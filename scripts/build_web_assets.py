@@ -0,0 +1,72 @@
+# PlatformIO pre-build script.
+# Gzips the dashboard in webstuff/ into data/www/ for the LittleFS image and writes
+# data/www/manifest.txt ("<name> <content-type> <etag>" per line). The firmware serves
+# the .gz files as-is with Content-Encoding: gzip and answers If-None-Match with 304.
+#
+# Flash the filesystem with:  pio run -t uploadfs
+# Can also be run by hand:    python scripts/build_web_assets.py
+
+import gzip
+import hashlib
+import io
+import os
+
+try:
+    Import("env")  # noqa: F821 (provided by PlatformIO/SCons)
+    PROJECT_DIR = env["PROJECT_DIR"]  # noqa: F821
+    DATA_DIR = env.subst("$PROJECT_DATA_DIR")  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    DATA_DIR = os.path.join(PROJECT_DIR, "data")
+
+SRC_DIR = os.path.join(PROJECT_DIR, "webstuff")
+OUT_DIR = os.path.join(DATA_DIR, "www")
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".ico": "image/x-icon",
+}
+
+
+def gzip_bytes(raw):
+    # mtime=0 and no filename keep the output (and so the ETag) reproducible
+    buf = io.BytesIO()
+    with gzip.GzipFile(filename="", mode="wb", fileobj=buf, compresslevel=9, mtime=0) as gz:
+        gz.write(raw)
+    return buf.getvalue()
+
+
+def write_if_changed(path, data):
+    if os.path.exists(path):
+        with open(path, "rb") as f:
+            if f.read() == data:
+                return False
+    with open(path, "wb") as f:
+        f.write(data)
+    return True
+
+
+def build():
+    os.makedirs(OUT_DIR, exist_ok=True)
+    manifest = []
+    for name in sorted(os.listdir(SRC_DIR)):
+        ctype = CONTENT_TYPES.get(os.path.splitext(name)[1].lower())
+        if ctype is None:
+            continue
+        with open(os.path.join(SRC_DIR, name), "rb") as f:
+            raw = f.read()
+        gz = gzip_bytes(raw)
+        etag = hashlib.sha256(gz).hexdigest()[:16]
+        if write_if_changed(os.path.join(OUT_DIR, name + ".gz"), gz):
+            print("web assets: %s %d -> %d bytes" % (name, len(raw), len(gz)))
+        manifest.append("%s %s %s" % (name, ctype, etag))
+    write_if_changed(os.path.join(OUT_DIR, "manifest.txt"), ("\n".join(manifest) + "\n").encode())
+
+
+build()
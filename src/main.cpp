@@ -1,7 +1,8 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <WiFiManager.h>
-#include <WebServer.h>
+#include <ESPAsyncWebServer.h>
+#include <LittleFS.h>
 #include <math.h>
 #include <time.h>
 #include <WiFiClientSecure.h>
@@ -9,8 +10,18 @@
 #include <Update.h>
 #include <ArduinoJson.h>
 #include <stdint.h>
+#include <atomic>
+#include <algorithm>
 #include <Preferences.h>
 #include <nvs_flash.h>
+#include <soc/gpio_struct.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <stddef.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/version.h>
+#include <esp32/rom/miniz.h>
+#include <esp_ota_ops.h>
 
 // Forward declarations used by helpers
 uint64_t getEpochMillis();
@@ -18,6 +29,7 @@ uint64_t getEpochMillis();
 
 // If MAIN_PAGE_HTML is defined in another file, this keeps it linking cleanly:
 // Simple placeholder page – ESP32 is now mainly a backend.
+// Served at "/" only when the LittleFS web assets (pio run -t uploadfs) are missing.
 // Your real UI lives on Firebase Hosting.
 const char MAIN_PAGE_HTML[] PROGMEM = R"rawliteral(
 <!DOCTYPE html>
@@ -40,13 +52,24 @@ const char MAIN_PAGE_HTML[] PROGMEM = R"rawliteral(
 //const char* WIFI_PASSWORD = "Frinov25!+!";
 WiFiManager wm;
 
-WebServer server(80);
+// Local HTTP server. Runs event-driven in the AsyncTCP task, independent of loop(),
+// so the local UI stays responsive while pumps run or Firebase calls time out.
+AsyncWebServer server(80);
 
 // NTP server and timezone (Central Time / Chicago)
 const char* NTP_SERVER     = "pool.ntp.org";
 const long  GMT_OFFSET_SEC = -6 * 3600;  // UTC-6 standard time
 const int   DST_OFFSET_SEC = 3600;       // DST +1h (simple)
-bool globalEmergencyStop = false; // If true, no pumps can move.
+volatile bool globalEmergencyStop = false; // If true, no pumps can move.
+
+// Settings changed through the local API are written back to RTDB so the next poll
+// doesn't revert them. While a write-back is pending, that RTDB node isn't pulled.
+enum CloudMirrorBits : uint8_t {
+  MIRROR_KILL_SWITCH   = 1 << 0,
+  MIRROR_DOSING_PLAN   = 1 << 1,
+  MIRROR_DOSE_SCHEDULE = 1 << 2,
+};
+uint8_t pendingCloudMirror = 0;
 
 // ===================== FIREBASE (REST API) =====================
 
@@ -65,15 +88,306 @@ const float MIN_DOSE_SEC = 1.0f; // Minimum time we allow a pump to run
 
 WiFiClientSecure secureClient;
 
-uint64_t lastRemoteTestTimestampMs = 0;
+// secureClient is shared by loop() and the one-shot boot network task; every REST
+// helper holds this for the whole request. Recursive so a helper can call another.
+SemaphoreHandle_t firebaseMutex = nullptr;
+
+struct FirebaseLock {
+  FirebaseLock()  { if (firebaseMutex) xSemaphoreTakeRecursive(firebaseMutex, portMAX_DELAY); }
+  ~FirebaseLock() { if (firebaseMutex) xSemaphoreGiveRecursive(firebaseMutex); }
+};
 
-Preferences dosingPrefs;
+// Test sync cursor: timestamp (ms) of the newest RTDB test already fed to the controller.
+uint64_t lastRemoteTestTimestampMs = 0;
+bool     testSyncNeedsBackfill     = true; // pull recent tests into history on (re)start
 
 void firebaseSetCalibrationStatus();
-void updateChemistryConstants();
 void syncTimeFromFirebaseHeader();
+void wsPublishPending();
+bool configCommit();
+uint32_t crc32Bytes(const void* data, size_t len, uint32_t crc = 0);
+void rtcSaveRuntime();
+void rtcSaveHistory();
+void rtcSaveThrottle();
+
+// Warm reset (see WARM RESET SNAPSHOT): RTC memory kept its contents, and the
+// runtime state (buckets, slots, cursor) came back from it.
+bool rtcWarmBoot        = false;
+bool rtcRuntimeRestored = false;
+
+
+// ===================== METRICS =====================
+// Counters, gauges and fixed-bucket histograms updated from the hot paths with
+// relaxed atomics (no locks, safe from any task). Exported as Prometheus text on
+// /metrics and as a compact summary in /state.
+
+struct MetricHistogram {
+  static const int MAX_BOUNDS = 11;
+  const uint32_t* bounds;   // inclusive upper bounds, ascending; +Inf bucket implied
+  uint8_t nBounds;
+  std::atomic<uint32_t> buckets[MAX_BOUNDS + 1];
+  std::atomic<uint32_t> count;
+  std::atomic<uint32_t> sum;
+  std::atomic<uint32_t> max;
+
+  MetricHistogram(const uint32_t* b, uint8_t n) : bounds(b), nBounds(n) {}
+
+  void observe(uint32_t v) {
+    uint8_t i = 0;
+    while (i < nBounds && v > bounds[i]) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+    uint32_t m = max.load(std::memory_order_relaxed);
+    while (v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+  }
+
+  // Upper bound of the bucket holding quantile q (observed max for the +Inf bucket).
+  uint32_t quantile(float q) const {
+    const uint32_t n = count.load(std::memory_order_relaxed);
+    if (n == 0) return 0;
+    const uint32_t rank = (uint32_t)ceilf(q * n);
+    uint32_t acc = 0;
+    for (uint8_t i = 0; i < nBounds; i++) {
+      acc += buckets[i].load(std::memory_order_relaxed);
+      if (acc >= rank) return bounds[i];
+    }
+    return max.load(std::memory_order_relaxed);
+  }
+};
+
+static const uint32_t METRIC_MS_BOUNDS[] = {25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000};
+static const uint32_t METRIC_US_BOUNDS[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000};
+static const uint32_t METRIC_SEC_BOUNDS[] = {1, 5, 15, 30, 60, 120, 300, 600, 1800, 3600};
+static const uint8_t  METRIC_N_BOUNDS    = sizeof(METRIC_MS_BOUNDS) / sizeof(METRIC_MS_BOUNDS[0]);
+
+// RTDB requests are grouped by the node under /devices/<id>/ they hit.
+enum RtdbEndpoint : uint8_t {
+  EP_COMMANDS, EP_SETTINGS, EP_STATE, EP_DOSE_RUNS, EP_TESTS, EP_ALERTS, EP_OTA, EP_OTHER,
+  EP_COUNT
+};
+static const char* const RTDB_ENDPOINT_NAMES[EP_COUNT] = {
+  "commands", "settings", "state", "doseRuns", "tests", "alerts", "ota", "other"
+};
+
+struct RtdbEndpointMetrics {
+  std::atomic<uint32_t> requests;
+  std::atomic<uint32_t> httpErrors;       // non-2xx answer
+  std::atomic<uint32_t> transportErrors;  // connect/TLS/socket failure
+  std::atomic<uint32_t> timeouts;         // read timeout
+  MetricHistogram latencyMs{METRIC_MS_BOUNDS, METRIC_N_BOUNDS};
+};
+
+struct Metrics {
+  RtdbEndpointMetrics rtdb[EP_COUNT];
+  MetricHistogram tlsHandshakeMs{METRIC_MS_BOUNDS, METRIC_N_BOUNDS};
+  std::atomic<uint32_t> tlsFailures;
+  MetricHistogram jsonParseUs{METRIC_US_BOUNDS, METRIC_N_BOUNDS};
+  std::atomic<uint32_t> jsonParseErrors;
+  MetricHistogram loopMs{METRIC_MS_BOUNDS, METRIC_N_BOUNDS};
+  std::atomic<uint32_t> nvsWrites;
+  MetricHistogram slotLatenessSec{METRIC_SEC_BOUNDS, METRIC_N_BOUNDS};
+  MetricHistogram doseOnTimeErrMs{METRIC_MS_BOUNDS, METRIC_N_BOUNDS};   // |actual - planned| pump run
+  std::atomic<uint32_t> slotsLate;
+  std::atomic<uint32_t> slotsMissed;
+  std::atomic<uint32_t> wsFramesDropped;   // websocket queue overflowed (slow client)
+};
+
+Metrics metrics;
+
+static uint8_t rtdbEndpointOf(const String& path) {
+  int p = path.indexOf("devices/");
+  if (p < 0) return EP_OTHER;
+  p = path.indexOf('/', p + 8);   // skip the device id
+  if (p < 0) return EP_OTHER;
+  const char* seg = path.c_str() + p + 1;
+  auto is = [seg](const char* name) { return strncmp(seg, name, strlen(name)) == 0; };
+
+  if (is("commands") || is("otaRequest") || is("calibration")) return EP_COMMANDS;
+  if (is("settings") || is("dosingPlan")) return EP_SETTINGS;
+  if (is("state"))    return EP_STATE;
+  if (is("doseRuns") || is("doseDaily")) return EP_DOSE_RUNS;
+  if (is("tests"))    return EP_TESTS;
+  if (is("alerts") || is("notifications")) return EP_ALERTS;
+  if (is("firmware") || is("otaStatus"))   return EP_OTA;
+  return EP_OTHER;
+}
+
+void metricsRtdbRequest(uint8_t ep, int code, uint32_t elapsedMs) {
+  RtdbEndpointMetrics& m = metrics.rtdb[ep < EP_COUNT ? ep : EP_OTHER];
+  m.requests.fetch_add(1, std::memory_order_relaxed);
+  m.latencyMs.observe(elapsedMs);
+  if (code == HTTPC_ERROR_READ_TIMEOUT) m.timeouts.fetch_add(1, std::memory_order_relaxed);
+  else if (code < 0) m.transportErrors.fetch_add(1, std::memory_order_relaxed);
+  else if (code < 200 || code >= 300) m.httpErrors.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Host part of FIREBASE_DB_URL, parsed once.
+static const char* firebaseHost() {
+  static char host[96] = {0};
+  if (!host[0]) {
+    const char* s = strstr(FIREBASE_DB_URL, "://");
+    s = s ? s + 3 : FIREBASE_DB_URL;
+    size_t n = strcspn(s, "/:");
+    if (n >= sizeof(host)) n = sizeof(host) - 1;
+    memcpy(host, s, n);
+    host[n] = 0;
+  }
+  return host;
+}
+
+// Opens the TLS session before the request so the handshake is timed on its own;
+// HTTPClient then uses the already-connected socket.
+void firebaseConnectTimed() {
+  if (secureClient.connected()) return;
+  const uint32_t t0 = millis();
+  if (secureClient.connect(firebaseHost(), 443)) {
+    metrics.tlsHandshakeMs.observe(millis() - t0);
+  } else {
+    metrics.tlsFailures.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+DeserializationError parseJsonTimed(JsonDocument& doc, const String& payload) {
+  const uint32_t t0 = micros();
+  DeserializationError err = deserializeJson(doc, payload);
+  metrics.jsonParseUs.observe(micros() - t0);
+  if (err) metrics.jsonParseErrors.fetch_add(1, std::memory_order_relaxed);
+  return err;
+}
+
+// Preferences that counts NVS writes. Use it for every namespace we write to.
+class NvsPrefs : public Preferences {
+ public:
+  size_t putFloat(const char* key, float v) { countWrite(); return Preferences::putFloat(key, v); }
+  size_t putString(const char* key, const char* v) { countWrite(); return Preferences::putString(key, v); }
+  size_t putString(const char* key, const String& v) { countWrite(); return Preferences::putString(key, v); }
+  size_t putULong64(const char* key, uint64_t v) { countWrite(); return Preferences::putULong64(key, v); }
+  size_t putUInt(const char* key, uint32_t v) { countWrite(); return Preferences::putUInt(key, v); }
+  size_t putBytes(const char* key, const void* v, size_t len) { countWrite(); return Preferences::putBytes(key, v, len); }
+ private:
+  static void countWrite() { metrics.nvsWrites.fetch_add(1, std::memory_order_relaxed); }
+};
+
+static void metricsPrintHistogram(Print& out, const char* name, const char* labels,
+                                  const MetricHistogram& h) {
+  uint32_t acc = 0;
+  for (uint8_t i = 0; i < h.nBounds; i++) {
+    acc += h.buckets[i].load(std::memory_order_relaxed);
+    out.printf("%s_bucket{%s%sle=\"%lu\"} %lu\n", name, labels, labels[0] ? "," : "",
+               (unsigned long)h.bounds[i], (unsigned long)acc);
+  }
+  acc += h.buckets[h.nBounds].load(std::memory_order_relaxed);
+  out.printf("%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, labels[0] ? "," : "", (unsigned long)acc);
+  const char* open = labels[0] ? "{" : "";
+  const char* close = labels[0] ? "}" : "";
+  out.printf("%s_sum%s%s%s %lu\n", name, open, labels, close,
+             (unsigned long)h.sum.load(std::memory_order_relaxed));
+  out.printf("%s_count%s%s%s %lu\n", name, open, labels, close, (unsigned long)acc);
+}
+
+// Prometheus text exposition format (version 0.0.4).
+void metricsWritePrometheus(Print& out) {
+  out.printf("# TYPE doser_uptime_seconds gauge\ndoser_uptime_seconds %lu\n", (unsigned long)(millis() / 1000));
+  out.printf("# TYPE doser_heap_free_bytes gauge\ndoser_heap_free_bytes %lu\n", (unsigned long)ESP.getFreeHeap());
+  out.printf("# TYPE doser_heap_largest_free_block_bytes gauge\ndoser_heap_largest_free_block_bytes %lu\n",
+             (unsigned long)ESP.getMaxAllocHeap());
+  out.printf("# TYPE doser_heap_min_free_bytes gauge\ndoser_heap_min_free_bytes %lu\n", (unsigned long)ESP.getMinFreeHeap());
+  out.printf("# TYPE doser_wifi_rssi_dbm gauge\ndoser_wifi_rssi_dbm %d\n", (int)WiFi.RSSI());
+  out.printf("# TYPE doser_nvs_writes_total counter\ndoser_nvs_writes_total %lu\n",
+             (unsigned long)metrics.nvsWrites.load(std::memory_order_relaxed));
+
+  out.print("# TYPE doser_rtdb_requests_total counter\n");
+  for (int i = 0; i < EP_COUNT; i++) {
+    out.printf("doser_rtdb_requests_total{endpoint=\"%s\"} %lu\n", RTDB_ENDPOINT_NAMES[i],
+               (unsigned long)metrics.rtdb[i].requests.load(std::memory_order_relaxed));
+  }
+  out.print("# TYPE doser_rtdb_errors_total counter\n");
+  for (int i = 0; i < EP_COUNT; i++) {
+    const RtdbEndpointMetrics& m = metrics.rtdb[i];
+    out.printf("doser_rtdb_errors_total{endpoint=\"%s\",kind=\"http\"} %lu\n", RTDB_ENDPOINT_NAMES[i],
+               (unsigned long)m.httpErrors.load(std::memory_order_relaxed));
+    out.printf("doser_rtdb_errors_total{endpoint=\"%s\",kind=\"transport\"} %lu\n", RTDB_ENDPOINT_NAMES[i],
+               (unsigned long)m.transportErrors.load(std::memory_order_relaxed));
+    out.printf("doser_rtdb_errors_total{endpoint=\"%s\",kind=\"timeout\"} %lu\n", RTDB_ENDPOINT_NAMES[i],
+               (unsigned long)m.timeouts.load(std::memory_order_relaxed));
+  }
+  out.print("# TYPE doser_rtdb_request_ms histogram\n");
+  for (int i = 0; i < EP_COUNT; i++) {
+    char labels[32];
+    snprintf(labels, sizeof(labels), "endpoint=\"%s\"", RTDB_ENDPOINT_NAMES[i]);
+    metricsPrintHistogram(out, "doser_rtdb_request_ms", labels, metrics.rtdb[i].latencyMs);
+  }
+
+  out.print("# TYPE doser_tls_handshake_ms histogram\n");
+  metricsPrintHistogram(out, "doser_tls_handshake_ms", "", metrics.tlsHandshakeMs);
+  out.printf("# TYPE doser_tls_failures_total counter\ndoser_tls_failures_total %lu\n",
+             (unsigned long)metrics.tlsFailures.load(std::memory_order_relaxed));
+
+  out.print("# TYPE doser_json_parse_us histogram\n");
+  metricsPrintHistogram(out, "doser_json_parse_us", "", metrics.jsonParseUs);
+  out.printf("# TYPE doser_json_parse_errors_total counter\ndoser_json_parse_errors_total %lu\n",
+             (unsigned long)metrics.jsonParseErrors.load(std::memory_order_relaxed));
+
+  out.print("# TYPE doser_loop_ms histogram\n");
+  metricsPrintHistogram(out, "doser_loop_ms", "", metrics.loopMs);
+
+  out.print("# TYPE doser_slot_lateness_seconds histogram\n");
+  metricsPrintHistogram(out, "doser_slot_lateness_seconds", "", metrics.slotLatenessSec);
+  out.print("# TYPE doser_dose_ontime_error_ms histogram\n");
+  metricsPrintHistogram(out, "doser_dose_ontime_error_ms", "", metrics.doseOnTimeErrMs);
+  out.printf("# TYPE doser_slots_late_total counter\ndoser_slots_late_total %lu\n",
+             (unsigned long)metrics.slotsLate.load(std::memory_order_relaxed));
+  out.printf("# TYPE doser_slots_missed_total counter\ndoser_slots_missed_total %lu\n",
+             (unsigned long)metrics.slotsMissed.load(std::memory_order_relaxed));
+  out.printf("# TYPE doser_ws_frames_dropped_total counter\ndoser_ws_frames_dropped_total %lu\n",
+             (unsigned long)metrics.wsFramesDropped.load(std::memory_order_relaxed));
+}
+
+// Compact summary for the /state heartbeat (all RTDB endpoints merged).
+String metricsSummaryJson() {
+  uint32_t req = 0, err = 0, tmo = 0, maxMs = 0;
+  uint32_t merged[MetricHistogram::MAX_BOUNDS + 1] = {0};
+  for (int i = 0; i < EP_COUNT; i++) {
+    const RtdbEndpointMetrics& m = metrics.rtdb[i];
+    req += m.requests.load(std::memory_order_relaxed);
+    err += m.httpErrors.load(std::memory_order_relaxed) + m.transportErrors.load(std::memory_order_relaxed);
+    tmo += m.timeouts.load(std::memory_order_relaxed);
+    maxMs = max(maxMs, m.latencyMs.max.load(std::memory_order_relaxed));
+    for (uint8_t b = 0; b <= METRIC_N_BOUNDS; b++) merged[b] += m.latencyMs.buckets[b].load(std::memory_order_relaxed);
+  }
+  uint32_t p95 = 0, acc = 0, total = 0;
+  for (uint8_t b = 0; b <= METRIC_N_BOUNDS; b++) total += merged[b];
+  for (uint8_t b = 0; b <= METRIC_N_BOUNDS && total; b++) {
+    acc += merged[b];
+    if (acc * 100 >= total * 95) { p95 = (b < METRIC_N_BOUNDS) ? METRIC_MS_BOUNDS[b] : maxMs; break; }
+  }
+
+  const uint32_t tlsN = metrics.tlsHandshakeMs.count.load(std::memory_order_relaxed);
+  const uint32_t tlsAvg = tlsN ? metrics.tlsHandshakeMs.sum.load(std::memory_order_relaxed) / tlsN : 0;
+
+  String json = "{";
+  json += "\"heapFree\":" + String(ESP.getFreeHeap()) + ",";
+  json += "\"heapMaxBlock\":" + String(ESP.getMaxAllocHeap()) + ",";
+  json += "\"heapMin\":" + String(ESP.getMinFreeHeap()) + ",";
+  json += "\"rtdbReq\":" + String(req) + ",";
+  json += "\"rtdbErr\":" + String(err) + ",";
+  json += "\"rtdbTimeouts\":" + String(tmo) + ",";
+  json += "\"rtdbP95Ms\":" + String(p95) + ",";
+  json += "\"rtdbMaxMs\":" + String(maxMs) + ",";
+  json += "\"tlsAvgMs\":" + String(tlsAvg) + ",";
+  json += "\"jsonP95Us\":" + String(metrics.jsonParseUs.quantile(0.95f)) + ",";
+  json += "\"loopP95Ms\":" + String(metrics.loopMs.quantile(0.95f)) + ",";
+  json += "\"loopMaxMs\":" + String(metrics.loopMs.max.load(std::memory_order_relaxed)) + ",";
+  json += "\"nvsWrites\":" + String(metrics.nvsWrites.load(std::memory_order_relaxed));
+  json += "}";
+  return json;
+}
+
 
 
+// ===================== FIREBASE: REST HELPERS =====================
+
 // Build full Firebase URL from a path (e.g. "/devices/reefDoser1/commands/resetAi")
 String firebaseUrl(const String& path) {
   String base = path;
@@ -104,6 +418,7 @@ bool firebasePutJson(const String& path, const String& jsonBody) {
     return false;
   }
 
+  FirebaseLock lock;
   HTTPClient https;
   String url = firebaseUrl(path);
 
@@ -120,8 +435,12 @@ bool firebasePutJson(const String& path, const String& jsonBody) {
   https.setReuse(false);    // optional but recommended
 
 
+  const uint8_t ep = rtdbEndpointOf(path);
+  const uint32_t t0 = millis();
+  firebaseConnectTimed();
   https.addHeader("Content-Type", "application/json");
   int code = https.PUT(jsonBody);
+  metricsRtdbRequest(ep, code, millis() - t0);
   if (code != HTTP_CODE_OK && code != HTTP_CODE_NO_CONTENT) {
     Serial.print("Firebase PUT error code: ");
     Serial.println(code);
@@ -142,6 +461,7 @@ bool firebasePostJson(const String& path, const String& jsonBody) {
     return false;
   }
 
+  FirebaseLock lock;
   HTTPClient https;
   String url = firebaseUrl(path);
 
@@ -157,8 +477,12 @@ bool firebasePostJson(const String& path, const String& jsonBody) {
   https.setTimeout(30000);   // ms
   https.setReuse(false);    // optional but recommended
 
+  const uint8_t ep = rtdbEndpointOf(path);
+  const uint32_t t0 = millis();
+  firebaseConnectTimed();
   https.addHeader("Content-Type", "application/json");
   int code = https.POST(jsonBody);
+  metricsRtdbRequest(ep, code, millis() - t0);
   if (code != HTTP_CODE_OK && code != HTTP_CODE_NO_CONTENT) {
     Serial.print("Firebase POST error code: ");
     Serial.println(code);
@@ -173,6 +497,49 @@ bool firebasePostJson(const String& path, const String& jsonBody) {
 }
 
 
+// Simple PATCH JSON helper (merges keys into an existing node)
+bool firebasePatchJson(const String& path, const String& jsonBody) {
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("Firebase PATCH: WiFi not connected");
+    return false;
+  }
+
+  FirebaseLock lock;
+  HTTPClient https;
+  String url = firebaseUrl(path);
+
+  Serial.print("Firebase PATCH: ");
+  Serial.println(url);
+  Serial.print("Body: ");
+  Serial.println(jsonBody);
+
+  if (!https.begin(secureClient, url)) {
+    Serial.println("Firebase PATCH begin() failed");
+    return false;
+  }
+  https.setTimeout(30000);   // ms
+  https.setReuse(false);
+
+  const uint8_t ep = rtdbEndpointOf(path);
+  const uint32_t t0 = millis();
+  firebaseConnectTimed();
+  https.addHeader("Content-Type", "application/json");
+  int code = https.PATCH(jsonBody);
+  metricsRtdbRequest(ep, code, millis() - t0);
+  if (code != HTTP_CODE_OK && code != HTTP_CODE_NO_CONTENT) {
+    Serial.print("Firebase PATCH error code: ");
+    Serial.println(code);
+    String resp = https.getString();
+    Serial.println(resp);
+    https.end();
+    return false;
+  }
+
+  https.end();
+  return true;
+}
+
+
 // Log a completed dose run to RTDB so the web UI can build the dosing history graph.
 // Writes to: /devices/<DEVICE_ID>/doseRuns (auto-push key).
 bool firebaseLogDoseRun(int pumpIndex,
@@ -207,6 +574,7 @@ String firebaseGetJson(const String& path) {
     return result;
   }
 
+  FirebaseLock lock;
   HTTPClient https;
   String url = firebaseUrl(path);
 
@@ -220,8 +588,12 @@ String firebaseGetJson(const String& path) {
   https.setTimeout(30000);   // ms
   https.setReuse(false);    // optional but recommended
 
+  const uint8_t ep = rtdbEndpointOf(path);
+  const uint32_t t0 = millis();
+  firebaseConnectTimed();
   int code = https.GET();
   if (code != HTTP_CODE_OK) {
+    metricsRtdbRequest(ep, code, millis() - t0);
     Serial.print("Firebase GET error code: ");
     Serial.println(code);
     https.end();
@@ -229,10 +601,65 @@ String firebaseGetJson(const String& path) {
   }
 
   result = https.getString();
+  metricsRtdbRequest(ep, code, millis() - t0);
   https.end();
   return result;
 }
 
+// Streaming GET helper: parses the body straight off the socket into `doc`
+// (optionally through an ArduinoJson filter) instead of buffering it in a String.
+// Returns false on transport/HTTP/parse errors. A "null" body yields an empty doc.
+bool firebaseGetJsonDoc(const String& path, JsonDocument& doc, const JsonDocument* filter) {
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("Firebase GET: WiFi not connected");
+    return false;
+  }
+
+  FirebaseLock lock;
+  HTTPClient https;
+  String url = firebaseUrl(path);
+
+  Serial.print("Firebase GET (stream): ");
+  Serial.println(url);
+
+  if (!https.begin(secureClient, url)) {
+    Serial.println("Firebase GET begin() failed");
+    return false;
+  }
+  https.setTimeout(30000);   // ms
+  https.setReuse(false);
+  https.useHTTP10(true);     // no chunked transfer, so the raw stream is plain JSON
+
+  const uint8_t ep = rtdbEndpointOf(path);
+  const uint32_t t0 = millis();
+  firebaseConnectTimed();
+  int code = https.GET();
+  if (code != HTTP_CODE_OK) {
+    metricsRtdbRequest(ep, code, millis() - t0);
+    Serial.print("Firebase GET error code: ");
+    Serial.println(code);
+    https.end();
+    return false;
+  }
+
+  // Parse time here includes waiting on the socket for the body.
+  const uint32_t parseStartUs = micros();
+  DeserializationError err = filter
+      ? deserializeJson(doc, https.getStream(), DeserializationOption::Filter(*filter))
+      : deserializeJson(doc, https.getStream());
+  metrics.jsonParseUs.observe(micros() - parseStartUs);
+  metricsRtdbRequest(ep, code, millis() - t0);
+  https.end();
+
+  if (err) {
+    metrics.jsonParseErrors.fetch_add(1, std::memory_order_relaxed);
+    Serial.print("Firebase GET JSON parse error: ");
+    Serial.println(err.c_str());
+    return false;
+  }
+  return true;
+}
+
 
 // ===================== TARGETS & TANK INFO =====================
 
@@ -263,27 +690,166 @@ float FLOW_TBD_ML_PER_MIN   = 50.0f;
 
 
 float FLOW_AUX_ML_PER_MIN = 0.0f;   // Pump 4 (optional)
-// ===================== CHEMISTRY CONSTANTS =====================
 
-// ---------- KALKWASSER (saturated) ----------
-float DKH_PER_ML_KALK_TANK    = 0.00010f;   // +0.00010 dKH/ml in 300g
-float CA_PPM_PER_ML_KALK_TANK = 0.00070f;   // +0.00070 ppm Ca/ml
+// Pump number (1..4) for a pump GPIO, 0 if unknown.
+int pinToPumpNum(int pin) {
+  if (pin == PIN_PUMP_KALK) return 1;
+  if (pin == PIN_PUMP_AFR)  return 2;
+  if (pin == PIN_PUMP_MG)   return 3;
+  if (pin == PIN_PUMP_TBD)  return 4;
+  return 0;
+}
+
+float pinFlowMlPerMin(int pin) {
+  switch (pinToPumpNum(pin)) {
+    case 1: return FLOW_KALK_ML_PER_MIN;
+    case 2: return FLOW_AFR_ML_PER_MIN;
+    case 3: return FLOW_MG_ML_PER_MIN;
+    case 4: return FLOW_TBD_ML_PER_MIN;
+    default: return 0.0f;
+  }
+}
+
+// ===================== REAGENT REGISTRY =====================
+// What each reagent does to the tank, as a reagents x parameters matrix. Effects are
+// the rise per ml in the 300g baseline tank (REAGENT_BASE_TANK_L);
+// applyTankVolumeScaling() turns them into per-pump effects for TANK_VOLUME_L. The
+// controller, the plan caps and the 24h governor all read reagentPumpEffect, so a
+// new reagent (potassium, iodine, ...) on a pump is configuration only.
+// Source: RTDB settings/reagents, cached in NVS ("reagents"/"reg"). Built-in
+// defaults are the kalk / All-For-Reef / Mg set this doser shipped with.
+//   settings/reagents = { "<name>": { "pump": 1..4 (0 = not fitted),
+//                                     "alk": x, "ca": x, "mg": x, "aux": x,
+//                                     "raisesPh": bool } }
+// "aux" is whatever the aux test field measures (RTDB tests/<id>/aux).
+
+const int   REAGENT_MAX         = 16;
+const int   REAGENT_NAME_LEN    = 16;
+const float REAGENT_BASE_TANK_L = 1135.6f;        // 300g
+const uint32_t REAGENT_MAGIC    = 0x52474E54UL;   // "RGNT"
+
+enum ChemParam : uint8_t { PARAM_ALK, PARAM_CA, PARAM_MG, PARAM_AUX, PARAM_COUNT };
+static const char* const PARAM_NAMES[PARAM_COUNT] = {"alk", "ca", "mg", "aux"};
+
+struct Reagent {
+  char    name[REAGENT_NAME_LEN];
+  uint8_t pump;                  // 1..4, 0 = registered but not fitted
+  uint8_t raisesPh;              // kalk-like: the pH prior steers alk toward these
+  uint8_t reserved[2];
+  float   effect[PARAM_COUNT];   // rise per ml in REAGENT_BASE_TANK_L
+};
+
+struct ReagentStore {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t reserved;
+  Reagent  r[REAGENT_MAX];
+  uint32_t crc;                  // over everything above
+};
+
+static const Reagent REAGENT_DEFAULTS[] = {
+  //  name    pump  pH   res     alk      ca       mg      aux
+  {"kalk",    1,    1, {0, 0}, {0.00010f, 0.00070f, 0.0f,   0.0f}},   // saturated kalkwasser
+  {"afr",     2,    0, {0, 0}, {0.0052f,  0.037f,   0.006f, 0.0f}},   // Tropic Marin All-For-Reef
+  {"mg",      3,    0, {0, 0}, {0.0f,     0.0f,     0.20f,  0.0f}},   // magnesium-only
+  {"aux",     4,    0, {0, 0}, {0.0f,     0.0f,     0.0f,   0.0f}},   // pump 4: set its effect to dose it
+};
+
+Reagent reagents[REAGENT_MAX];
+int     reagentCount = 0;
+RTC_NOINIT_ATTR ReagentStore reagentRtc;   // mirror of the registry, read instead of NVS after a warm reset
+float   reagentPumpEffect[4][PARAM_COUNT];   // per ml in this tank, by pump - 1
+int     reagentOnPump[4] = {-1, -1, -1, -1}; // registry index, -1 = none
+
+static void reagentLoadDefaults() {
+  memset(reagents, 0, sizeof(reagents));
+  reagentCount = sizeof(REAGENT_DEFAULTS) / sizeof(REAGENT_DEFAULTS[0]);
+  memcpy(reagents, REAGENT_DEFAULTS, sizeof(REAGENT_DEFAULTS));
+}
+
+// Per-pump effects for the current tank volume. One reagent per pump; a later
+// entry naming a taken pump is ignored.
+void reagentRebuildMatrix() {
+  const float scale = (TANK_VOLUME_L > 0.0f) ? REAGENT_BASE_TANK_L / TANK_VOLUME_L : 1.0f;
+  memset(reagentPumpEffect, 0, sizeof(reagentPumpEffect));
+  for (int p = 0; p < 4; p++) reagentOnPump[p] = -1;
+  for (int i = 0; i < reagentCount; i++) {
+    const int p = reagents[i].pump;
+    if (p < 1 || p > 4) continue;
+    if (reagentOnPump[p - 1] >= 0) {
+      Serial.printf("Reagents: %s ignored, pump %d already has %s\n",
+                    reagents[i].name, p, reagents[reagentOnPump[p - 1]].name);
+      continue;
+    }
+    reagentOnPump[p - 1] = i;
+    for (int k = 0; k < PARAM_COUNT; k++) reagentPumpEffect[p - 1][k] = reagents[i].effect[k] * scale;
+  }
+}
+
+float reagentEffectPerMl(int pump, int param) {
+  if (pump < 1 || pump > 4 || param < 0 || param >= PARAM_COUNT) return 0.0f;
+  return reagentPumpEffect[pump - 1][param];
+}
+
+static bool reagentStoreValid(const ReagentStore& st) {
+  return st.magic == REAGENT_MAGIC && st.count <= REAGENT_MAX &&
+         st.crc == crc32Bytes(&st, offsetof(ReagentStore, crc));
+}
+
+static void reagentCapture(ReagentStore& st) {
+  st = {};
+  st.magic = REAGENT_MAGIC;
+  st.count = (uint16_t)reagentCount;
+  memcpy(st.r, reagents, sizeof(reagents));
+  st.crc = crc32Bytes(&st, offsetof(ReagentStore, crc));
+}
 
-// ---------- TROPIC MARIN ALL-FOR-REEF ----------
-float DKH_PER_ML_AFR_TANK     = 0.0052f;    // +0.0052 dKH/ml in 300g
-float CA_PPM_PER_ML_AFR_TANK  = 0.037f;     // +0.037 ppm Ca/ml
-float MG_PPM_PER_ML_AFR_TANK  = 0.006f;     // +0.006 ppm Mg/ml
+// Boot: RTC mirror after a warm reset, else the NVS copy if valid, else the built-in set.
+void reagentLoad() {
+  const char* src = "RTC";
+  ReagentStore st;
+  bool ok = rtcWarmBoot && reagentStoreValid(reagentRtc);
+  if (ok) {
+    st = reagentRtc;
+  } else {
+    src = "NVS";
+    NvsPrefs prefs;
+    if (prefs.begin("reagents", true)) {
+      ok = prefs.getBytes("reg", &st, sizeof(st)) == sizeof(st) && reagentStoreValid(st);
+      prefs.end();
+    }
+  }
+  if (ok) {
+    memcpy(reagents, st.r, sizeof(reagents));
+    reagentCount = st.count;
+    for (int i = 0; i < reagentCount; i++) reagents[i].name[REAGENT_NAME_LEN - 1] = 0;
+  } else {
+    src = "defaults";
+    reagentLoadDefaults();
+  }
+  reagentCapture(reagentRtc);
+  Serial.printf("Reagents: %d registered (%s)\n", reagentCount, src);
+}
 
-// ---------- MAGNESIUM-ONLY ----------
-float MG_PPM_PER_ML_MG_TANK   = 0.20f;      // +0.20 ppm Mg/ml
+static bool reagentSave() {
+  ReagentStore st;
+  reagentCapture(st);
+  reagentRtc = st;
 
-// ---------- PUMP 4 (TBD / AUX) ----------
-float TBD_PPM_PER_ML_TANK     = 0.00f;
+  NvsPrefs prefs;
+  if (!prefs.begin("reagents", false)) {
+    Serial.println("Prefs: failed to open reagents (write)");
+    return false;
+  }
+  const bool ok = prefs.putBytes("reg", &st, sizeof(st)) == sizeof(st);
+  prefs.end();
+  return ok;
+}
 
 // ===================== DOSING CONFIG & TEST DATA =====================
 
 struct TestPoint {
-  uint32_t t;  // seconds since boot (for graph; not wall time)
+  uint32_t t;  // test time, seconds since epoch (RTDB "timestamp" / 1000)
   float ca;
   float alk;
   float mg;
@@ -315,93 +881,16 @@ float MAX_TBD_ML_PER_DAY   = 40.0f;    // 40 ml/day max Mg
 // SAFETY: throttle dosing if no tests for a while
 uint32_t lastSafetyBackoffTs = 0;
 
-// Persist AI dosing plan (ml/day) across reboots/OTA
-void loadDosingFromPrefs() {
-  if (!dosingPrefs.begin("dosing", true)) {
-    Serial.println("Prefs: failed to open dosing (read)");
-    return;
-  }
-
-  dosing.ml_per_day_kalk = dosingPrefs.getFloat("kalk", dosing.ml_per_day_kalk);
-  dosing.ml_per_day_afr  = dosingPrefs.getFloat("afr",  dosing.ml_per_day_afr);
-  dosing.ml_per_day_mg   = dosingPrefs.getFloat("mg",   dosing.ml_per_day_mg);
-  dosing.ml_per_day_tbd   = dosingPrefs.getFloat("tbd",   dosing.ml_per_day_tbd);
-
-  dosingPrefs.end();
-
-  Serial.print("Prefs: loaded dosing KALK=");
-  Serial.print(dosing.ml_per_day_kalk);
-  Serial.print(" AFR=");
-  Serial.print(dosing.ml_per_day_afr);
-  Serial.print(" MG=");
-  Serial.println(dosing.ml_per_day_mg);
-}
-
 // Clears persisted pending volumes so plan/schedule changes don't overdose.
 void clearPendingBuckets(const char* why) {
-  Preferences prefs;
-  if (!prefs.begin("doser-buckets", false)) {
-    Serial.println("Prefs: failed to open doser-buckets (clear)");
-    return;
-  }
-  prefs.putFloat("p_kalk", 0.0f);
-  prefs.putFloat("p_afr",  0.0f);
-  prefs.putFloat("p_mg",   0.0f);
-  prefs.putFloat("p_tbd",  0.0f);
-  prefs.end();
-
   pendingKalkMl = pendingAfrMl = pendingMgMl = pendingTbdMl = 0.0f;
+  configCommit();
+  wsPublishPending();
 
   Serial.print("Pending buckets CLEARED: ");
   Serial.println(why ? why : "");
 }
 
-
-void initBucketPrefs() {
-  Preferences prefs;
-  if (!prefs.begin("doser-buckets", false)) {
-    Serial.println("Prefs: failed to open doser-buckets (write)");
-    return;
-  }
-
-  // Create keys if missing (prevents NOT_FOUND spam)
-  if (!prefs.isKey("p_kalk")) prefs.putFloat("p_kalk", 0.0f);
-  if (!prefs.isKey("p_afr"))  prefs.putFloat("p_afr",  0.0f);
-  if (!prefs.isKey("p_mg"))   prefs.putFloat("p_mg",   0.0f);
-  if (!prefs.isKey("p_tbd"))  prefs.putFloat("p_tbd",  0.0f);
-
-  prefs.end();
-}
-
-// ===================== FLOW CALIBRATION (NVS PREFS) =====================
-// Persist calibrated pump flow rates so they survive reboots.
-// Keys: fk, fa, fm, fx
-void loadFlowFromPrefs() {
-  if (!dosingPrefs.begin("flow", true)) {
-    Serial.println("Prefs: failed to open flow (read)");
-    return;
-  }
-
-  FLOW_KALK_ML_PER_MIN = dosingPrefs.getFloat("fk", FLOW_KALK_ML_PER_MIN);
-  FLOW_AFR_ML_PER_MIN  = dosingPrefs.getFloat("fa", FLOW_AFR_ML_PER_MIN);
-  FLOW_MG_ML_PER_MIN   = dosingPrefs.getFloat("fm", FLOW_MG_ML_PER_MIN);
-  FLOW_TBD_ML_PER_MIN  = dosingPrefs.getFloat("fx", FLOW_TBD_ML_PER_MIN);
-  FLOW_AUX_ML_PER_MIN = FLOW_TBD_ML_PER_MIN; // alias for legacy code
-
-  dosingPrefs.end();
-
-  Serial.print("Prefs: loaded flow KALK=");
-  Serial.print(FLOW_KALK_ML_PER_MIN);
-  Serial.print(" AFR=");
-  Serial.print(FLOW_AFR_ML_PER_MIN);
-  Serial.print(" MG=");
-  Serial.print(FLOW_MG_ML_PER_MIN);
-  Serial.print(" AUX=");
-  Serial.println(FLOW_TBD_ML_PER_MIN);
-}
-
-
-
 static void validateFlow(const char* name, float &flow, float fallback) {
   // Reasonable range for typical dosing pumps (ml/min). Adjust if needed.
   if (!isfinite(flow) || flow < 30.0f || flow > 5000.0f) {
@@ -410,51 +899,34 @@ static void validateFlow(const char* name, float &flow, float fallback) {
   }
 }
 
-// Forward-declared here; implementation is below dosing schedule globals.
+// ===================== TEST HISTORY FOR GRAPHS =====================
 
+// Ring buffer: historyHead counts every point ever pushed, the oldest live point
+// is historyHead - historyCount. historyAt(0) is the oldest, historyAt(count-1) the newest.
+const int MAX_HISTORY = 64;
+TestPoint historyBuf[MAX_HISTORY];
+int historyCount = 0;
+uint32_t historyHead = 0;
 
-void saveFlowToPrefs() {
-  if (!dosingPrefs.begin("flow", false)) {
-    Serial.println("Prefs: failed to open flow (write)");
-    return;
-  }
+// The async web server task reads history while loop() appends to it.
+SemaphoreHandle_t historyMutex = nullptr;
 
-  dosingPrefs.putFloat("fk", FLOW_KALK_ML_PER_MIN);
-  dosingPrefs.putFloat("fa", FLOW_AFR_ML_PER_MIN);
-  dosingPrefs.putFloat("fm", FLOW_MG_ML_PER_MIN);
-  dosingPrefs.putFloat("fx", FLOW_TBD_ML_PER_MIN);
+struct HistoryLock {
+  HistoryLock()  { if (historyMutex) xSemaphoreTake(historyMutex, portMAX_DELAY); }
+  ~HistoryLock() { if (historyMutex) xSemaphoreGive(historyMutex); }
+};
 
-  dosingPrefs.end();
+uint32_t historyOldestSeq() {
+  return historyHead - (uint32_t)historyCount;
 }
 
-void saveDosingToPrefs() {
-  if (!dosingPrefs.begin("dosing", false)) {
-    Serial.println("Prefs: failed to open dosing (write)");
-    return;
-  }
-
-  dosingPrefs.putFloat("kalk", dosing.ml_per_day_kalk);
-  dosingPrefs.putFloat("afr",  dosing.ml_per_day_afr);
-  dosingPrefs.putFloat("mg",   dosing.ml_per_day_mg);
-  dosingPrefs.putFloat("tbd",   dosing.ml_per_day_tbd);
-
-  dosingPrefs.end();
-
-  Serial.print("Prefs: saved dosing KALK=");
-  Serial.print(dosing.ml_per_day_kalk);
-  Serial.print(" AFR=");
-  Serial.print(dosing.ml_per_day_afr);
-  Serial.print(" MG=");
-  Serial.println(dosing.ml_per_day_mg);
+const TestPoint& historyBySeq(uint32_t seq) {
+  return historyBuf[seq % MAX_HISTORY];
 }
 
-
-
-// ===================== TEST HISTORY FOR GRAPHS =====================
-
-const int MAX_HISTORY = 64;
-TestPoint historyBuf[MAX_HISTORY];
-int historyCount = 0;
+const TestPoint& historyAt(int i) {
+  return historyBySeq(historyOldestSeq() + (uint32_t)i);
+}
 
 TestPoint lastTest    = {0, 0, 0, 0, 0};
 TestPoint currentTest = {0, 0, 0, 0, 0};
@@ -507,6 +979,26 @@ struct DoseScheduleCfg {
 };
 DoseScheduleCfg doseScheduleCfg;
 
+// Time-of-day profile per pump (kalk, afr, mg, tbd): 24 hourly weights, any scale.
+// A slot gets weight(its hour) / sum(weights of all active slots) of the daily volume,
+// so the day total is unchanged. All zero (the default) means uniform.
+// Set under settings/doseSchedule: "profile": {"kalk":[24 numbers], ...}
+float doseProfile[4][24] = {};
+float slotShare[4][MAX_DOSE_SLOTS];   // fraction of ml_per_day per slot, rebuilt with the slots
+
+// Outage catch-up policy (see OUTAGE CATCH-UP). Set under settings/doseSchedule:
+// "catchUp": {"enabled":true, "maxHours":24, "spreadSlots":4, "maxSlotFactor":1.0}
+struct CatchUpCfg {
+  bool  enabled       = true;
+  int   maxHours      = 24;     // older missed slots are written off
+  int   spreadSlots   = 4;      // replay the missed volume over this many slots
+  float maxSlotFactor = 1.0f;   // extra per slot <= this x an average slot share
+};
+CatchUpCfg catchUpCfg;
+uint32_t lastSlotEpoch = 0;            // when the last slot fired (epoch s), 0 = unknown
+float catchUpMl[4]       = {0, 0, 0, 0};   // still to replay, by pump - 1
+float catchUpPerSlotMl[4] = {0, 0, 0, 0};
+
 // --- schedule helper prototypes ---
 static int  clampInt(int v, int lo, int hi);
 static bool scheduleWraps(int startHour, int endHour);
@@ -515,6 +1007,328 @@ static int  windowStartYday(const tm& t, int startHour, int endHour);
 static void rebuildScheduleSlots();
 
 
+// ===================== CONFIG STORE (NVS, A/B) =====================
+// Everything we persist about dosing lives in one binary record: plan, flows,
+// schedule, tank volume, pending buckets and the test cursor. Boot is one read,
+// every save is one blob write.
+//
+// Two copies ("config"/"a" and "config"/"b") are written alternately; each has a
+// generation counter and a CRC over its payload. Load takes the newest valid one,
+// so a write torn by a reset falls back to the previous copy.
+// The payload is append-only: a newer firmware reading an older (shorter) record
+// keeps its defaults for the fields that weren't there yet, and an older firmware
+// (after a downgrade or OTA rollback) reads the prefix it knows of a longer one.
+// Since v4 the CRC covers the header too, so payloadSize can be trusted.
+// On first boot after the upgrade the legacy "dosing", "flow", "doser-buckets"
+// and "testsync" namespaces are migrated; they are only erased once the image
+// is confirmed (configDropLegacy()), so a rollback still finds them.
+
+const uint32_t CONFIG_MAGIC   = 0x44434647UL;   // "DCFG"
+const uint16_t CONFIG_VERSION = 4;   // 2: doseProfile, 3: catch-up, 4: CRC covers the header
+const size_t   CONFIG_MAX_BYTES = 2048;   // largest record a reader accepts (newer firmware included)
+
+struct ConfigPayload {
+  float    planMlPerDay[4];    // kalk, afr, mg, tbd
+  float    flowMlPerMin[4];
+  float    pendingMl[4];
+  float    tankVolumeL;
+  uint8_t  schedEnabled;
+  uint8_t  schedStartHour;
+  uint8_t  schedEndHour;
+  uint8_t  reserved0;
+  uint16_t schedEveryMin;
+  uint16_t reserved1;
+  uint64_t schedUpdatedAt;
+  uint64_t testCursorMs;
+  float    doseProfile[4][24];  // v2
+  uint32_t lastSlotEpoch;      // v3
+  uint8_t  catchUpEnabled;
+  uint8_t  catchUpSpreadSlots;
+  uint16_t catchUpMaxHours;
+  float    catchUpMaxSlotFactor;
+  float    catchUpMl[4];
+  float    catchUpPerSlotMl[4];
+};
+
+struct ConfigHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t payloadSize;
+  uint32_t generation;
+  uint32_t crc;                // v4+: header fields above, then payloadSize bytes of payload
+};
+
+struct ConfigRecord {
+  ConfigHeader  hdr;
+  ConfigPayload payload;
+};
+
+uint32_t      configGeneration = 0;
+char          configSlot       = 'a';   // slot holding the newest copy
+bool          configUnreadable = false; // records on flash, none this image could read
+ConfigPayload configCommitted  = {};    // what's on flash, to skip no-op writes
+
+// Copy of the newest record in RTC memory; a warm reset loads it instead of NVS.
+RTC_NOINIT_ATTR ConfigRecord configRtc;
+RTC_NOINIT_ATTR char         configRtcSlot;
+
+static void configCapture(ConfigPayload& p) {
+  p = {};
+  p.planMlPerDay[0] = dosing.ml_per_day_kalk;
+  p.planMlPerDay[1] = dosing.ml_per_day_afr;
+  p.planMlPerDay[2] = dosing.ml_per_day_mg;
+  p.planMlPerDay[3] = dosing.ml_per_day_tbd;
+  p.flowMlPerMin[0] = FLOW_KALK_ML_PER_MIN;
+  p.flowMlPerMin[1] = FLOW_AFR_ML_PER_MIN;
+  p.flowMlPerMin[2] = FLOW_MG_ML_PER_MIN;
+  p.flowMlPerMin[3] = FLOW_TBD_ML_PER_MIN;
+  p.pendingMl[0]    = pendingKalkMl;
+  p.pendingMl[1]    = pendingAfrMl;
+  p.pendingMl[2]    = pendingMgMl;
+  p.pendingMl[3]    = pendingTbdMl;
+  p.tankVolumeL     = TANK_VOLUME_L;
+  p.schedEnabled    = doseScheduleCfg.enabled ? 1 : 0;
+  p.schedStartHour  = (uint8_t)doseScheduleCfg.startHour;
+  p.schedEndHour    = (uint8_t)doseScheduleCfg.endHour;
+  p.schedEveryMin   = (uint16_t)doseScheduleCfg.everyMin;
+  p.schedUpdatedAt  = doseScheduleCfg.updatedAt;
+  p.testCursorMs    = lastRemoteTestTimestampMs;
+  memcpy(p.doseProfile, doseProfile, sizeof(doseProfile));
+  p.lastSlotEpoch        = lastSlotEpoch;
+  p.catchUpEnabled       = catchUpCfg.enabled ? 1 : 0;
+  p.catchUpSpreadSlots   = (uint8_t)catchUpCfg.spreadSlots;
+  p.catchUpMaxHours      = (uint16_t)catchUpCfg.maxHours;
+  p.catchUpMaxSlotFactor = catchUpCfg.maxSlotFactor;
+  memcpy(p.catchUpMl, catchUpMl, sizeof(catchUpMl));
+  memcpy(p.catchUpPerSlotMl, catchUpPerSlotMl, sizeof(catchUpPerSlotMl));
+}
+
+static void configApply(const ConfigPayload& p) {
+  dosing.ml_per_day_kalk    = p.planMlPerDay[0];
+  dosing.ml_per_day_afr     = p.planMlPerDay[1];
+  dosing.ml_per_day_mg      = p.planMlPerDay[2];
+  dosing.ml_per_day_tbd     = p.planMlPerDay[3];
+  FLOW_KALK_ML_PER_MIN      = p.flowMlPerMin[0];
+  FLOW_AFR_ML_PER_MIN       = p.flowMlPerMin[1];
+  FLOW_MG_ML_PER_MIN        = p.flowMlPerMin[2];
+  FLOW_TBD_ML_PER_MIN       = p.flowMlPerMin[3];
+  FLOW_AUX_ML_PER_MIN       = FLOW_TBD_ML_PER_MIN; // alias for legacy code
+  pendingKalkMl             = p.pendingMl[0];
+  pendingAfrMl              = p.pendingMl[1];
+  pendingMgMl               = p.pendingMl[2];
+  pendingTbdMl              = p.pendingMl[3];
+  if (p.tankVolumeL > 0.0f) TANK_VOLUME_L = p.tankVolumeL;
+  doseScheduleCfg.enabled   = p.schedEnabled != 0;
+  doseScheduleCfg.startHour = clampInt(p.schedStartHour, 0, 23);
+  doseScheduleCfg.endHour   = clampInt(p.schedEndHour,   0, 23);
+  doseScheduleCfg.everyMin  = clampInt(p.schedEveryMin,  1, 240);
+  doseScheduleCfg.updatedAt = p.schedUpdatedAt;
+  lastRemoteTestTimestampMs = p.testCursorMs;
+  memcpy(doseProfile, p.doseProfile, sizeof(doseProfile));
+  lastSlotEpoch             = p.lastSlotEpoch;
+  catchUpCfg.enabled        = p.catchUpEnabled != 0;
+  catchUpCfg.spreadSlots    = clampInt(p.catchUpSpreadSlots, 1, MAX_DOSE_SLOTS);
+  catchUpCfg.maxHours       = clampInt(p.catchUpMaxHours, 0, 72);
+  catchUpCfg.maxSlotFactor  = isfinite(p.catchUpMaxSlotFactor) ? min(4.0f, max(0.0f, p.catchUpMaxSlotFactor)) : 1.0f;
+  memcpy(catchUpMl, p.catchUpMl, sizeof(catchUpMl));
+  memcpy(catchUpPerSlotMl, p.catchUpPerSlotMl, sizeof(catchUpPerSlotMl));
+}
+
+static uint32_t configRecordCrc(const ConfigHeader& h, const void* payload) {
+  if (h.version < 4) return crc32Bytes(payload, h.payloadSize);   // payload only
+  return crc32Bytes(payload, h.payloadSize, crc32Bytes(&h, offsetof(ConfigHeader, crc)));
+}
+
+// Reads one slot; on success fills `p` and `gen`. Defaults are kept past an older
+// (shorter) payload; the tail of a newer (longer) one is ignored.
+static bool configReadSlot(Preferences& prefs, const char* key, ConfigPayload& p, uint32_t& gen) {
+  const size_t len = prefs.getBytesLength(key);
+  if (len < sizeof(ConfigHeader) || len > CONFIG_MAX_BYTES) return false;
+  uint8_t* buf = (uint8_t*)malloc(len);
+  if (!buf) return false;
+  bool ok = prefs.getBytes(key, buf, len) == len;
+
+  ConfigHeader h;
+  memcpy(&h, buf, sizeof(h));
+  const uint8_t* payload = buf + sizeof(ConfigHeader);
+  ok = ok && h.magic == CONFIG_MAGIC && h.payloadSize == len - sizeof(ConfigHeader) &&
+       configRecordCrc(h, payload) == h.crc;
+  if (ok) {
+    memcpy(&p, payload, min((size_t)h.payloadSize, sizeof(ConfigPayload)));
+    gen = h.generation;
+  }
+  free(buf);
+  return ok;
+}
+
+// Persist the current settings. One blob write into the older slot; no-op if unchanged.
+bool configCommit() {
+  rtcSaveRuntime();   // buckets / cursor / catch-up, even if the flash write fails
+  ConfigRecord rec;
+  configCapture(rec.payload);
+  if (configGeneration != 0 && memcmp(&rec.payload, &configCommitted, sizeof(ConfigPayload)) == 0) return true;
+
+  rec.hdr.magic       = CONFIG_MAGIC;
+  rec.hdr.version     = CONFIG_VERSION;
+  rec.hdr.payloadSize = sizeof(ConfigPayload);
+  rec.hdr.generation  = configGeneration + 1;
+  rec.hdr.crc         = configRecordCrc(rec.hdr, &rec.payload);
+
+  const char target = (configSlot == 'a') ? 'b' : 'a';
+  const char key[2] = {target, 0};
+
+  NvsPrefs prefs;
+  if (!prefs.begin("config", false)) {
+    Serial.println("Prefs: failed to open config (write)");
+    return false;
+  }
+  const bool ok = prefs.putBytes(key, &rec, sizeof(rec)) == sizeof(rec);
+  prefs.end();
+  if (!ok) {
+    Serial.println("Prefs: config write failed");
+    return false;
+  }
+
+  configGeneration = rec.hdr.generation;
+  configSlot       = target;
+  configCommitted  = rec.payload;
+  configRtc        = rec;
+  configRtcSlot    = target;
+  return true;
+}
+
+static void configMirrorToRtc() {
+  if (configGeneration == 0) {         // nothing on flash yet: defaults, not configCommitted
+    configRtc.hdr.magic = 0;
+    return;
+  }
+  configRtc.hdr.magic       = CONFIG_MAGIC;
+  configRtc.hdr.version     = CONFIG_VERSION;
+  configRtc.hdr.payloadSize = sizeof(ConfigPayload);
+  configRtc.hdr.generation  = configGeneration;
+  configRtc.payload         = configCommitted;
+  configRtc.hdr.crc         = configRecordCrc(configRtc.hdr, &configRtc.payload);
+  configRtcSlot             = configSlot;
+}
+
+// Warm reset: the RTC copy is the record last written to flash.
+static bool configLoadRtc() {
+  const ConfigHeader& h = configRtc.hdr;
+  if (h.magic != CONFIG_MAGIC || h.version != CONFIG_VERSION || h.payloadSize != sizeof(ConfigPayload) ||
+      (configRtcSlot != 'a' && configRtcSlot != 'b') ||
+      configRecordCrc(h, &configRtc.payload) != h.crc) {
+    return false;
+  }
+  configApply(configRtc.payload);
+  configGeneration = h.generation;
+  configSlot       = configRtcSlot;
+  configCommitted  = configRtc.payload;
+  return true;
+}
+
+static const char* const CONFIG_LEGACY_NAMESPACES[] = {"dosing", "flow", "doser-buckets", "testsync"};
+
+// One-time import from the per-key namespaces used before the config blob. The
+// old keys stay until configDropLegacy(): firmware we might roll back to reads them.
+static bool configMigrateLegacy() {
+  bool found = false;
+  NvsPrefs prefs;
+
+  if (prefs.begin("dosing", true)) {
+    found |= prefs.isKey("kalk");
+    dosing.ml_per_day_kalk = prefs.getFloat("kalk", dosing.ml_per_day_kalk);
+    dosing.ml_per_day_afr  = prefs.getFloat("afr",  dosing.ml_per_day_afr);
+    dosing.ml_per_day_mg   = prefs.getFloat("mg",   dosing.ml_per_day_mg);
+    dosing.ml_per_day_tbd  = prefs.getFloat("tbd",  dosing.ml_per_day_tbd);
+    prefs.end();
+  }
+  if (prefs.begin("flow", true)) {
+    found |= prefs.isKey("fk");
+    FLOW_KALK_ML_PER_MIN = prefs.getFloat("fk", FLOW_KALK_ML_PER_MIN);
+    FLOW_AFR_ML_PER_MIN  = prefs.getFloat("fa", FLOW_AFR_ML_PER_MIN);
+    FLOW_MG_ML_PER_MIN   = prefs.getFloat("fm", FLOW_MG_ML_PER_MIN);
+    FLOW_TBD_ML_PER_MIN  = prefs.getFloat("fx", FLOW_TBD_ML_PER_MIN);
+    FLOW_AUX_ML_PER_MIN  = FLOW_TBD_ML_PER_MIN;
+    prefs.end();
+  }
+  if (prefs.begin("doser-buckets", true)) {
+    found |= prefs.isKey("p_kalk");
+    pendingKalkMl = prefs.getFloat("p_kalk", 0.0f);
+    pendingAfrMl  = prefs.getFloat("p_afr",  0.0f);
+    pendingMgMl   = prefs.getFloat("p_mg",   0.0f);
+    pendingTbdMl  = prefs.getFloat("p_tbd",  0.0f);
+    prefs.end();
+  }
+  if (prefs.begin("testsync", true)) {
+    found |= prefs.isKey("cursor");
+    lastRemoteTestTimestampMs = prefs.getULong64("cursor", 0);
+    prefs.end();
+  }
+  if (!found) return false;
+  if (!configCommit()) return false;
+  Serial.println("Prefs: migrated legacy dosing/flow/bucket/cursor keys into config");
+  return true;
+}
+
+// Erase the pre-blob namespaces. Only once the running image is confirmed
+// (no rollback pending), see otaServiceValidation().
+void configDropLegacy() {
+  if (configGeneration == 0) return;   // nothing saved in the blob yet
+  NvsPrefs prefs;
+  for (const char* ns : CONFIG_LEGACY_NAMESPACES) {
+    if (!prefs.begin(ns, false)) continue;
+    const bool any = prefs.isKey("kalk") || prefs.isKey("fk") || prefs.isKey("p_kalk") || prefs.isKey("cursor");
+    if (any) {
+      prefs.clear();
+      Serial.printf("Prefs: dropped legacy namespace %s\n", ns);
+    }
+    prefs.end();
+  }
+}
+
+// Boot: RTC copy after a warm reset, else the newest valid flash copy (or migrate /
+// start from defaults).
+void configLoad() {
+  if (rtcWarmBoot && configLoadRtc()) {
+    Serial.printf("Prefs: config gen %lu from RTC (warm reset)\n", (unsigned long)configGeneration);
+    return;
+  }
+
+  ConfigPayload a, b;
+  configCapture(a);          // defaults for fields an older record lacks
+  b = a;
+  uint32_t genA = 0, genB = 0;
+  bool okA = false, okB = false;
+
+  bool present = false;
+  NvsPrefs prefs;
+  if (prefs.begin("config", true)) {
+    present = prefs.isKey("a") || prefs.isKey("b");
+    okA = configReadSlot(prefs, "a", a, genA);
+    okB = configReadSlot(prefs, "b", b, genB);
+    prefs.end();
+  }
+  configUnreadable = present && !okA && !okB;
+
+  if (okA || okB) {
+    const bool useB = okB && (!okA || (int32_t)(genB - genA) > 0);
+    configApply(useB ? b : a);
+    configGeneration = useB ? genB : genA;
+    configSlot       = useB ? 'b' : 'a';
+    configCapture(configCommitted);
+    if (!okA || !okB) Serial.println("Prefs: one config copy invalid, using the other");
+  } else if (!configMigrateLegacy()) {
+    Serial.println("Prefs: no saved config, using defaults");
+  }
+  configMirrorToRtc();
+
+  Serial.printf("Prefs: config gen %lu plan KALK=%.2f AFR=%.2f MG=%.2f flow KALK=%.2f AFR=%.2f MG=%.2f AUX=%.2f\n",
+                (unsigned long)configGeneration,
+                dosing.ml_per_day_kalk, dosing.ml_per_day_afr, dosing.ml_per_day_mg,
+                FLOW_KALK_ML_PER_MIN, FLOW_AFR_ML_PER_MIN, FLOW_MG_ML_PER_MIN, FLOW_TBD_ML_PER_MIN);
+}
+
+
 // Time validity guard: avoid dosing before NTP sync is real.
 // tm_year is years since 1900. 123 == 2023.
 /*bool isTimeValid(const tm& t) {
@@ -595,13 +1409,46 @@ static int windowStartYday(const tm& t, int startHour, int endHour) {
 }
 
 // Build DOSE_HOURS / DOSE_MINUTES arrays from doseScheduleCfg (or legacy defaults).
-static void rebuildScheduleSlots() {
-  // default legacy schedule if not enabled
-  if (!doseScheduleCfg.enabled) {
+// doseProfile as the settings/doseSchedule "profile" object; null when all uniform.
+String doseProfileJson() {
+  static const char* const keys[4] = {"kalk", "afr", "mg", "tbd"};
+  String json;
+  for (int p = 0; p < 4; p++) {
+    bool set = false;
+    for (int h = 0; h < 24 && !set; h++) set = doseProfile[p][h] > 0.0f;
+    if (!set) continue;
+    json += json.length() ? ",\"" : "{\"";
+    json += String(keys[p]) + "\":[";
+    for (int h = 0; h < 24; h++) {
+      if (h) json += ",";
+      json += String(doseProfile[p][h], 3);
+    }
+    json += "]";
+  }
+  return json.length() ? json + "}" : String("null");
+}
+
+// Precompute each slot's share of the daily volume from doseProfile (O(1) per slot later).
+static void rebuildSlotShares() {
+  const int n = max(1, DOSE_SLOTS_PER_DAY);
+  for (int p = 0; p < 4; p++) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) sum += max(0.0f, doseProfile[p][DOSE_HOURS[i] % 24]);
+    for (int i = 0; i < n; i++) {
+      slotShare[p][i] = (sum > 0.0f) ? max(0.0f, doseProfile[p][DOSE_HOURS[i] % 24]) / sum
+                                     : 1.0f / (float)n;
+    }
+  }
+}
+
+static void rebuildScheduleSlots() {
+  // default legacy schedule if not enabled
+  if (!doseScheduleCfg.enabled) {
     DOSE_SLOTS_PER_DAY = 3;
     DOSE_HOURS[0] = 9;  DOSE_MINUTES[0] = 30;
     DOSE_HOURS[1] = 12; DOSE_MINUTES[1] = 30;
     DOSE_HOURS[2] = 15; DOSE_MINUTES[2] = 30;
+    rebuildSlotShares();
     return;
   }
 
@@ -634,6 +1481,7 @@ static void rebuildScheduleSlots() {
     // Do NOT reset the 'done' status here!
   }
 
+  rebuildSlotShares();
   Serial.printf("DoseSchedule rebuilt: %d slots total.\n", DOSE_SLOTS_PER_DAY);
 }
 
@@ -641,7 +1489,7 @@ static void rebuildScheduleSlots() {
 // When time becomes valid, mark any already-passed slots as done.
 void primeDoseSlotsForToday() {
   struct tm t;
-  if (!getLocalTime(&t)) {
+  if (!getLocalTime(&t, 0)) {
     Serial.println("WARN: cannot prime slots (no time yet)");
     return;
   }
@@ -680,6 +1528,7 @@ void primeDoseSlotsForToday() {
   }
 
   doseSlotsPrimed = true;
+  rtcSaveRuntime();
   Serial.printf("Dose slots primed for today (yday=%d, now=%02d:%02d:%02d)\n", t.tm_yday, t.tm_hour, t.tm_min, t.tm_sec);
 }
 
@@ -718,6 +1567,17 @@ float clampf(float v, float vmin, float vmax){
   return v;
 }
 
+// CRC-32 (IEEE, reflected) for records we persist in RTC memory / NVS.
+uint32_t crc32Bytes(const void* data, size_t len, uint32_t crc) {
+  const uint8_t* p = (const uint8_t*)data;
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1)));
+  }
+  return ~crc;
+}
+
 float adjustWithLimit(float current, float suggested){
   float maxChange = fabsf(current) * 0.15f;
   if(maxChange < 1.0f) maxChange = 1.0f;
@@ -754,12 +1614,10 @@ void updatePumpSchedules() {
 }
 }
 void pushHistory(const TestPoint& tp){
-  if(historyCount < MAX_HISTORY){
-    historyBuf[historyCount++] = tp;
-  } else {
-    for(int i=1;i<MAX_HISTORY;i++) historyBuf[i-1] = historyBuf[i];
-    historyBuf[MAX_HISTORY-1] = tp;
-  }
+  HistoryLock lock;
+  historyBuf[historyHead % MAX_HISTORY] = tp;
+  historyHead++;
+  if(historyCount < MAX_HISTORY) historyCount++;
 }
 
 
@@ -850,7 +1708,7 @@ void syncTimeFromFirebaseHeader() {
 
 String getLocalTimeString() {
   struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
+  if (!getLocalTime(&timeinfo, 0)) {
     return "time unknown";
   }
   char buf[32];
@@ -864,7 +1722,7 @@ String getLocalTimeString() {
 // Helper: get a best-effort timestamp in ms since epoch
 uint64_t getEpochMillis() {
   struct tm timeinfo;
-  if (getLocalTime(&timeinfo)) {
+  if (getLocalTime(&timeinfo, 0)) {
     time_t t = mktime(&timeinfo);
     if (t > 0) {
       return (uint64_t)t * 1000ULL;
@@ -874,6 +1732,10 @@ uint64_t getEpochMillis() {
   return (uint64_t)millis();
 }
 
+uint32_t epochSeconds() {
+  return (uint32_t)(getEpochMillis() / 1000ULL);
+}
+
 
 // ===================== ALERT / PUSH THROTTLING =====================
 // Prevent RTDB from filling up with duplicate alerts & pushes.
@@ -897,11 +1759,13 @@ static ThrottleEntry gThrottle[] = {
 static const size_t gThrottleCount = sizeof(gThrottle)/sizeof(gThrottle[0]);
 
 bool allowThrottled(const char* key, uint64_t cooldownMs) {
+  FirebaseLock lock;  // the boot network task pushes too
   uint64_t now = getEpochMillis();
   for (size_t i = 0; i < gThrottleCount; i++) {
     if (strcmp(gThrottle[i].key, key) == 0) {
       if (gThrottle[i].lastTs == 0 || (now - gThrottle[i].lastTs) >= cooldownMs) {
         gThrottle[i].lastTs = now;
+        rtcSaveThrottle();
         return true;
       }
       return false;
@@ -996,24 +1860,520 @@ bool firebasePushNotificationThrottled(const char* throttleKey,
 
 
 
-// ===================== SAFETY: CHEMISTRY-BASED CAPS =====================
+// ===================== LIVE TELEMETRY (WEBSOCKET /ws) =====================
+// Pushes dosing events to local dashboards as they happen. Frames are small JSON
+// arrays, first element is the event kind:
+//   ["hello",fw,estop,kalk,afr,mg,tbd]   on connect (current state)
+//   ["pon",pump,ml,sec]                  pump switched on (planned ml / seconds)
+//   ["poff",pump,ml,sec]                 pump switched off (delivered ml / seconds)
+//   ["pend",kalk,afr,mg,tbd]             pending bucket volumes (ml)
+//   ["slot",idx,epoch]                   dose slot fired
+//   ["estop",0|1,source]                 E-stop transition
+//   ["test",epoch,ca,alk,mg,ph]          new test result
+// Each client has a small bounded queue. State frames ("pend", "estop") replace an
+// older queued frame of the same kind; when the queue is full the oldest frame is
+// dropped, so a slow client always ends up with the newest state.
+// Dropped frames are counted in /metrics (doser_ws_frames_dropped_total).
 
-void enforceChemSafetyCaps() {
-  float alkRise =
-      dosing.ml_per_day_kalk * DKH_PER_ML_KALK_TANK +
-      dosing.ml_per_day_afr  * DKH_PER_ML_AFR_TANK;
+AsyncWebSocket ws("/ws");
+
+const int WS_MAX_CLIENTS    = 4;
+const int WS_QUEUE_LEN      = 8;
+const int WS_FRAME_MAX      = 72;
+
+enum WsFrameKind : uint8_t {
+  WSF_HELLO, WSF_PUMP_ON, WSF_PUMP_OFF, WSF_PENDING, WSF_SLOT, WSF_ESTOP, WSF_TEST,
+};
+
+struct WsFrame {
+  uint8_t kind;
+  char text[WS_FRAME_MAX];
+};
+
+struct WsClientQueue {
+  uint32_t id;          // 0 = unused
+  uint8_t  head;
+  uint8_t  count;
+  WsFrame  frames[WS_QUEUE_LEN];
+};
+
+WsClientQueue wsClients[WS_MAX_CLIENTS];
+portMUX_TYPE wsMux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool wsCoalesces(uint8_t kind) {
+  return kind == WSF_PENDING || kind == WSF_ESTOP;
+}
+
+// Caller holds wsMux.
+static void wsEnqueueLocked(WsClientQueue& q, uint8_t kind, const char* text) {
+  if (wsCoalesces(kind)) {
+    for (uint8_t i = 0; i < q.count; i++) {
+      WsFrame& f = q.frames[(q.head + i) % WS_QUEUE_LEN];
+      if (f.kind == kind) {
+        strlcpy(f.text, text, sizeof(f.text));
+        return;
+      }
+    }
+  }
+  if (q.count == WS_QUEUE_LEN) {        // full: drop the stalest frame
+    q.head = (q.head + 1) % WS_QUEUE_LEN;
+    q.count--;
+    metrics.wsFramesDropped.fetch_add(1, std::memory_order_relaxed);
+  }
+  WsFrame& f = q.frames[(q.head + q.count) % WS_QUEUE_LEN];
+  f.kind = kind;
+  strlcpy(f.text, text, sizeof(f.text));
+  q.count++;
+}
+
+// Queue a frame for every connected client. Safe from any task; never blocks on the socket.
+void wsPublish(uint8_t kind, const char* text) {
+  portENTER_CRITICAL(&wsMux);
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsClients[i].id) wsEnqueueLocked(wsClients[i], kind, text);
+  }
+  portEXIT_CRITICAL(&wsMux);
+}
+
+// Hands queued frames to the socket layer while it still has room; the rest wait
+// for the next call. Called from loop() and while a pump runs.
+void wsFlush() {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    for (;;) {
+      WsFrame frame;
+      uint32_t id;
+      portENTER_CRITICAL(&wsMux);
+      id = wsClients[i].id;
+      const bool have = id && wsClients[i].count;
+      if (have) frame = wsClients[i].frames[wsClients[i].head];
+      portEXIT_CRITICAL(&wsMux);
+      if (!have) break;
+
+      AsyncWebSocketClient* c = ws.client(id);
+      if (!c) break;                   // disconnect event will free the slot
+      if (!c->canSend()) break;        // backpressure: keep it queued
+      c->text(frame.text);
+
+      portENTER_CRITICAL(&wsMux);
+      if (wsClients[i].id == id && wsClients[i].count) {
+        wsClients[i].head = (wsClients[i].head + 1) % WS_QUEUE_LEN;
+        wsClients[i].count--;
+      }
+      portEXIT_CRITICAL(&wsMux);
+    }
+  }
+
+  static uint32_t lastCleanupMs = 0;
+  if ((uint32_t)(millis() - lastCleanupMs) >= 1000) {
+    lastCleanupMs = millis();
+    ws.cleanupClients(WS_MAX_CLIENTS);
+  }
+}
+
+void wsPublishPending() {
+  char buf[WS_FRAME_MAX];
+  snprintf(buf, sizeof(buf), "[\"pend\",%.2f,%.2f,%.2f,%.2f]",
+           pendingKalkMl, pendingAfrMl, pendingMgMl, pendingTbdMl);
+  wsPublish(WSF_PENDING, buf);
+}
+
+void wsPublishPump(bool on, int pin, float sec) {
+  const float ml = sec * pinFlowMlPerMin(pin) / 60.0f;
+  char buf[WS_FRAME_MAX];
+  snprintf(buf, sizeof(buf), "[\"%s\",%d,%.2f,%.1f]", on ? "pon" : "poff", pinToPumpNum(pin), ml, sec);
+  wsPublish(on ? WSF_PUMP_ON : WSF_PUMP_OFF, buf);
+}
+
+void wsPublishSlot(int idx) {
+  char buf[WS_FRAME_MAX];
+  snprintf(buf, sizeof(buf), "[\"slot\",%d,%lu]", idx, (unsigned long)epochSeconds());
+  wsPublish(WSF_SLOT, buf);
+}
+
+void wsPublishEstop(bool on, const char* source) {
+  char buf[WS_FRAME_MAX];
+  snprintf(buf, sizeof(buf), "[\"estop\",%d,\"%.24s\"]", on ? 1 : 0, source ? source : "");
+  wsPublish(WSF_ESTOP, buf);
+}
+
+void wsPublishTest(const TestPoint& p) {
+  char buf[WS_FRAME_MAX];
+  snprintf(buf, sizeof(buf), "[\"test\",%lu,%.0f,%.2f,%.0f,%.2f]",
+           (unsigned long)p.t, p.ca, p.alk, p.mg, p.ph);
+  wsPublish(WSF_TEST, buf);
+}
+
+// Runs in the AsyncTCP task.
+void onWsEvent(AsyncWebSocket* server, AsyncWebSocketClient* client, AwsEventType type,
+               void* arg, uint8_t* data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    char hello[WS_FRAME_MAX];
+    snprintf(hello, sizeof(hello), "[\"hello\",\"%s\",%d,%.2f,%.2f,%.2f,%.2f]",
+             FW_VERSION, globalEmergencyStop ? 1 : 0,
+             pendingKalkMl, pendingAfrMl, pendingMgMl, pendingTbdMl);
+
+    bool added = false;
+    portENTER_CRITICAL(&wsMux);
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (wsClients[i].id) continue;
+      wsClients[i].id = client->id();
+      wsClients[i].head = wsClients[i].count = 0;
+      wsEnqueueLocked(wsClients[i], WSF_HELLO, hello);
+      added = true;
+      break;
+    }
+    portEXIT_CRITICAL(&wsMux);
+    if (!added) client->close(1013, "too many clients");
+  } else if (type == WS_EVT_DISCONNECT) {
+    portENTER_CRITICAL(&wsMux);
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (wsClients[i].id == client->id()) wsClients[i].id = 0;
+    }
+    portEXIT_CRITICAL(&wsMux);
+  }
+  // Incoming data is ignored: commands go through /api/commands/*.
+}
+
+void registerWebSocket() {
+  ws.onEvent(onWsEvent);
+  server.addHandler(&ws);
+}
+
+
+// ===================== E-STOP FAST PATH =====================
+// Engaging the E-stop doesn't wait for the 10 s poll. Sources:
+//  - physical button on PIN_ESTOP_BUTTON (opt-in; GPIO interrupt, wired to GND,
+//    latched once the pump driver tick sees it still low ESTOP_BUTTON_DEBOUNCE_MS later)
+//  - RTDB stream on settings/killSwitch (own task + TLS connection)
+//  - local API (PUT /api/settings/killSwitch)
+//  - the 10 s poll, as a fallback when the stream is down
+// Every path sets the flag and then clears all pump pins with a single GPIO
+// register write. The pump driver watches the flag while running, stops early and
+// reports the partial run so callers can log the ml actually delivered.
+
+const int PIN_ESTOP_BUTTON = -1;   // -1 = no button fitted (33 on the reference board)
+const uint32_t ESTOP_BUTTON_DEBOUNCE_MS = 5;
+
+static const uint32_t PUMP_PIN_MASK =
+    (1UL << PIN_PUMP_KALK) | (1UL << PIN_PUMP_AFR) | (1UL << PIN_PUMP_MG) | (1UL << PIN_PUMP_TBD);
+
+volatile uint32_t estopEngagedMs    = 0;     // millis() when the flag was last raised
+volatile uint32_t estopEngageCount  = 0;     // bumped on every raise (the pump driver latches on it)
+volatile bool     estopButtonLatched = false; // set once the press is confirmed, consumed by loop()
+volatile uint32_t estopButtonEdgeMs  = 0;     // falling edge seen by the ISR, 0 = none pending
+const char* volatile estopNotifySource = nullptr;  // push notification owed (sent from loop)
+std::atomic<bool> estopReported{false};      // last state we logged / published
+std::atomic<int>  lastCloudKillSwitch{-1};   // last RTDB value acted on (-1 = none yet)
+
+// All pump outputs LOW in one write. ISR-safe.
+static inline void IRAM_ATTR pumpsAllOffFast() {
+  GPIO.out_w1tc = PUMP_PIN_MASK;
+}
+
+// Only notes the edge: a glitch on the line must not cut pumps the driver still
+// thinks are running. estopButtonConfirm() latches it if the level holds.
+void IRAM_ATTR estopButtonIsr() {
+  if (!estopButtonEdgeMs) estopButtonEdgeMs = millis() | 1;
+}
+
+// Pump driver tick (every 20 ms): latch a press that is still low after the debounce.
+void estopButtonConfirm(uint32_t now) {
+  const uint32_t edge = estopButtonEdgeMs;
+  if (!edge || now - edge < ESTOP_BUTTON_DEBOUNCE_MS) return;
+  estopButtonEdgeMs = 0;
+  if (digitalRead(PIN_ESTOP_BUTTON) != LOW) return;   // bounce or noise
+  globalEmergencyStop = true;
+  pumpsAllOffFast();
+  estopEngagedMs = millis();
+  estopEngageCount = estopEngageCount + 1;
+  estopButtonLatched = true;
+}
+
+// Single place that changes the E-stop state. Safe to call from any task (not
+// from an ISR): engaging forces every pump pin LOW first; no network I/O here.
+void setEmergencyStop(bool on, const char* source) {
+  if (on) {
+    globalEmergencyStop = true;
+    pumpsAllOffFast();
+    estopEngagedMs = millis();
+    estopEngageCount = estopEngageCount + 1;
+  } else {
+    globalEmergencyStop = false;
+  }
+  if (estopReported.exchange(on) != on) {
+    Serial.printf("!!! EMERGENCY STOP %s (%s) !!!\n", on ? "ACTIVATED" : "released", source);
+    wsPublishEstop(on, source);
+    if (on) estopNotifySource = source;
+  }
+}
+
+// RTDB killSwitch value from the stream or the poll. Acts on changes of the RTDB
+// value only, so a local E-stop isn't undone by a stale cloud value.
+void applyCloudKillSwitch(bool cloudStop, const char* source) {
+  if (pendingCloudMirror & MIRROR_KILL_SWITCH) return; // local change not written back yet
+  if (lastCloudKillSwitch.exchange(cloudStop) == (int)cloudStop) return;
+  setEmergencyStop(cloudStop, source);
+}
+
+// ---------- RTDB stream (server-sent events) ----------
+const uint32_t ESTOP_STREAM_IDLE_MS = 70000;  // RTDB sends keep-alive every 30 s
+
+// Parses `data: {"path":"/","data":true}` from a put/patch event.
+static void estopStreamHandleData(const String& data) {
+  StaticJsonDocument<128> doc;
+  if (deserializeJson(doc, data)) return;
+  JsonVariant v = doc["data"];
+  if (v.is<bool>()) applyCloudKillSwitch(v.as<bool>(), "firebase stream");
+  else if (v.isNull()) applyCloudKillSwitch(false, "firebase stream");
+}
+
+// One streaming session. Returns when the connection drops, idles out or is cancelled.
+static void estopStreamSession(WiFiClientSecure& client, String host) {
+  const String path = "/devices/" + String(DEVICE_ID) + "/settings/killSwitch.json";
+
+  bool streaming = false;
+  for (int redirects = 0; redirects < 3 && !streaming; redirects++) {
+    if (!client.connect(host.c_str(), 443)) return;
+    client.print("GET " + path + " HTTP/1.1\r\nHost: " + host +
+                 "\r\nAccept: text/event-stream\r\nConnection: keep-alive\r\n\r\n");
+
+    client.setTimeout(5000);
+    String status = client.readStringUntil('\n');
+    String location;
+    for (;;) {   // headers
+      String h = client.readStringUntil('\n');
+      h.trim();
+      if (h.length() == 0) break;
+      if (h.startsWith("Location:") || h.startsWith("location:")) location = h.substring(9);
+    }
+    if (status.indexOf(" 307") > 0 && location.length()) {
+      // RTDB may hand us to the shard that owns the node
+      client.stop();
+      location.trim();
+      const int s = location.indexOf("://");
+      if (s < 0) {
+        Serial.println("E-stop stream: bad redirect " + location);
+        return;
+      }
+      const int e = location.indexOf('/', s + 3);
+      host = (e < 0) ? location.substring(s + 3) : location.substring(s + 3, e);
+      continue;
+    }
+    if (status.indexOf(" 200") < 0) {
+      Serial.print("E-stop stream: ");
+      Serial.println(status);
+      client.stop();
+      return;
+    }
+    streaming = true;
+  }
+  if (!streaming) return;
+
+  Serial.println("E-stop stream: connected");
+  uint32_t lastRxMs = millis();
+  String event;
+  while (client.connected()) {
+    if (!client.available()) {
+      if ((uint32_t)(millis() - lastRxMs) > ESTOP_STREAM_IDLE_MS) break;
+      vTaskDelay(pdMS_TO_TICKS(20));
+      continue;
+    }
+    lastRxMs = millis();
+    String line = client.readStringUntil('\n');
+    line.trim();
+    if (line.startsWith("event:")) {
+      event = line.substring(6);
+      event.trim();
+      if (event == "cancel" || event == "auth_revoked") break;
+    } else if (line.startsWith("data:") && (event == "put" || event == "patch")) {
+      estopStreamHandleData(line.substring(5));
+    }
+  }
+  client.stop();
+  Serial.println("E-stop stream: disconnected");
+}
+
+void estopStreamTask(void*) {
+  WiFiClientSecure client;
+  client.setInsecure();
+  for (;;) {
+    if (WiFi.status() == WL_CONNECTED) estopStreamSession(client, String(firebaseHost()));
+    vTaskDelay(pdMS_TO_TICKS(5000));
+  }
+}
+
+void estopFastPathBegin() {
+  if (PIN_ESTOP_BUTTON >= 0) {
+    pinMode(PIN_ESTOP_BUTTON, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(PIN_ESTOP_BUTTON), estopButtonIsr, FALLING);
+  }
+  xTaskCreatePinnedToCore(estopStreamTask, "estopStream", 8192, nullptr, 2, nullptr, 0);
+}
+
+// loop(): finish what the ISR / other tasks can't do (logging, RTDB write-back, push).
+void serviceEstopEvents() {
+  if (estopButtonLatched) {
+    estopButtonLatched = false;
+    setEmergencyStop(true, "button");
+    pendingCloudMirror |= MIRROR_KILL_SWITCH;
+  }
+  const char* src = estopNotifySource;
+  if (src) {
+    estopNotifySource = nullptr;
+    firebasePushNotification("CRITICAL", "E-STOP ACTIVE",
+                             "All dosing pumps have been hard-disabled (" + String(src) + ").");
+  }
+}
+
+
+// ===================== PUMP GUARD (HARDWARE TIMER) =====================
+// Independent bound on pump on-time. A hardware timer interrupt samples the pump
+// output latches every PUMP_GUARD_TICK_MS, so it keeps working if loop() hangs in
+// an HTTP timeout, the WiFi stack or the pump driver itself. A channel trips when it is
+//  - on past the deadline pumpOn() armed (planned run + slack), or
+//  - on without being armed for longer than PUMP_GUARD_UNARMED_MS, or
+//  - on longer than its ceiling: MAX_*_ML_PER_DAY at the current flow. A run armed
+//    as calibration (into a cup) is bounded by CALIBRATE_MAX_SEC instead.
+// A trip clears every pump output and latches the E-stop; loop() logs, alerts and
+// mirrors it to RTDB. Worst-case overdose per run: ceiling + one tick.
+
+const uint32_t PUMP_GUARD_TICK_MS     = 100;
+const uint32_t PUMP_GUARD_SLACK_MS    = 2000;
+const uint32_t PUMP_GUARD_UNARMED_MS  = 1000;
+const int      CALIBRATE_MAX_SEC      = 300;
+
+struct PumpGuardChannel {
+  int pin;
+  volatile uint32_t deadlineTick;   // 0 = not armed
+  volatile uint32_t onTicks;        // consecutive ticks seen on
+  volatile uint32_t ceilingTicks;
+  volatile bool     calibrating;    // armed run uses CALIBRATE_CEILING_TICKS
+};
+
+PumpGuardChannel pumpGuard[4] = {
+  {PIN_PUMP_KALK, 0, 0, 0, false}, {PIN_PUMP_AFR, 0, 0, 0, false},
+  {PIN_PUMP_MG, 0, 0, 0, false},   {PIN_PUMP_TBD, 0, 0, 0, false},
+};
+const uint32_t CALIBRATE_CEILING_TICKS =
+    (uint32_t)((CALIBRATE_MAX_SEC * 1000UL + PUMP_GUARD_SLACK_MS) / PUMP_GUARD_TICK_MS);
+volatile uint32_t pumpGuardNowTick   = 0;
+volatile uint8_t  pumpGuardTripMask  = 0;  // bit per channel, cleared by loop()
+hw_timer_t*       pumpGuardTimer     = nullptr;
+
+void IRAM_ATTR pumpGuardIsr() {
+  const uint32_t now = ++pumpGuardNowTick;
+  const uint32_t out = GPIO.out;
+  for (int i = 0; i < 4; i++) {
+    PumpGuardChannel& c = pumpGuard[i];
+    if (!(out & (1UL << c.pin))) {
+      c.onTicks = 0;
+      continue;
+    }
+    const uint32_t on = ++c.onTicks;
+    const uint32_t deadline = c.deadlineTick;
+    const bool overrun = deadline ? (int32_t)(now - deadline) > 0
+                                  : on * PUMP_GUARD_TICK_MS > PUMP_GUARD_UNARMED_MS;
+    const uint32_t ceiling = c.calibrating ? CALIBRATE_CEILING_TICKS : c.ceilingTicks;
+    if (overrun || on > ceiling) {
+      globalEmergencyStop = true;
+      pumpsAllOffFast();
+      estopEngagedMs = millis();
+      estopEngageCount = estopEngageCount + 1;
+      pumpGuardTripMask |= (uint8_t)(1 << i);
+    }
+  }
+}
+
+static int pumpGuardIndex(int pin) {
+  for (int i = 0; i < 4; i++) if (pumpGuard[i].pin == pin) return i;
+  return -1;
+}
+
+// Ceilings from the daily caps and current flow alone. Call after flows change.
+void pumpGuardUpdateLimits() {
+  const float capMl[4] = {MAX_KALK_ML_PER_DAY, MAX_AFR_ML_PER_DAY, MAX_MG_ML_PER_DAY, MAX_TBD_ML_PER_DAY};
+  for (int i = 0; i < 4; i++) {
+    const float flow = pinFlowMlPerMin(pumpGuard[i].pin);
+    const float sec = (flow > 0.0f) ? capMl[i] / flow * 60.0f : 0.0f;
+    pumpGuard[i].ceilingTicks = (uint32_t)((sec * 1000.0f + PUMP_GUARD_SLACK_MS) / PUMP_GUARD_TICK_MS);
+  }
+}
+
+// Central pump switching: every planned run goes through these.
+// calibrate: the run goes into a cup, bounded by CALIBRATE_MAX_SEC, not the daily cap.
+void pumpOn(int pin, float seconds, bool calibrate = false) {
+  const int i = pumpGuardIndex(pin);
+  if (i >= 0) {
+    pumpGuard[i].calibrating = calibrate;
+    const uint32_t ticks = (uint32_t)((seconds * 1000.0f + PUMP_GUARD_SLACK_MS) / PUMP_GUARD_TICK_MS) + 1;
+    uint32_t deadline = pumpGuardNowTick + ticks;
+    if (deadline == 0) deadline = 1;
+    pumpGuard[i].deadlineTick = deadline;
+  }
+  digitalWrite(pin, HIGH);
+}
+
+void pumpOff(int pin) {
+  digitalWrite(pin, LOW);
+  const int i = pumpGuardIndex(pin);
+  if (i >= 0) {
+    pumpGuard[i].deadlineTick = 0;
+    pumpGuard[i].calibrating  = false;
+  }
+}
+
+void pumpGuardBegin() {
+  pumpGuardUpdateLimits();
+  pumpGuardTimer = timerBegin(0, 80, true);            // 80 MHz APB / 80 = 1 us
+  timerAttachInterrupt(pumpGuardTimer, &pumpGuardIsr, true);
+  timerAlarmWrite(pumpGuardTimer, PUMP_GUARD_TICK_MS * 1000, true);
+  timerAlarmEnable(pumpGuardTimer);
+}
+
+// loop(): report trips raised by the ISR.
+void servicePumpGuard() {
+  const uint8_t mask = pumpGuardTripMask;
+  if (!mask) return;
+  pumpGuardTripMask = 0;
+
+  static const char* const names[4] = {"kalk", "afr", "mg", "tbd"};
+  String which;
+  for (int i = 0; i < 4; i++) {
+    if (!(mask & (1 << i))) continue;
+    if (which.length()) which += ",";
+    which += names[i];
+  }
+  Serial.println("!!! PUMP GUARD TRIPPED: " + which + " stayed on too long !!!");
+  setEmergencyStop(true, "pump guard");
+  pendingCloudMirror |= MIRROR_KILL_SWITCH;
+  firebasePushAlert("safety",
+                    "Pump guard tripped",
+                    "Pump " + which + " exceeded its max on-time. E-stop latched; check the doser before releasing.",
+                    getLocalTimeString(),
+                    "pump_guard",
+                    10ULL*60ULL*1000ULL);
+}
 
-  float caRise =
-      dosing.ml_per_day_kalk * CA_PPM_PER_ML_KALK_TANK +
-      dosing.ml_per_day_afr  * CA_PPM_PER_ML_AFR_TANK;
 
-  float mgRise =
-      dosing.ml_per_day_afr  * MG_PPM_PER_ML_AFR_TANK +
-      dosing.ml_per_day_mg   * MG_PPM_PER_ML_MG_TANK;
+// ===================== SAFETY: CHEMISTRY-BASED CAPS =====================
+
+// Max tank rise per day, for the plan here and for actual delivery (24h governor)
+const float MAX_ALK_RISE_DKH_PER_DAY = 0.8f;
+const float MAX_CA_RISE_PPM_PER_DAY  = 20.0f;
+const float MAX_MG_RISE_PPM_PER_DAY  = 30.0f;
+
+// Daily rise of one parameter under the current plan.
+static float planRise(int param) {
+  return dosing.ml_per_day_kalk * reagentEffectPerMl(1, param) +
+         dosing.ml_per_day_afr  * reagentEffectPerMl(2, param) +
+         dosing.ml_per_day_mg   * reagentEffectPerMl(3, param) +
+         dosing.ml_per_day_tbd  * reagentEffectPerMl(4, param);
+}
 
-  const float MAX_ALK_RISE_DKH_PER_DAY = 0.8f;
-  const float MAX_CA_RISE_PPM_PER_DAY  = 20.0f;
-  const float MAX_MG_RISE_PPM_PER_DAY  = 30.0f;
+void enforceChemSafetyCaps() {
+  float alkRise = planRise(PARAM_ALK);
+  float caRise  = planRise(PARAM_CA);
+  float mgRise  = planRise(PARAM_MG);
 
   float scale = 1.0f;
 
@@ -1057,12 +2417,17 @@ void resetAIState() {
   Serial.println("=== AI RESET requested ===");
 
   // Clear test history in RAM
-  historyCount = 0;
-  memset(historyBuf, 0, sizeof(historyBuf));
+  {
+    HistoryLock lock;
+    historyCount = 0;
+    historyHead  = 0;
+    memset(historyBuf, 0, sizeof(historyBuf));
+  }
 
   // Clear last / current tests
   lastTest    = {0, 0, 0, 0, 0};
   currentTest = {0, 0, 0, 0, 0};
+  rtcSaveHistory();
 
   // Reset dosing back to your conservative defaults
   dosing.ml_per_day_kalk = 2000.0f;  // 2L/day
@@ -1072,13 +2437,16 @@ void resetAIState() {
 
   // Reset safety / timing
   lastSafetyBackoffTs = nowSeconds();
+
+  // Re-seed the test baseline from RTDB on the next sync (history only, no dosing change)
   lastRemoteTestTimestampMs = 0;
+  testSyncNeedsBackfill = true;
 
   // Recompute per-dose seconds
   updatePumpSchedules();
 
-  // Save default dosing so it becomes the new baseline
-  saveDosingToPrefs();
+  // Save default dosing + cursor so they become the new baseline
+  configCommit();
 
   // Optional: Firebase alert for AI reset
   firebasePushAlert("reset",
@@ -1092,18 +2460,127 @@ void resetAIState() {
 }
 
 
+// ===================== REAGENT SOLVER (NNLS) =====================
+// Turns per-parameter consumption into ml/day per pump: min ||W(A x - b)||^2 with
+// x >= 0, where A is the parameters x fitted reagents effect matrix, b the daily
+// consumption and W scales each row by the error that counts as "one unit" for
+// that parameter. Kalk and AFR move alk and Ca in almost the same ratio, so those
+// two rows alone can't split them; one more row (the pH prior) asks that the
+// pH-raising reagents supply kalkFrac of the alk.
+// Solved by cyclic coordinate descent on the normal equations: every step is an
+// exact minimisation along one reagent, clamped at 0. Cost is bounded by the
+// matrix size (<= 16 reagents x 8 rows) and NNLS_MAX_SWEEPS.
+
+const int   NNLS_MAX_COLS   = REAGENT_MAX;
+const int   NNLS_MAX_ROWS   = 8;
+const int   NNLS_MAX_SWEEPS = 200;
+const float NNLS_TOL        = 1e-4f;   // largest residual change per sweep, in row units
+
+// Tolerance per parameter: an error this size weighs 1 in the fit
+const float PARAM_FIT_UNIT[PARAM_COUNT] = {0.1f, 5.0f, 5.0f, 1.0f};
+const float PH_PRIOR_WEIGHT = 1.0f;
+
+// A: m x n, row-major with stride NNLS_MAX_COLS. x holds the warm start on entry.
+// Returns the sweeps used (NNLS_MAX_SWEEPS = not converged, x is still feasible).
+int nnlsSolve(const float A[][NNLS_MAX_COLS], int m, int n, const float* b, float* x) {
+  float Q[NNLS_MAX_COLS][NNLS_MAX_COLS];
+  float c[NNLS_MAX_COLS];
+  for (int j = 0; j < n; j++) {
+    c[j] = 0.0f;
+    for (int r = 0; r < m; r++) c[j] += A[r][j] * b[r];
+    for (int k = j; k < n; k++) {
+      float q = 0.0f;
+      for (int r = 0; r < m; r++) q += A[r][j] * A[r][k];
+      Q[j][k] = Q[k][j] = q;
+    }
+    if (x[j] < 0.0f || !isfinite(x[j])) x[j] = 0.0f;
+  }
+
+  int sweep = 0;
+  while (sweep < NNLS_MAX_SWEEPS) {
+    sweep++;
+    float maxStep = 0.0f;
+    for (int j = 0; j < n; j++) {
+      if (Q[j][j] <= 0.0f) { x[j] = 0.0f; continue; }   // reagent touches no row
+      float g = -c[j];
+      for (int k = 0; k < n; k++) g += Q[j][k] * x[k];
+      const float nx = max(0.0f, x[j] - g / Q[j][j]);
+      maxStep = max(maxStep, fabsf(nx - x[j]) * sqrtf(Q[j][j]));
+      x[j] = nx;
+    }
+    if (maxStep < NNLS_TOL) break;
+  }
+  return sweep;
+}
+
+// cons/measured: daily consumption per parameter and whether both tests had it.
+// plan: current ml/day per pump, used as the warm start; pumps whose reagent
+// touches no measured parameter keep their value. Writes ml/day per pump to out.
+void reagentSolvePlan(const float cons[PARAM_COUNT], const bool measured[PARAM_COUNT],
+                      float kalkFrac, const float plan[4], float out[4]) {
+  float A[NNLS_MAX_ROWS][NNLS_MAX_COLS] = {};
+  float b[NNLS_MAX_ROWS] = {};
+  float x[NNLS_MAX_COLS] = {};
+  int   cols[NNLS_MAX_COLS];   // pump - 1 for each column
+  int   n = 0, m = 0;
+
+  for (int p = 0; p < 4; p++) {
+    out[p] = plan[p];
+    bool seen = false;
+    for (int k = 0; k < PARAM_COUNT; k++) seen |= measured[k] && reagentPumpEffect[p][k] != 0.0f;
+    if (reagentOnPump[p] < 0 || !seen) continue;
+    cols[n] = p;
+    x[n] = plan[p];
+    n++;
+  }
+  if (n == 0) return;
+
+  for (int k = 0; k < PARAM_COUNT; k++) {
+    if (!measured[k]) continue;
+    for (int j = 0; j < n; j++) A[m][j] = reagentPumpEffect[cols[j]][k] / PARAM_FIT_UNIT[k];
+    b[m] = max(0.0f, cons[k]) / PARAM_FIT_UNIT[k];
+    m++;
+  }
+
+  // pH prior: sum((raisesPh - kalkFrac) * alk * x) = 0. Only when both kinds supply alk,
+  // otherwise it would just push the one kind to zero.
+  if (measured[PARAM_ALK]) {
+    bool raising = false, neutral = false;
+    float row[NNLS_MAX_COLS];
+    for (int j = 0; j < n; j++) {
+      const float alk = reagentPumpEffect[cols[j]][PARAM_ALK];
+      const bool ph = reagents[reagentOnPump[cols[j]]].raisesPh != 0;
+      if (alk > 0.0f) (ph ? raising : neutral) = true;
+      row[j] = ((ph ? 1.0f : 0.0f) - kalkFrac) * alk / PARAM_FIT_UNIT[PARAM_ALK] * PH_PRIOR_WEIGHT;
+    }
+    if (raising && neutral && m < NNLS_MAX_ROWS) {
+      for (int j = 0; j < n; j++) A[m][j] = row[j];
+      b[m] = 0.0f;
+      m++;
+    }
+  }
+
+  const int sweeps = nnlsSolve(A, m, n, b, x);
+  if (sweeps >= NNLS_MAX_SWEEPS) Serial.println("Reagent solve: not converged, using best so far");
+  for (int j = 0; j < n; j++) out[cols[j]] = x[j];
+}
+
+
 // ===================== “AI” CONTROL (with pH bias & safety) =====================
 
-void onNewTestInput(float ca, float alk, float mg, float ph, float tbd_val) {
+// testTimeSec: when the test was taken (epoch seconds); 0 = now.
+void onNewTestInput(float ca, float alk, float mg, float ph, float tbd_val, uint32_t testTimeSec = 0) {
   // 1. Update history for graph
   lastTest = currentTest;
-  currentTest.t   = nowSeconds();
+  currentTest.t   = testTimeSec ? testTimeSec : epochSeconds();
   currentTest.ca  = ca;
   currentTest.alk = alk;
   currentTest.mg  = mg;
   currentTest.ph  = ph;
   currentTest.tbd = tbd_val; // Added TBD to history struct
   pushHistory(currentTest);
+  rtcSaveHistory();
+  wsPublishTest(currentTest);
 
   // 2. Sanity check ranges (Safety First)
   if (ca   < 300.0f || ca   > 550.0f ||
@@ -1127,14 +2604,15 @@ void onNewTestInput(float ca, float alk, float mg, float ph, float tbd_val) {
     return;
   }
 
-  // 5. Consumption per day calculations
-  float consAlk = (lastTest.alk - currentTest.alk) / days;
-  float consCa  = (lastTest.ca  - currentTest.ca ) / days;
-  float consMg  = (lastTest.mg  - currentTest.mg ) / days;
-  float consTbd = (lastTest.tbd - currentTest.tbd) / days; // Track Pump 4 consumption
-
-  float alkNeeded = consAlk;
-  if(alkNeeded < 0.0f) alkNeeded = 0.0f;
+  // 5. Consumption per day for each parameter; one missing from either test sits out
+  const float nowVal[PARAM_COUNT]  = {currentTest.alk, currentTest.ca, currentTest.mg, currentTest.tbd};
+  const float lastVal[PARAM_COUNT] = {lastTest.alk,    lastTest.ca,    lastTest.mg,    lastTest.tbd};
+  float cons[PARAM_COUNT];
+  bool  measured[PARAM_COUNT];
+  for (int k = 0; k < PARAM_COUNT; k++) {
+    measured[k] = isfinite(nowVal[k]) && isfinite(lastVal[k]) && nowVal[k] > 0.0f && lastVal[k] > 0.0f;
+    cons[k] = measured[k] ? (lastVal[k] - nowVal[k]) / days : 0.0f;
+  }
 
   // --- 6. PH BIAS LOGIC (Kalk vs AFR) ---
   float kalkFrac = 0.8f;  // default: 80% alk from kalk
@@ -1148,38 +2626,20 @@ void onNewTestInput(float ca, float alk, float mg, float ph, float tbd_val) {
   }
   kalkFrac = clampf(kalkFrac, 0.6f, 0.95f);
 
-  // --- 7. SUGGESTED RATES ---
-  float targetAlkFromKalk = kalkFrac * alkNeeded;
-  float targetAlkFromAfr  = (1.0f - kalkFrac) * alkNeeded;
-
-  float suggested_ml_kalk = (DKH_PER_ML_KALK_TANK > 0.0f) ? (targetAlkFromKalk / DKH_PER_ML_KALK_TANK) : 0.0f;
-  float suggested_ml_afr  = (DKH_PER_ML_AFR_TANK  > 0.0f) ? (targetAlkFromAfr  / DKH_PER_ML_AFR_TANK ) : 0.0f;
-
-  // Calculate what AFR/Kalk provide for Ca/Mg
-  float caFromKalk = suggested_ml_kalk * CA_PPM_PER_ML_KALK_TANK;
-  float caFromAfr  = suggested_ml_afr  * CA_PPM_PER_ML_AFR_TANK;
-  float mgFromAfr  = suggested_ml_afr  * MG_PPM_PER_ML_AFR_TANK;
-
-  // Ca Error Correction
-  float caError = consCa - (caFromKalk + caFromAfr);
-  if(fabsf(caError) > 5.0f){
-    float afrCorrection = (caError / CA_PPM_PER_ML_AFR_TANK) * 0.3f;
-    suggested_ml_afr += afrCorrection;
-  }
-
-  // Mg Error Correction (Pump 3)
-  float suggested_ml_mg = dosing.ml_per_day_mg;
-  if(consMg > mgFromAfr + 0.5f){
-    float mgCorrection = (consMg - mgFromAfr) / MG_PPM_PER_ML_MG_TANK;
-    mgCorrection *= 0.3f;
-    suggested_ml_mg += mgCorrection;
-  }
-
-  // TBD Placeholder Correction (Pump 4)
-  float suggested_ml_tbd = dosing.ml_per_day_tbd;
-  if (consTbd > 0.1f) {
-    // If you add a TBD_PPM_PER_ML constant, use it here like Mg
-    suggested_ml_tbd += (consTbd * 0.2f); 
+  // --- 7. SUGGESTED RATES (reagent matrix, NNLS) ---
+  const float plan[4] = {dosing.ml_per_day_kalk, dosing.ml_per_day_afr, dosing.ml_per_day_mg, dosing.ml_per_day_tbd};
+  float suggested[4];
+  reagentSolvePlan(cons, measured, kalkFrac, plan, suggested);
+  float suggested_ml_kalk = suggested[0];
+  float suggested_ml_afr  = suggested[1];
+  float suggested_ml_mg   = dosing.ml_per_day_mg;
+  float suggested_ml_tbd  = suggested[3];
+
+  // Mg (pump 3) stays an incremental, damped correction: only a shortfall of more
+  // than 0.5 ppm/day against the current plan raises it, by 30% of the solve's delta.
+  const float mgDeltaMl = suggested[2] - dosing.ml_per_day_mg;
+  if (mgDeltaMl * reagentPumpEffect[2][PARAM_MG] > 0.5f) {
+    suggested_ml_mg += mgDeltaMl * 0.3f;
   }
 
   // 8. FINAL LIMITS & CLAMPS
@@ -1201,7 +2661,7 @@ void onNewTestInput(float ca, float alk, float mg, float ph, float tbd_val) {
   // 9. WRAP UP
   enforceChemSafetyCaps();
   updatePumpSchedules();
-  saveDosingToPrefs();
+  configCommit();
   lastSafetyBackoffTs = nowSeconds();
 
   Serial.println("AI Update: 4-Pump Dosing Plan Recalculated.");
@@ -1214,7 +2674,10 @@ void safetyBackoffIfNoTests() {
   if (currentTest.t == 0) return;
 
   uint32_t now = nowSeconds();
-  float daysSinceLastTest = float(now - currentTest.t) / 86400.0f;
+  uint32_t nowEpoch = epochSeconds();
+  if (nowEpoch < currentTest.t) return; // clock not valid yet
+
+  float daysSinceLastTest = float(nowEpoch - currentTest.t) / 86400.0f;
 
   if (daysSinceLastTest <= 5.0f) return;
   if (now - lastSafetyBackoffTs < 86400UL) return;
@@ -1234,7 +2697,7 @@ void safetyBackoffIfNoTests() {
   updatePumpSchedules();
 
   // Persist backed-off dosing plan
-  saveDosingToPrefs();
+  configCommit();
 
   lastSafetyBackoffTs = now;
 
@@ -1248,983 +2711,4642 @@ void safetyBackoffIfNoTests() {
 }
 
 
-// ===================== PUMP SCHEDULER (REAL-TIME SLOTS) =====================
+// ===================== DOSE TIMING SLA =====================
+// Per-slot accounting for the scheduler: how late each slot fired against its
+// DOSE_HOURS/DOSE_MINUTES time, how long pumps actually ran vs planned, and where
+// each slot's planned ml went (delivered / deferred by MIN_DOSE_SEC / held by E-stop).
+// Histograms live in `metrics` (/metrics); daily rollups ride along with /state.
+
+const uint32_t SLA_LATE_SEC = 60;   // a slot firing later than this counts as late
+
+struct DoseSlaDay {
+  uint32_t ymd;              // local date as yyyymmdd, 0 = empty
+  uint16_t slotsFired;
+  uint16_t slotsLate;
+  uint16_t slotsMissed;      // never fired (loop blocked past the whole slot)
+  uint32_t latenessSumSec;
+  uint32_t latenessMaxSec;
+  float plannedMl[4];        // slot shares of the daily plan
+  float deliveredMl[4];      // measured run time x flow
+  float deferredMl[4];       // shares left in the bucket by MIN_DOSE_SEC
+  float skippedMl[4];        // shares left in the bucket by E-stop
+};
 
-bool giveDose(int pin, float seconds) {
-  if (globalEmergencyStop) {
-        Serial.println("Pump execution blocked: E-Stop is ACTIVE.");
-        return false;
-    }
-  if (seconds <= 0) return false;
+DoseSlaDay slaToday     = {};
+DoseSlaDay slaYesterday = {};
 
-  const uint32_t totalMs = (uint32_t)(seconds * 1000.0f);
-  const uint32_t beatEveryMs = 5000;   // keep RTDB heartbeat fresh while dosing
-  const uint32_t loopDelayMs = 50;     // yield to WiFi stack
+static void slaRollDay(const tm& t) {
+  const uint32_t ymd = (uint32_t)(t.tm_year + 1900) * 10000 + (t.tm_mon + 1) * 100 + t.tm_mday;
+  if (slaToday.ymd == ymd) return;
+  if (slaToday.ymd != 0) slaYesterday = slaToday;
+  slaToday = {};
+  slaToday.ymd = ymd;
+}
 
-  digitalWrite(pin, HIGH);
+// Slot `idx` is firing now. Books lateness, any earlier slots that were skipped over,
+// and the planned per-pump shares.
+void slaSlotFired(const tm& now, int idx, const float shareMl[4]) {
+  slaRollDay(now);
 
-  uint32_t start = millis();
-  uint32_t lastBeat = start;
+  const int32_t plannedSec = (DOSE_HOURS[idx] * 60 + DOSE_MINUTES[idx]) * 60;
+  int32_t late = (now.tm_hour * 3600 + now.tm_min * 60 + now.tm_sec) - plannedSec;
+  if (late < 0) late += 24 * 3600;   // slot planned before midnight, fired after
 
-  while ((uint32_t)(millis() - start) < totalMs) {
-    delay(loopDelayMs);
+  for (int i = 0; i < idx; i++) {
+    if (slotDone[i]) continue;
+    slotDone[i] = true;
+    slaToday.slotsMissed++;
+    metrics.slotsMissed.fetch_add(1, std::memory_order_relaxed);
+  }
 
-    // Keep the device marked online while a long dose is running
-    if ((uint32_t)(millis() - lastBeat) >= beatEveryMs) {
-      lastBeat = millis();
-      firebaseSendStateHeartbeat();
-    }
+  slaToday.slotsFired++;
+  slaToday.latenessSumSec += (uint32_t)late;
+  if ((uint32_t)late > slaToday.latenessMaxSec) slaToday.latenessMaxSec = (uint32_t)late;
+  metrics.slotLatenessSec.observe((uint32_t)late);
+  if ((uint32_t)late > SLA_LATE_SEC) {
+    slaToday.slotsLate++;
+    metrics.slotsLate.fetch_add(1, std::memory_order_relaxed);
+    Serial.printf("SLA: slot %d fired %lds late\n", idx + 1, (long)late);
   }
 
-  digitalWrite(pin, LOW);
-  return true;
+  for (int p = 0; p < 4; p++) slaToday.plannedMl[p] += shareMl[p];
 }
 
+void slaDoseDelivered(int pump, float ml) {
+  if (pump >= 1 && pump <= 4) slaToday.deliveredMl[pump - 1] += ml;
+}
 
+// Completed runs only (a run cut by E-stop isn't a timing error).
+void slaDoseOnTime(float plannedSec, float ranSec) {
+  metrics.doseOnTimeErrMs.observe((uint32_t)(fabsf(ranSec - plannedSec) * 1000.0f));
+}
 
-// Doses a specific amount on a specific pump, then logs it to RTDB.
-void doseAndLog(int pumpIndex, const String& pumpName, int pin, float ml, float flowMlPerMin, const String& source) {
-  if (ml <= 0.0f || flowMlPerMin <= 0.0f) return;
-  const float durationSec = (ml / flowMlPerMin) * 60.0f;
-  if (!giveDose(pin, durationSec)) return;
-  firebaseLogDoseRun(pumpIndex, pumpName, ml, durationSec, flowMlPerMin, source);
+void slaDoseDeferred(int pump, float shareMl) {
+  if (pump >= 1 && pump <= 4) slaToday.deferredMl[pump - 1] += shareMl;
 }
 
+void slaDoseSkipped(int pump, float shareMl) {
+  if (pump >= 1 && pump <= 4) slaToday.skippedMl[pump - 1] += shareMl;
+}
 
-void maybeDosePumpsRealTime() {
-  if (WiFi.status() != WL_CONNECTED) return;
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) return;
-  if (!isTimeValid(timeinfo)) return;
+static String slaDayJson(const DoseSlaDay& d) {
+  static const char* const names[4] = {"kalk", "afr", "mg", "tbd"};
+  auto perPump = [&](const char* key, const float* v) {
+    String s = "\"" + String(key) + "\":{";
+    for (int p = 0; p < 4; p++) {
+      if (p) s += ",";
+      s += "\"" + String(names[p]) + "\":" + String(v[p], 2);
+    }
+    return s + "}";
+  };
 
-  // ... [Day change logic remains exactly as you have it] ...
-  const int windowDay = doseScheduleCfg.enabled ? windowStartYday(timeinfo, doseScheduleCfg.startHour, doseScheduleCfg.endHour)
-                                                 : timeinfo.tm_yday;
+  String json = "{";
+  json += "\"date\":" + String(d.ymd) + ",";
+  json += "\"slotsFired\":" + String(d.slotsFired) + ",";
+  json += "\"slotsLate\":" + String(d.slotsLate) + ",";
+  json += "\"slotsMissed\":" + String(d.slotsMissed) + ",";
+  json += "\"latenessAvgSec\":" + String(d.slotsFired ? d.latenessSumSec / d.slotsFired : 0) + ",";
+  json += "\"latenessMaxSec\":" + String(d.latenessMaxSec) + ",";
+  json += perPump("plannedMl", d.plannedMl) + ",";
+  json += perPump("deliveredMl", d.deliveredMl) + ",";
+  json += perPump("deferredMl", d.deferredMl) + ",";
+  json += perPump("skippedMl", d.skippedMl);
+  json += "}";
+  return json;
+}
 
-  if (!doseSlotsPrimed || windowDay != lastDoseWindowDay) {
-    // [Your existing Day Change code here]
-    lastDoseWindowDay = windowDay; 
-    doseSlotsPrimed = true; 
-    rebuildScheduleSlots();
-    for (int i = 0; i < DOSE_SLOTS_PER_DAY; i++) slotDone[i] = false;
-    // ...
-  }
+// Heartbeat payload: today's and yesterday's rollups plus the rolling percentiles.
+String slaSummaryJson() {
+  String json = "{";
+  json += "\"latenessP95Sec\":" + String(metrics.slotLatenessSec.quantile(0.95f)) + ",";
+  json += "\"onTimeErrP95Ms\":" + String(metrics.doseOnTimeErrMs.quantile(0.95f)) + ",";
+  json += "\"today\":" + slaDayJson(slaToday);
+  if (slaYesterday.ymd) json += ",\"yesterday\":" + slaDayJson(slaYesterday);
+  json += "}";
+  return json;
+}
 
-  // Determine nowIdx as you already do...
-  int nowIdx = -1;
-  if (doseScheduleCfg.enabled) {
-    nowIdx = scheduleSlotIndex(timeinfo, doseScheduleCfg.startHour, doseScheduleCfg.endHour, doseScheduleCfg.everyMin);
-  } else {
-    // legacy window logic...
-  }
 
-  // --- ACCUMULATION DOSING LOGIC WITH MEMORY ---
-  if (nowIdx >= 0 && nowIdx < DOSE_SLOTS_PER_DAY) {
-    if (!slotDone[nowIdx]) {
-      
-      // 1. LOAD current buckets from permanent memory
-      Preferences prefs;
-      prefs.begin("doser-buckets", false); // false = read/write mode
-      pendingKalkMl = prefs.getFloat("p_kalk", 0.0f);
-      pendingAfrMl  = prefs.getFloat("p_afr", 0.0f);
-      pendingMgMl   = prefs.getFloat("p_mg", 0.0f);
-      pendingTbdMl   = prefs.getFloat("p_tbd", 0.0f);
-
-      // 2. Add current slot's requirement
-      pendingKalkMl += dosing.ml_per_day_kalk / (float)max(1, DOSE_SLOTS_PER_DAY);
-      pendingAfrMl  += dosing.ml_per_day_afr  / (float)max(1, DOSE_SLOTS_PER_DAY);
-      pendingMgMl   += dosing.ml_per_day_mg   / (float)max(1, DOSE_SLOTS_PER_DAY);
-      pendingTbdMl   += dosing.ml_per_day_tbd   / (float)max(1, DOSE_SLOTS_PER_DAY);
+// ===================== DOSE LEDGER (LITTLEFS) =====================
+// Every pump run is appended to /ledger/runs.bin as a fixed 16-byte record, so local
+// charts and the safety logic can read dose history without any RTDB reads.
+// serviceLedger() compacts in the background: runs older than LEDGER_RAW_DAYS fold
+// into hourly totals (hour.bin), hourly totals older than LEDGER_HOUR_DAYS fold into
+// daily totals (day.bin). A tier only ever holds whole periods older than the next
+// finer tier, so a range query walks day -> hour -> raw and stays chronological.
+// Compaction rewrites through tmp.bin + rename and never runs while a query is open;
+// fold.bin marks a fold whose appended rows aren't committed by that rename yet.
+
+const char* const LEDGER_DIR       = "/ledger";
+const char* const LEDGER_RAW_PATH  = "/ledger/runs.bin";
+const char* const LEDGER_HOUR_PATH = "/ledger/hour.bin";
+const char* const LEDGER_DAY_PATH  = "/ledger/day.bin";
+const char* const LEDGER_TMP_PATH  = "/ledger/tmp.bin";
+const char* const LEDGER_MARK_PATH = "/ledger/fold.bin";
+
+const uint32_t LEDGER_RAW_DAYS         = 7;
+const uint32_t LEDGER_HOUR_DAYS        = 90;
+const size_t   LEDGER_DAY_MAX_BYTES    = 64 * 1024;       // ~6 years of daily rows
+const uint32_t LEDGER_COMPACT_EVERY_MS = 60UL * 60UL * 1000UL;
+const uint32_t LEDGER_MIN_EPOCH        = 1672531200UL;    // 2023-01-01: clock not set yet
+
+enum LedgerSource : uint8_t {
+  LEDGER_SRC_OTHER, LEDGER_SRC_SCHEDULE, LEDGER_SRC_SLOT, LEDGER_SRC_LIVE, LEDGER_SRC_RECOVERED,
+  LEDGER_SRC_CALIBRATE,
+};
+static const char* const LEDGER_SOURCE_NAMES[] = {"other", "schedule", "slot", "live", "recovered", "calibrate"};
+const uint8_t LEDGER_SOURCE_COUNT = sizeof(LEDGER_SOURCE_NAMES) / sizeof(LEDGER_SOURCE_NAMES[0]);
+
+struct LedgerRun {         // raw tier, 16 bytes
+  uint32_t ts;             // epoch seconds when the run ended
+  float    ml;
+  float    sec;
+  uint8_t  pump;           // 1..4
+  uint8_t  source;         // LedgerSource
+  uint8_t  reserved;
+  uint8_t  check;          // low byte of the CRC over the bytes before it
+};
 
-      Serial.printf("Slot %d: Buckets Loaded (Kalk:%.2fml, AFR:%.2fml, MG:%.2fml, TBD:%.2fml)\n", nowIdx + 1, pendingKalkMl, pendingAfrMl,pendingMgMl,pendingTbdMl);
+struct LedgerBucket {      // hour/day tiers, 28 bytes
+  uint32_t start;          // period start, epoch seconds
+  float    ml[4];
+  uint16_t runs[4];
+};
 
-      // 3. KALK 
-      if (pendingKalkMl > 0.0f && FLOW_KALK_ML_PER_MIN > 0.0f) {
-        float sec = (pendingKalkMl / FLOW_KALK_ML_PER_MIN) * 60.0f;
-        if (sec >= MIN_DOSE_SEC) {
-          if (giveDose(PIN_PUMP_KALK, sec)) {
-          firebaseLogDoseRun(1, "kalk", pendingKalkMl, sec, FLOW_KALK_ML_PER_MIN, "schedule");
-          pendingKalkMl = 0.0f;
-        } else {
-          Serial.println("E-Stop active: skipped KALK dosing, kept pending volume.");
-        } 
-        } else {
-          Serial.println("Kalk deferred (under 1s).");
-        }
-      }
+enum LedgerRes : uint8_t { LEDGER_RES_RAW, LEDGER_RES_HOUR, LEDGER_RES_DAY };
 
-      // 4. AFR 
-      if (pendingAfrMl > 0.0f && FLOW_AFR_ML_PER_MIN > 0.0f) {
-        float sec = (pendingAfrMl / FLOW_AFR_ML_PER_MIN) * 60.0f;
-        if (sec >= MIN_DOSE_SEC) {
-          if (giveDose(PIN_PUMP_AFR, sec)) {
-          firebaseLogDoseRun(2, "afr", pendingAfrMl, sec, FLOW_AFR_ML_PER_MIN, "schedule");
-          pendingAfrMl = 0.0f;
-        } else {
-          Serial.println("E-Stop active: skipped AFR dosing, kept pending volume.");
-        } 
-        } else {
-          Serial.println("AFR deferred (under 1s).");
-        }
-      }
+// Written before a fold appends to dstPath: the size to cut it back to if the
+// source rename never happened.
+struct LedgerFoldMark {
+  uint32_t magic;
+  uint32_t dstSize;
+  char     dstPath[24];
+};
+const uint32_t LEDGER_MARK_MAGIC = 0x4C464D31;   // "LFM1"
 
-      // 5. MG 
-      if (pendingMgMl > 0.0f && FLOW_MG_ML_PER_MIN > 0.0f) {
-        float sec = (pendingMgMl / FLOW_MG_ML_PER_MIN) * 60.0f;
-        if (sec >= MIN_DOSE_SEC) {
-          if (giveDose(PIN_PUMP_MG, sec)) {
-          firebaseLogDoseRun(3, "mg", pendingMgMl, sec, FLOW_MG_ML_PER_MIN, "schedule");
-          pendingMgMl = 0.0f;
-        } else {
-          Serial.println("E-Stop active: skipped MG dosing, kept pending volume.");
-        } 
-        }else {
-          Serial.println("Mg deferred (under 1s).");
-        }
-      }
-      // 5. TBD
-      if (pendingTbdMl > 0.0f && FLOW_TBD_ML_PER_MIN > 0.0f) {
-        float sec = (pendingTbdMl / FLOW_TBD_ML_PER_MIN) * 60.0f;
-        if (sec >= MIN_DOSE_SEC) {
-          if (giveDose(PIN_PUMP_TBD, sec)) {
-          firebaseLogDoseRun(4, "tbd", pendingTbdMl, sec, FLOW_TBD_ML_PER_MIN, "schedule");
-          pendingTbdMl = 0.0f;
-        } else {
-          Serial.println("E-Stop active: skipped AUX dosing, kept pending volume.");
-        } 
-        }else {
-          Serial.println("TBD deferred (under 1s).");
-        }
-      }
+bool fsMounted = false;                // LittleFS (web assets + ledger)
+portMUX_TYPE ledgerMux = portMUX_INITIALIZER_UNLOCKED;
+int      ledgerReaders    = 0;         // open /api/ledger responses (ledgerMux)
+bool     ledgerCompacting = false;     // files are being rewritten (ledgerMux)
+bool     ledgerCompactDue   = true;
+uint32_t lastLedgerCompactMs = 0;
 
+static uint8_t ledgerCheck(const LedgerRun& r) {
+  return (uint8_t)crc32Bytes(&r, offsetof(LedgerRun, check));
+}
 
-      // 6. SAVE buckets back to memory so they survive a reboot
-      prefs.putFloat("p_kalk", pendingKalkMl);
-      prefs.putFloat("p_afr", pendingAfrMl);
-      prefs.putFloat("p_mg", pendingMgMl);
-      prefs.putFloat("p_tbd", pendingTbdMl);
-      prefs.end();
+static bool ledgerRunValid(const LedgerRun& r) {
+  return r.pump >= 1 && r.pump <= 4 && r.check == ledgerCheck(r);
+}
 
-      slotDone[nowIdx] = true;
-    }
+// Days are cut at local midnight (localtime_r, DST included), the same day the
+// RTDB rollups file a run under, so daily rows match the dashboard.
+static uint32_t ledgerPeriodStart(uint32_t ts, LedgerRes res) {
+  if (res == LEDGER_RES_HOUR) return ts - ts % 3600UL;
+  if (res == LEDGER_RES_DAY) {
+    const time_t t = (time_t)ts;
+    struct tm d;
+    localtime_r(&t, &d);
+    d.tm_hour = d.tm_min = d.tm_sec = 0;
+    d.tm_isdst = -1;
+    return (uint32_t)mktime(&d);
   }
+  return ts;
 }
 
-//////////////////////check for new tests ////////////////////
-////////////////////// check for new tests ////////////////////
-void checkForNewTest() {
-  // IMPORTANT: encode quotes as %22 for Firebase REST query params
-  String path = "/devices/" + String(DEVICE_ID) + "/tests?orderBy=%22timestamp%22&limitToLast=1";
+// A reader reference is only handed out while no compaction holds the files, and a
+// compaction only starts with no references out; both checks sit under ledgerMux.
+bool ledgerReaderAcquire() {
+  portENTER_CRITICAL(&ledgerMux);
+  const bool ok = !ledgerCompacting;
+  if (ok) ledgerReaders++;
+  portEXIT_CRITICAL(&ledgerMux);
+  return ok;
+}
 
-  String payload = firebaseGetJson(path);
-  if (payload.length() == 0 || payload == "null") return;
+void ledgerReaderRelease() {
+  portENTER_CRITICAL(&ledgerMux);
+  if (ledgerReaders > 0) ledgerReaders--;
+  portEXIT_CRITICAL(&ledgerMux);
+}
 
-  StaticJsonDocument<768> doc;
-  DeserializationError err = deserializeJson(doc, payload);
-  if (err) {
-    Serial.println("checkForNewTest: JSON parse error");
-    return;
-  }
+static bool ledgerCompactTryBegin() {
+  portENTER_CRITICAL(&ledgerMux);
+  const bool ok = (ledgerReaders == 0);
+  if (ok) ledgerCompacting = true;
+  portEXIT_CRITICAL(&ledgerMux);
+  return ok;
+}
 
-  JsonObject root = doc.as<JsonObject>();
-  if (root.size() == 0) return;
+static void ledgerCompactEnd() {
+  portENTER_CRITICAL(&ledgerMux);
+  ledgerCompacting = false;
+  portEXIT_CRITICAL(&ledgerMux);
+}
 
-  JsonObject test;
-  for (JsonPair kv : root) { test = kv.value().as<JsonObject>(); break; }
+static LedgerSource ledgerSourceOf(const String& source) {
+  for (uint8_t i = 1; i < LEDGER_SOURCE_COUNT; i++) {
+    if (source == LEDGER_SOURCE_NAMES[i]) return (LedgerSource)i;
+  }
+  return LEDGER_SRC_OTHER;
+}
 
-  uint64_t ts = test["timestamp"] | 0ULL;
-  if (ts == 0) return;
-  if (ts <= lastRemoteTestTimestampMs) return;
+void ledgerRecordRun(int pump, float ml, float sec, const String& source) {
+  const uint32_t now = (uint32_t)time(NULL);
+  if (!fsMounted || ml <= 0.0f || pump < 1 || pump > 4 || now < LEDGER_MIN_EPOCH) return;
+
+  LedgerRun r = {};
+  r.ts     = now;
+  r.ml     = ml;
+  r.sec    = sec;
+  r.pump   = (uint8_t)pump;
+  r.source = ledgerSourceOf(source);
+  r.check  = ledgerCheck(r);
+
+  File f = LittleFS.open(LEDGER_RAW_PATH, FILE_APPEND, true);
+  if (!f || f.write((const uint8_t*)&r, sizeof(r)) != sizeof(r)) {
+    Serial.println("Ledger: append failed");
+  }
+  if (f) f.close();
+}
 
-  lastRemoteTestTimestampMs = ts;
+static void ledgerAddToBucket(LedgerBucket& b, const LedgerBucket& in) {
+  for (int p = 0; p < 4; p++) {
+    b.ml[p]  += in.ml[p];
+    b.runs[p] = (uint16_t)min(65535, b.runs[p] + in.runs[p]);
+  }
+}
 
-  float ca  = test["ca"]  | NAN;
-  float alk = test["alk"] | NAN;
-  float mg  = test["mg"]  | NAN;
-  float ph  = test["ph"]  | NAN;
+static void ledgerAddRun(LedgerBucket& b, const LedgerRun& r) {
+  b.ml[r.pump - 1] += r.ml;
+  if (b.runs[r.pump - 1] < 65535) b.runs[r.pump - 1]++;
+}
 
-  if (!isfinite(ca) || !isfinite(alk) || !isfinite(mg) || !isfinite(ph)) {
-    Serial.println("NEW TEST invalid (NaN) -> ignoring");
-    return;
-  }
+// Start of the newest row already in an aggregate file (0 if none).
+static uint32_t ledgerLastBucketStart(const char* path) {
+  File f = LittleFS.open(path, FILE_READ);
+  if (!f) return 0;
+  LedgerBucket b;
+  uint32_t start = 0;
+  const size_t n = f.size() / sizeof(b);
+  if (n > 0 && f.seek((n - 1) * sizeof(b)) && f.read((uint8_t*)&b, sizeof(b)) == sizeof(b)) start = b.start;
+  f.close();
+  return start;
+}
 
-  Serial.printf("NEW TEST DETECTED ts=%llu ca=%.1f alk=%.2f mg=%.1f ph=%.2f\n",
-                (unsigned long long)ts, ca, alk, mg, ph);
+// Appends folded rows to `dst`. Rows not newer than what's there are dropped; a pass
+// cut short before its rename is undone through fold.bin (ledgerRecoverFold).
+struct LedgerFoldOut {
+  File     dst;
+  uint32_t lastStart;
+  LedgerBucket cur;
+  bool     have;
+  uint32_t rows;
+
+  void add(uint32_t start, const LedgerRun* run, const LedgerBucket* bucket) {
+    if (have && start != cur.start) flush();
+    if (!have) {
+      cur = {};
+      cur.start = start;
+      have = true;
+    }
+    if (run) ledgerAddRun(cur, *run);
+    else     ledgerAddToBucket(cur, *bucket);
+  }
 
-  // Now this will run
-  onNewTestInput(ca, alk, mg, ph, 0.0f);
-}
-///////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////
+  void flush() {
+    if (!have) return;
+    if (cur.start > lastStart && dst.write((const uint8_t*)&cur, sizeof(cur)) == sizeof(cur)) {
+      lastStart = cur.start;
+      rows++;
+    }
+    have = false;
+  }
+};
 
-// ===================== FIREBASE: resetAi COMMAND =====================
+// Rewrites `srcPath`, folding every record before `cutoff` into `res` rows on `dstPath`.
+// recSize selects the record type (raw runs or buckets). Returns false on I/O trouble.
+static bool ledgerFold(const char* srcPath, size_t recSize, const char* dstPath,
+                       LedgerRes res, uint32_t cutoff) {
+  File src = LittleFS.open(srcPath, FILE_READ);
+  if (!src) return true;   // nothing logged yet
+
+  // Skip the rewrite when nothing is old enough and the file isn't torn
+  const size_t size = src.size();
+  uint32_t firstTs = UINT32_MAX;
+  if (size >= recSize) {
+    uint32_t ts;
+    if (src.read((uint8_t*)&ts, sizeof(ts)) == sizeof(ts)) firstTs = ts;  // ts/start lead both records
+    src.seek(0);
+  }
+  if (size % recSize == 0 && firstTs >= cutoff) {
+    src.close();
+    return true;
+  }
 
-// Check /devices/{DEVICE_ID}/commands/resetAi
-// If true, reset AI and clear the flag.
-// Returns true if a reset was performed.
-bool firebaseCheckAndHandleResetAi() {
-  if (WiFi.status() != WL_CONNECTED) {
+  File tmp = LittleFS.open(LEDGER_TMP_PATH, FILE_WRITE, true);
+  LedgerFoldOut out = {};
+  out.lastStart = ledgerLastBucketStart(dstPath);
+  out.dst = LittleFS.open(dstPath, FILE_APPEND, true);
+  if (!tmp || !out.dst) {
+    Serial.println("Ledger: compaction open failed");
+    src.close();
+    if (tmp) tmp.close();
+    if (out.dst) out.dst.close();
     return false;
   }
 
-  String path = "/devices/" + String(DEVICE_ID) + "/commands/resetAi";
-  String payload = firebaseGetJson(path);
-  if (payload.length() == 0 || payload == "null") {
+  LedgerFoldMark mark = {};
+  mark.magic   = LEDGER_MARK_MAGIC;
+  mark.dstSize = (uint32_t)out.dst.size();
+  strlcpy(mark.dstPath, dstPath, sizeof(mark.dstPath));
+  File m = LittleFS.open(LEDGER_MARK_PATH, FILE_WRITE, true);
+  const bool marked = m && m.write((const uint8_t*)&mark, sizeof(mark)) == sizeof(mark);
+  if (m) m.close();
+  if (!marked) {
+    Serial.println("Ledger: fold marker write failed");
+    src.close();
+    tmp.close();
+    out.dst.close();
     return false;
   }
 
-  Serial.print("resetAi payload: ");
-  Serial.println(payload);
-
-  // If it's literally true (could be true or "true")
-  if (payload.indexOf("true") != -1) {
-    // Perform reset
-    resetAIState();
-
-    // Clear the flag back to false
-    firebasePutJson(path, "false");
-    Serial.println("resetAi flag cleared in Firebase.");
-    return true;
+  uint32_t kept = 0, folded = 0;
+  union { LedgerRun run; LedgerBucket bucket; } rec;
+  while (src.read((uint8_t*)&rec, recSize) == recSize) {
+    const bool isRun = (recSize == sizeof(LedgerRun));
+    if (isRun && !ledgerRunValid(rec.run)) continue;
+    const uint32_t ts = isRun ? rec.run.ts : rec.bucket.start;
+    if (ts >= cutoff) {
+      tmp.write((const uint8_t*)&rec, recSize);
+      kept++;
+      continue;
+    }
+    out.add(ledgerPeriodStart(ts, res), isRun ? &rec.run : nullptr, isRun ? nullptr : &rec.bucket);
+    folded++;
+  }
+  out.flush();
+  out.dst.close();
+  src.close();
+  tmp.close();
+
+  if (!LittleFS.rename(LEDGER_TMP_PATH, srcPath)) {
+    Serial.printf("Ledger: rename onto %s failed\n", srcPath);
+    return false;   // marker stays: the next recovery cuts dst back
   }
+  LittleFS.remove(LEDGER_MARK_PATH);
+  Serial.printf("Ledger: %s folded %lu -> %lu rows, kept %lu\n", srcPath,
+                (unsigned long)folded, (unsigned long)out.rows, (unsigned long)kept);
+  return true;
+}
 
-  return false;
+// Drops the oldest daily rows once day.bin outgrows its budget.
+static void ledgerTrimDays() {
+  File src = LittleFS.open(LEDGER_DAY_PATH, FILE_READ);
+  if (!src) return;
+  if (src.size() <= LEDGER_DAY_MAX_BYTES) {
+    src.close();
+    return;
+  }
+  const size_t keep = (LEDGER_DAY_MAX_BYTES * 3 / 4) / sizeof(LedgerBucket);
+  src.seek((src.size() / sizeof(LedgerBucket) - keep) * sizeof(LedgerBucket));
+
+  File tmp = LittleFS.open(LEDGER_TMP_PATH, FILE_WRITE, true);
+  LedgerBucket b;
+  while (tmp && src.read((uint8_t*)&b, sizeof(b)) == sizeof(b)) tmp.write((const uint8_t*)&b, sizeof(b));
+  src.close();
+  if (!tmp) return;
+  tmp.close();
+  LittleFS.rename(LEDGER_TMP_PATH, LEDGER_DAY_PATH);
 }
 
+// Finishes or undoes a fold that didn't get past its rename. With tmp.bin still there
+// the source wasn't replaced, so the rows appended to dst are cut off again (copied
+// through tmp.bin; a reset mid-cut leaves tmp.bin and the marker, and this repeats).
+// Without tmp.bin the rename went through and dst is kept as is.
+static void ledgerRecoverFold() {
+  File m = LittleFS.open(LEDGER_MARK_PATH, FILE_READ);
+  if (!m) return;
+  LedgerFoldMark mark = {};
+  const bool ok = m.read((uint8_t*)&mark, sizeof(mark)) == sizeof(mark) && mark.magic == LEDGER_MARK_MAGIC;
+  m.close();
+  mark.dstPath[sizeof(mark.dstPath) - 1] = '\0';
+
+  if (ok && LittleFS.exists(LEDGER_TMP_PATH)) {
+    File dst = LittleFS.open(mark.dstPath, FILE_READ);
+    if (dst && dst.size() > mark.dstSize) {
+      File tmp = LittleFS.open(LEDGER_TMP_PATH, FILE_WRITE, true);
+      uint8_t buf[256];
+      size_t left = mark.dstSize;
+      while (tmp && left > 0) {
+        const size_t n = dst.read(buf, min(left, sizeof(buf)));
+        if (n == 0 || tmp.write(buf, n) != n) break;
+        left -= n;
+      }
+      dst.close();
+      if (!tmp || left > 0) {
+        if (tmp) tmp.close();
+        Serial.printf("Ledger: cutting %s back failed\n", mark.dstPath);
+        return;   // keep the marker, retry on the next pass
+      }
+      tmp.close();
+      if (!LittleFS.rename(LEDGER_TMP_PATH, mark.dstPath)) return;
+      Serial.printf("Ledger: undid an interrupted fold into %s\n", mark.dstPath);
+    } else if (dst) {
+      dst.close();
+    }
+  }
+  if (LittleFS.exists(LEDGER_TMP_PATH)) LittleFS.remove(LEDGER_TMP_PATH);
+  LittleFS.remove(LEDGER_MARK_PATH);
+}
 
-// ===================== FIREBASE: Live Dose COMMAND =====================
+void ledgerCompact() {
+  const uint32_t now = (uint32_t)time(NULL);
+  if (now < LEDGER_MIN_EPOCH) return;   // cutoffs need real time
 
-// Perform one "live" dose using current per-day plan (one of the 3 doses)
-void runLiveDoseOnce() {
-  Serial.println("=== LIVE DOSE REQUESTED ===");
+  ledgerRecoverFold();
 
-  // This function is used by the web UI "dose now" action (if you keep it),
-  // and it doses one "slot" worth (SEC_PER_DOSE_*) for each pump.
-  if (SEC_PER_DOSE_KALK > 0.0f) {
-    const float ml = (SEC_PER_DOSE_KALK / 60.0f) * FLOW_KALK_ML_PER_MIN;
-    doseAndLog(1, "kalk", PIN_PUMP_KALK, ml, FLOW_KALK_ML_PER_MIN, "slot");
-  }
-  if (SEC_PER_DOSE_AFR > 0.0f) {
-    const float ml = (SEC_PER_DOSE_AFR / 60.0f) * FLOW_AFR_ML_PER_MIN;
-    doseAndLog(2, "afr", PIN_PUMP_AFR, ml, FLOW_AFR_ML_PER_MIN, "slot");
-  }
-  if (SEC_PER_DOSE_MG > 0.0f) {
-    const float ml = (SEC_PER_DOSE_MG / 60.0f) * FLOW_MG_ML_PER_MIN;
-    doseAndLog(3, "mg", PIN_PUMP_MG, ml, FLOW_MG_ML_PER_MIN, "slot");
-  }
-  if (SEC_PER_DOSE_TBD > 0.0f) {
-    const float ml = (SEC_PER_DOSE_TBD / 60.0f) * FLOW_TBD_ML_PER_MIN;
-    doseAndLog(4, "tbd", PIN_PUMP_TBD, ml, FLOW_TBD_ML_PER_MIN, "slot");
-  }
+  const uint32_t rawCutoff  = ledgerPeriodStart(now - LEDGER_RAW_DAYS  * 86400UL, LEDGER_RES_HOUR);
+  const uint32_t hourCutoff = ledgerPeriodStart(now - LEDGER_HOUR_DAYS * 86400UL, LEDGER_RES_DAY);
 
-  Serial.println("=== LIVE DOSE COMPLETE ===");
+  if (!ledgerFold(LEDGER_RAW_PATH, sizeof(LedgerRun), LEDGER_HOUR_PATH, LEDGER_RES_HOUR, rawCutoff)) return;
+  if (!ledgerFold(LEDGER_HOUR_PATH, sizeof(LedgerBucket), LEDGER_DAY_PATH, LEDGER_RES_DAY, hourCutoff)) return;
+  ledgerTrimDays();
+  ledgerCompactDue = false;
 }
 
-// Check /devices/{DEVICE_ID}/commands/liveDose
-bool firebaseCheckAndHandleLiveDose() {
-  const String path = "/devices/" + String(DEVICE_ID) + "/commands/liveDose";
-  String payload = firebaseGetJson(path);
+void ledgerBegin() {
+  if (!fsMounted) return;
+  LittleFS.mkdir(LEDGER_DIR);
+  ledgerRecoverFold();
+  // A tmp file means a compaction died before its rename; the source is intact.
+  if (LittleFS.exists(LEDGER_TMP_PATH)) LittleFS.remove(LEDGER_TMP_PATH);
+  ledgerCompactDue = true;
+}
 
-  // Typical payload:
-  // {"trigger":true,"pump":1,"ml":5}
-  if (payload.length() == 0 || payload == "null") return false;
+// loop(): hourly compaction, deferred while a query is streaming.
+void serviceLedger() {
+  if (!fsMounted) return;
+  if (millis() - lastLedgerCompactMs >= LEDGER_COMPACT_EVERY_MS) ledgerCompactDue = true;
+  if (!ledgerCompactDue || !ledgerCompactTryBegin()) return;
+  lastLedgerCompactMs = millis();
+  ledgerCompact();
+  ledgerCompactEnd();
+}
 
-  StaticJsonDocument<256> doc;
-  DeserializationError err = deserializeJson(doc, payload);
-  if (err) {
-    Serial.println("LiveDose: JSON parse error, ignoring");
-    return false;
+// Calls fn for every valid raw run at or after `from` (the raw tier covers the last
+// LEDGER_RAW_DAYS). Loop task only (blocking flash reads).
+void ledgerForEachRun(uint32_t from, void (*fn)(const LedgerRun&)) {
+  if (!fsMounted) return;
+  File f = LittleFS.open(LEDGER_RAW_PATH, FILE_READ);
+  LedgerRun r;
+  while (f && f.read((uint8_t*)&r, sizeof(r)) == sizeof(r)) {
+    if (ledgerRunValid(r) && r.ts >= from) fn(r);
   }
+  if (f) f.close();
+}
 
-  bool trigger = doc["trigger"] | false;
-  if (!trigger) return false;
+// Chunked JSON body for GET /api/ledger. Runs in the AsyncTCP task; each file is read
+// sequentially through its own handle. Rows come out at max(res, tier) granularity:
+//   raw:        {"t":..,"pump":1,"ml":..,"sec":..,"src":"schedule"}
+//   hour / day: {"t":..,"span":3600,"ml":[k,a,m,t],"runs":[k,a,m,t]}
+struct LedgerStream {
+  uint32_t  from = 0;
+  uint32_t  to   = UINT32_MAX;
+  LedgerRes res  = LEDGER_RES_RAW;
+
+  uint8_t   stage = 0;     // 0 header, 1 day file, 2 hour file, 3 raw file, 4 footer, 5 done
+  bool      opened = false;
+  File      f;
+  bool      firstRow = true;
+  LedgerBucket acc;        // fold of finer rows into `res`
+  LedgerRes accRes = LEDGER_RES_HOUR;
+  bool      haveAcc = false;
+  char      pend[192];
+  size_t    pendLen = 0;
+  size_t    pendOff = 0;
+
+  bool      held = false;  // reader reference from ledgerReaderAcquire()
+
+  ~LedgerStream() { if (f) f.close(); if (held) ledgerReaderRelease(); }
+
+  int writeBucket(const LedgerBucket& b, LedgerRes r) {
+    const uint32_t span = (r == LEDGER_RES_DAY) ? 86400UL : 3600UL;
+    const int n = snprintf(pend, sizeof(pend),
+                           "%s{\"t\":%lu,\"span\":%lu,\"ml\":[%.2f,%.2f,%.2f,%.2f],\"runs\":[%u,%u,%u,%u]}",
+                           firstRow ? "" : ",", (unsigned long)b.start, (unsigned long)span,
+                           b.ml[0], b.ml[1], b.ml[2], b.ml[3], b.runs[0], b.runs[1], b.runs[2], b.runs[3]);
+    firstRow = false;
+    return n;
+  }
 
-  int pump = doc["pump"] | 0;
-  float ml = doc["ml"] | 0.0f;
+  int writeRun(const LedgerRun& r) {
+    const int n = snprintf(pend, sizeof(pend),
+                           "%s{\"t\":%lu,\"pump\":%u,\"ml\":%.2f,\"sec\":%.1f,\"src\":\"%s\"}",
+                           firstRow ? "" : ",", (unsigned long)r.ts, r.pump, r.ml, r.sec,
+                           LEDGER_SOURCE_NAMES[r.source < LEDGER_SOURCE_COUNT ? r.source : 0]);
+    firstRow = false;
+    return n;
+  }
 
-  // Safety sanity checks
-  if (pump < 1 || pump > 4 || ml <= 0.0f) {
-    Serial.println("LiveDose: invalid pump/ml, clearing trigger");
-    String clearJson = "{\"trigger\":false,\"lastRun\":" + String((unsigned long long)getEpochMillis()) + "}";
-    firebasePutJson(path, clearJson);
-    return true;
+  int flushAcc() {
+    if (!haveAcc) return 0;
+    haveAcc = false;
+    return writeBucket(acc, accRes);
   }
 
-  int pin = -1;
-  float flow = 0.0f;
-  String pumpName;
+  // Adds a row to the running fold; returns the previous period's row once it's complete.
+  int foldInto(uint32_t start, LedgerRes r, const LedgerRun* run, const LedgerBucket* bucket) {
+    int n = 0;
+    if (haveAcc && (start != acc.start || r != accRes)) n = flushAcc();
+    if (!haveAcc) {
+      acc = {};
+      acc.start = start;
+      accRes = r;
+      haveAcc = true;
+    }
+    if (run) ledgerAddRun(acc, *run);
+    else     ledgerAddToBucket(acc, *bucket);
+    return n;
+  }
 
-  switch (pump) {
-    case 1: pin = PIN_PUMP_KALK; flow = FLOW_KALK_ML_PER_MIN; pumpName = "kalk"; break;
-    case 2: pin = PIN_PUMP_AFR;  flow = FLOW_AFR_ML_PER_MIN;  pumpName = "afr";  break;
-    case 3: pin = PIN_PUMP_MG;   flow = FLOW_MG_ML_PER_MIN;   pumpName = "mg";   break;
-    case 4: pin = PIN_PUMP_TBD;  flow = FLOW_TBD_ML_PER_MIN;  pumpName = "tbd";  break;
+  // Next row of the current tier file into pend; -1 once the tier is exhausted.
+  int nextRow() {
+    static const char* const paths[] = {LEDGER_DAY_PATH, LEDGER_HOUR_PATH, LEDGER_RAW_PATH};
+    if (!opened) {
+      f = LittleFS.open(paths[stage - 1], FILE_READ);
+      opened = true;
+    }
+    if (stage == 3) {
+      LedgerRun r;
+      while (f && f.read((uint8_t*)&r, sizeof(r)) == sizeof(r)) {
+        if (!ledgerRunValid(r) || r.ts < from || r.ts >= to) continue;
+        if (res == LEDGER_RES_RAW) return writeRun(r);
+        const int n = foldInto(ledgerPeriodStart(r.ts, res), res, &r, nullptr);
+        if (n > 0) return n;
+      }
+    } else {
+      const LedgerRes tierRes = (stage == 1) ? LEDGER_RES_DAY : LEDGER_RES_HOUR;
+      const LedgerRes outRes  = (res > tierRes) ? res : tierRes;
+      LedgerBucket b;
+      while (f && f.read((uint8_t*)&b, sizeof(b)) == sizeof(b)) {
+        if (b.start < from || b.start >= to) continue;
+        const int n = foldInto(ledgerPeriodStart(b.start, outRes), outRes, nullptr, &b);
+        if (n > 0) return n;
+      }
+    }
+    if (f) f.close();
+    return -1;
   }
 
-  if (pin < 0 || flow <= 0.0f) {
-    Serial.println("LiveDose: invalid pin/flow, clearing trigger");
-    String clearJson = "{\"trigger\":false,\"lastRun\":" + String((unsigned long long)getEpochMillis()) + "}";
-    firebasePutJson(path, clearJson);
+  bool produce() {
+    int n = 0;
+    while (n == 0) {
+      if (stage == 0) {
+        n = snprintf(pend, sizeof(pend), "{\"from\":%lu,\"to\":%lu,\"rows\":[",
+                     (unsigned long)from, (unsigned long)to);
+        stage = 1;
+      } else if (stage <= 3) {
+        // Aggregate rows end where raw rows begin
+        if (stage == 3 && res == LEDGER_RES_RAW && haveAcc) n = flushAcc();
+        else n = nextRow();
+        if (n < 0) {
+          n = 0;
+          stage++;
+          opened = false;
+        }
+      } else if (stage == 4) {
+        n = flushAcc();
+        if (n == 0) {
+          n = snprintf(pend, sizeof(pend), "]}");
+          stage = 5;
+        }
+      } else {
+        return false;
+      }
+    }
+    pendLen = (n < (int)sizeof(pend)) ? (size_t)n : sizeof(pend) - 1;
+    pendOff = 0;
     return true;
   }
 
-  // Clamp to something sane so you don't accidentally run for hours from a typo.
-  const float maxMl = 2000.0f; // adjust later if you want
-  if (ml > maxMl) ml = maxMl;
+  size_t fill(uint8_t* buf, size_t maxLen) {
+    size_t n = 0;
+    while (n < maxLen) {
+      if (pendOff >= pendLen && !produce()) break;
+      size_t take = min(maxLen - n, pendLen - pendOff);
+      memcpy(buf + n, pend + pendOff, take);
+      n += take;
+      pendOff += take;
+    }
+    return n;
+  }
+};
 
-  const float durationSec = (ml / flow) * 60.0f;
-  Serial.printf("LiveDose: pump %d (%s) pin %d, %.2f ml @ %.2f ml/min => %.2f sec\n",
-                pump, pumpName.c_str(), pin, ml, flow, durationSec);
 
-  doseAndLog(pump, pumpName, pin, ml, flow, "live");
+// ===================== DOSE ROLLUPS (RTDB doseDaily) =====================
+// Per-pump daily and hourly totals the dashboard reads instead of raw doseRuns:
+//   /devices/<id>/doseDaily/<yyyy-mm-dd> = {
+//     kalk: {ml, runs}, afr: {...}, mg: {...}, aux: {...},
+//     hours: { h09: {kalk: ml, ...}, ... }, updatedAt }
+// Runs are coalesced in RAM per (local day, hour) and flushed as one PATCH per day
+// with server-side increments, at most every ROLLUP_FLUSH_MS. A run can count twice
+// only if a PATCH lands but its response is lost; the ledger keeps the exact record.
+// Raw doseRuns older than settings/doseRunsRetentionDays (default 30, 0 = keep) are
+// pruned a page at a time.
+
+const uint32_t ROLLUP_FLUSH_MS         = 60UL * 1000UL;
+const uint32_t ROLLUP_PRUNE_EVERY_MS   = 60UL * 60UL * 1000UL;
+const int      ROLLUP_PRUNE_PAGE       = 50;
+const int      ROLLUP_DEFAULT_RETENTION_DAYS = 30;
+const int      MAX_ROLLUP_PENDING      = 48;
+
+static const char* const ROLLUP_PUMP_KEYS[4] = {"kalk", "afr", "mg", "aux"};  // dashboard names
+
+struct RollupPending {
+  uint16_t year;
+  uint8_t  mon;          // 1..12
+  uint8_t  mday;
+  uint8_t  hour;
+  float    ml[4];
+  uint16_t runs[4];
+};
 
-  // Clear trigger + record lastRun + echo values
-  StaticJsonDocument<128> out;
-  out["trigger"] = false;
-  out["lastRun"] = (unsigned long long)getEpochMillis();
-  out["pump"] = pump;
-  out["ml"] = ml;
-  String clearJson;
-  serializeJson(out, clearJson);
-  firebasePutJson(path, clearJson);
+RollupPending rollupPending[MAX_ROLLUP_PENDING];
+int      rollupPendingCount = 0;
+uint32_t lastRollupFlushMs  = 0;
+uint32_t lastRollupPruneMs  = 0;
+bool     rollupPruneMore    = true;   // first pass after boot, then hourly or while pages stay full
 
-  return true;
+void rollupAddRun(int pump, float ml) {
+  const time_t now = time(NULL);
+  if (pump < 1 || pump > 4 || ml <= 0.0f || now < (time_t)LEDGER_MIN_EPOCH) return;
+  struct tm t;
+  localtime_r(&now, &t);
+
+  RollupPending* slot = nullptr;
+  for (int i = 0; i < rollupPendingCount; i++) {
+    RollupPending& r = rollupPending[i];
+    if (r.year == t.tm_year + 1900 && r.mon == t.tm_mon + 1 && r.mday == t.tm_mday && r.hour == t.tm_hour) {
+      slot = &r;
+      break;
+    }
+  }
+  if (!slot) {
+    if (rollupPendingCount >= MAX_ROLLUP_PENDING) {
+      // Offline for days: drop the oldest hour (the ledger still has it)
+      Serial.println("Rollup: pending full, dropping oldest hour");
+      memmove(&rollupPending[0], &rollupPending[1], sizeof(RollupPending) * (MAX_ROLLUP_PENDING - 1));
+      rollupPendingCount--;
+    }
+    slot = &rollupPending[rollupPendingCount++];
+    *slot = {};
+    slot->year = (uint16_t)(t.tm_year + 1900);
+    slot->mon  = (uint8_t)(t.tm_mon + 1);
+    slot->mday = (uint8_t)t.tm_mday;
+    slot->hour = (uint8_t)t.tm_hour;
+  }
+  slot->ml[pump - 1] += ml;
+  if (slot->runs[pump - 1] < 65535) slot->runs[pump - 1]++;
 }
 
-void firebaseSyncTankSize() {
-  String path = "/devices/" + String(DEVICE_ID) + "/settings/tankSize";
-  String val = firebaseGetJson(path);
+static String rollupIncrement(float v, int decimals) {
+  return "{\".sv\":{\"increment\":" + String(v, decimals) + "}}";
+}
 
-  if (val != "" && val != "null") {
-    float gallons = val.toFloat();
-    if (gallons > 0) {
-      float newLiters = gallons * 3.78541f;
-      
-      if (abs(newLiters - TANK_VOLUME_L) > 0.1f) {
-        Serial.print("TANK UPDATE DETECTED! New Gallons: ");
-        Serial.println(gallons);
+// One PATCH for every pending hour of the first pending day. False on failure.
+static bool rollupFlushDay() {
+  const RollupPending first = rollupPending[0];   // by value: compaction below overwrites [0]
+  char day[11];
+  snprintf(day, sizeof(day), "%04u-%02u-%02u", first.year, first.mon, first.mday);
+
+  float dayMl[4]  = {0, 0, 0, 0};
+  int   dayRuns[4] = {0, 0, 0, 0};
+  String body = "{";
+  int used = 0;
+  for (int i = 0; i < rollupPendingCount; i++) {
+    const RollupPending& r = rollupPending[i];
+    if (r.year != first.year || r.mon != first.mon || r.mday != first.mday) continue;
+    char hour[4];
+    snprintf(hour, sizeof(hour), "h%02u", r.hour);
+    for (int p = 0; p < 4; p++) {
+      if (r.runs[p] == 0) continue;
+      body += "\"hours/" + String(hour) + "/" + ROLLUP_PUMP_KEYS[p] + "\":" + rollupIncrement(r.ml[p], 2) + ",";
+      dayMl[p]   += r.ml[p];
+      dayRuns[p] += r.runs[p];
+    }
+    used++;
+  }
+  for (int p = 0; p < 4; p++) {
+    if (dayRuns[p] == 0) continue;
+    body += "\"" + String(ROLLUP_PUMP_KEYS[p]) + "/ml\":"   + rollupIncrement(dayMl[p], 2) + ",";
+    body += "\"" + String(ROLLUP_PUMP_KEYS[p]) + "/runs\":" + rollupIncrement((float)dayRuns[p], 0) + ",";
+  }
+  body += "\"updatedAt\":{\".sv\":\"timestamp\"}}";
 
-        TANK_VOLUME_L = newLiters;
+  const String path = "/devices/" + String(DEVICE_ID) + "/doseDaily/" + day + ".json";
+  if (!firebasePatchJson(path, body)) return false;
 
-        // Baseline is 300g (1135.6L)
-        float scaleFactor = 1135.6f / TANK_VOLUME_L;
+  // Drop the flushed day, keep the rest in order
+  int w = 0;
+  for (int i = 0; i < rollupPendingCount; i++) {
+    const RollupPending& r = rollupPending[i];
+    if (r.year == first.year && r.mon == first.mon && r.mday == first.mday) continue;
+    rollupPending[w++] = r;
+  }
+  rollupPendingCount = w;
+  Serial.printf("Rollup: flushed %d hour(s) of %s\n", used, day);
+  return true;
+}
 
-        // 1. Kalk Scaling
-        DKH_PER_ML_KALK_TANK    = 0.00010f * scaleFactor; 
-        CA_PPM_PER_ML_KALK_TANK = 0.00070f * scaleFactor;
+// Firebase push IDs start with the creation time in ms, 8 chars of this alphabet,
+// so "endAt=<prefix>" on $key selects everything pushed before that time (no index needed).
+static String pushIdPrefix(uint64_t ms) {
+  static const char* const PUSH_CHARS = "-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
+  char out[9];
+  for (int i = 7; i >= 0; i--) {
+    out[i] = PUSH_CHARS[ms % 64];
+    ms /= 64;
+  }
+  out[8] = 0;
+  return String(out);
+}
 
-        // 2. AFR Scaling (Scaling all 3 impacts)
-        DKH_PER_ML_AFR_TANK     = 0.0052f  * scaleFactor; // Fixed typo (AF -> AFR)
-        CA_PPM_PER_ML_AFR_TANK  = 0.037f   * scaleFactor; // Added
-        MG_PPM_PER_ML_AFR_TANK  = 0.006f   * scaleFactor; // Added
+// Deletes one page of doseRuns older than the retention window.
+static void rollupPruneDoseRuns() {
+  const String base = "/devices/" + String(DEVICE_ID);
+  int days = ROLLUP_DEFAULT_RETENTION_DAYS;
+  String val = firebaseGetJson(base + "/settings/doseRunsRetentionDays");
+  if (val != "" && val != "null") days = val.toInt();
+  if (days <= 0) {
+    rollupPruneMore = false;
+    return;
+  }
 
-        // 3. Magnesium Pump Scaling
-        MG_PPM_PER_ML_MG_TANK   = 0.20f    * scaleFactor; // Added
+  const uint64_t cutoffMs = getEpochMillis() - (uint64_t)days * 86400000ULL;
+  const String path = base + "/doseRuns.json?orderBy=%22%24key%22&endAt=%22" + pushIdPrefix(cutoffMs) +
+                      "%22&limitToFirst=" + String(ROLLUP_PRUNE_PAGE);
 
-        updatePumpSchedules(); 
-      }
-    }
+  JsonDocument filter;
+  filter["*"]["ts"] = true;    // keys are all we need
+  JsonDocument doc;
+  if (!firebaseGetJsonDoc(path, doc, &filter)) return;
+
+  String body = "{";
+  int n = 0;
+  for (JsonPair kv : doc.as<JsonObject>()) {
+    if (n++) body += ",";
+    body += "\"" + String(kv.key().c_str()) + "\":null";
+  }
+  body += "}";
+  rollupPruneMore = (n >= ROLLUP_PRUNE_PAGE);
+  if (n == 0) return;
+
+  if (firebasePatchJson(base + "/doseRuns.json", body)) {
+    Serial.printf("Rollup: pruned %d doseRuns older than %d days\n", n, days);
+  } else {
+    rollupPruneMore = false;   // try again next hour
   }
 }
-// Pull /settings/doseSchedule.json and apply changes.
-// Expected shape:
-// { "enabled": true, "startHour": 0, "endHour": 9, "everyMin": 15, "updatedAt": 1234567890 }
-void firebaseSyncDoseScheduleOnce() {
-  String path = "/devices/" + String(DEVICE_ID) + "/settings/doseSchedule.json";
-  String payload = firebaseGetJson(path);
-  if (payload.length() == 0 || payload == "null") return;
 
-  JsonDocument doc;
-  DeserializationError err = deserializeJson(doc, payload);
-  if (err) return;
+// loop(): flush coalesced totals, then prune old raw runs.
+void serviceDoseRollups() {
+  if (WiFi.status() != WL_CONNECTED) return;
+  const uint32_t nowMs = millis();
 
-  bool enabled    = doc["enabled"]   | false;
-  int  startHour  = doc["startHour"] | 0;
-  int  endHour    = doc["endHour"]   | 0;
-  int  everyMin   = doc["everyMin"]  | 60;
+  if (rollupPendingCount > 0 && nowMs - lastRollupFlushMs >= ROLLUP_FLUSH_MS) {
+    lastRollupFlushMs = nowMs;
+    rollupFlushDay();
+    return;
+  }
 
-  // --- THE NEW GATEKEEPER ---
-  // Compare current values against the NEW values from Firebase
-  if (enabled == doseScheduleCfg.enabled &&
-      startHour == doseScheduleCfg.startHour &&
-      endHour == doseScheduleCfg.endHour &&
-      everyMin == doseScheduleCfg.everyMin) {
-      // Everything is the same. Exit quietly.
-      return; 
+  if (nowMs - lastRollupPruneMs >= ROLLUP_PRUNE_EVERY_MS) rollupPruneMore = true;
+  if (rollupPruneMore && time(NULL) >= (time_t)LEDGER_MIN_EPOCH && nowMs - lastRollupFlushMs >= ROLLUP_FLUSH_MS) {
+    lastRollupPruneMs = nowMs;
+    lastRollupFlushMs = nowMs;   // pace prune pages like flushes
+    rollupPruneDoseRuns();
   }
+}
 
-  // If we got here, something actually changed!
-  Serial.println(">>> New Dose Schedule detected. Updating...");
+// Log a finished run to the ledger, the doseDaily rollups and RTDB doseRuns.
+bool recordDoseRun(int pumpIndex, const String& pumpName, float ml, float durationSec,
+                   float flowMlPerMin, const String& source) {
+  ledgerRecordRun(pumpIndex, ml, durationSec, source);
+  rollupAddRun(pumpIndex, ml);
+  return firebaseLogDoseRun(pumpIndex, pumpName, ml, durationSec, flowMlPerMin, source);
+}
 
-  doseScheduleCfg.enabled = enabled;
-  doseScheduleCfg.startHour = clampInt(startHour, 0, 23);
-  doseScheduleCfg.endHour   = clampInt(endHour,   0, 23);
-  doseScheduleCfg.everyMin  = clampInt(everyMin,  1, 240);
 
-  rebuildScheduleSlots();
-  doseSlotsPrimed = false;
-  primeDoseSlotsForToday();
-  updatePumpSchedules(); 
-  clearPendingBuckets("schedule changed");
-  
-  Serial.println(">>> Schedule update complete.");
+// ===================== SAFETY: ROLLING 24H DELIVERY GOVERNOR =====================
+// enforceChemSafetyCaps() only limits the plan. This limits what actually goes in:
+// every pump run (schedule, catch-up, live) asks for headroom first and is shortened
+// or refused so the last 24h stay under MAX_*_ML_PER_DAY per pump and under the
+// daily alk/Ca/Mg rise those ml imply. Calibration runs go into a cup, not the tank:
+// they're exempt, bounded by CALIBRATE_MAX_SEC instead, and their ledger rows
+// (LEDGER_SRC_CALIBRATE) are skipped when the window is seeded. Delivered ml land in 24 hourly
+// buckets per pump with running sums, so a check or a record is O(1). The clock is
+// uptime (immune to NTP jumps); at boot the window is seeded from the dose ledger.
+
+const int   GOVERNOR_BUCKETS     = 24;    // 1h each
+const float GOVERNOR_MIN_RUN_SEC = 0.5f;  // below this the run is refused outright
+
+float    governorMl[4][GOVERNOR_BUCKETS];
+float    governorSumMl[4]  = {0, 0, 0, 0};
+int32_t  governorHour      = -1;          // hour index of the newest bucket
+uint32_t governorLimitedRuns = 0;
+String   governorAlertBody;               // queued by governorAllowedSec(), sent from loop()
+String   governorAlertWhen;
+
+// Uptime hours, offset by a day so runs from before this boot map to valid indexes.
+static int32_t governorHourNow() {
+  return (int32_t)((esp_timer_get_time() / 1000000LL + 86400LL) / 3600LL);
 }
 
+// Roll the window forward; expired buckets drop out of the running sums.
+static void governorAdvance(int32_t hour) {
+  if (governorHour < 0) governorHour = hour;
+  if (hour <= governorHour) return;
+  const int32_t steps = min((int32_t)GOVERNOR_BUCKETS, hour - governorHour);
+  for (int32_t h = governorHour + 1; h <= governorHour + steps; h++) {
+    const int slot = h % GOVERNOR_BUCKETS;
+    for (int p = 0; p < 4; p++) {
+      governorSumMl[p] -= governorMl[p][slot];
+      governorMl[p][slot] = 0.0f;
+    }
+  }
+  governorHour = hour;
+  for (int p = 0; p < 4; p++) if (governorSumMl[p] < 0.0f) governorSumMl[p] = 0.0f;
+}
 
+// ml < 0 refunds part of an earlier reservation (see pumpDriverTake()).
+static void governorAddAt(int pump, float ml, int32_t hour) {
+  if (pump < 1 || pump > 4 || ml == 0.0f) return;
+  governorAdvance(governorHourNow());
+  if (hour <= governorHour - GOVERNOR_BUCKETS) return;   // already outside the window
+  float& bucket = governorMl[pump - 1][hour % GOVERNOR_BUCKETS];
+  if (ml < -bucket) ml = -bucket;
+  bucket += ml;
+  governorSumMl[pump - 1] += ml;
+  if (governorSumMl[pump - 1] < 0.0f) governorSumMl[pump - 1] = 0.0f;
+}
 
-// ===================== FIREBASE: CALIBRATE COMMAND =====================
-// UI writes:
-//  devices/<id>/commands/calibrate = {trigger:true, pump:1..4, durationSec:60, ts:<ms>}
-// ESP32 runs that pump for durationSec seconds, then clears trigger and stores lastRun.
-int pumpNumToPin(int pump) {
+void governorRecord(int pump, float ml) {
+  governorAddAt(pump, ml, governorHourNow());
+}
+
+static float governorMaxMlPerDay(int pump) {
   switch (pump) {
-    case 1: return PIN_PUMP_KALK;
-    case 2: return PIN_PUMP_AFR;
-    case 3: return PIN_PUMP_MG;
-    case 4: return PIN_PUMP_TBD;
-    default: return -1;
+    case 1: return MAX_KALK_ML_PER_DAY;
+    case 2: return MAX_AFR_ML_PER_DAY;
+    case 3: return MAX_MG_ML_PER_DAY;
+    case 4: return MAX_TBD_ML_PER_DAY;
   }
+  return 0.0f;
 }
-//////////////////////////////////////////////////////////////////////////////////
-// Pull /devices/<id>/settings/dosingMlPerDay and apply if changed.
-// Expected JSON: {"kalk":123,"afr":45,"mg":6,"tbd":0,"updatedAt":123456}
-// Pull /devices/<id>/dosingPlan and apply if changed.
-// Expected JSON: {"kalk":120,"afr":40,"mg":10,"tbd":0, ...}
-// We IGNORE "alk" (it's not a dose; sometimes a string).
-void firebaseSyncDosingPlanOnce() {
-  String path = "/devices/" + String(DEVICE_ID) + "/dosingPlan.json";
-  String payload = firebaseGetJson(path);
 
-  Serial.println("DOSING PLAN payload: " + payload);
-  if (payload.length() == 0 || payload == "null") return;
+// Tank rise per ml for each pump (alk dKH, Ca ppm, Mg ppm), from the reagent registry.
+static void governorRisePerMl(int pump, float& alk, float& ca, float& mg) {
+  alk = reagentEffectPerMl(pump, PARAM_ALK);
+  ca  = reagentEffectPerMl(pump, PARAM_CA);
+  mg  = reagentEffectPerMl(pump, PARAM_MG);
+}
 
-  StaticJsonDocument<256> doc;
-  DeserializationError err = deserializeJson(doc, payload);
-  if (err) return;
+// Rise delivered over the window, summed over all pumps.
+static void governorWindowRise(float& alk, float& ca, float& mg) {
+  alk = ca = mg = 0.0f;
+  for (int p = 1; p <= 4; p++) {
+    float a, c, m;
+    governorRisePerMl(p, a, c, m);
+    alk += governorSumMl[p - 1] * a;
+    ca  += governorSumMl[p - 1] * c;
+    mg  += governorSumMl[p - 1] * m;
+  }
+}
 
-  // helper: accept float or string
-  auto readFloat = [&](const char* key, float fallback) -> float {
-    if (!doc.containsKey(key)) return fallback;
-    JsonVariant v = doc[key];
-    if (v.is<float>() || v.is<int>() || v.is<double>()) return (float)v.as<double>();
-    if (v.is<const char*>()) return String(v.as<const char*>()).toFloat();
-    return fallback;
-  };
+// ml this pump may still deliver without breaking a 24h limit.
+float governorHeadroomMl(int pump) {
+  if (pump < 1 || pump > 4) return 0.0f;
+  governorAdvance(governorHourNow());
+
+  float head = governorMaxMlPerDay(pump) - governorSumMl[pump - 1];
+  float alk, ca, mg, alkPerMl, caPerMl, mgPerMl;
+  governorWindowRise(alk, ca, mg);
+  governorRisePerMl(pump, alkPerMl, caPerMl, mgPerMl);
+  if (alkPerMl > 0.0f) head = min(head, (MAX_ALK_RISE_DKH_PER_DAY - alk) / alkPerMl);
+  if (caPerMl  > 0.0f) head = min(head, (MAX_CA_RISE_PPM_PER_DAY  - ca)  / caPerMl);
+  if (mgPerMl  > 0.0f) head = min(head, (MAX_MG_RISE_PPM_PER_DAY  - mg)  / mgPerMl);
+  return max(0.0f, head);
+}
 
-  float nk = readFloat("kalk", dosing.ml_per_day_kalk);
-  float na = readFloat("afr",  dosing.ml_per_day_afr);
-  float nm = readFloat("mg",   dosing.ml_per_day_mg);
-  float nt = readFloat("tbd",  dosing.ml_per_day_tbd); // optional, default stays
+// pumpDriverStart() / slotRunnerStart(): how long this pin may run (<= seconds).
+// When it has to cut, the alert is only queued: this sits on the actuation path.
+float governorAllowedSec(int pin, float seconds) {
+  const int   pump = pinToPumpNum(pin);
+  const float flow = pinFlowMlPerMin(pin);
+  if (pump < 1 || flow <= 0.0f) return seconds;
+
+  const float headMl  = governorHeadroomMl(pump);
+  const float wantMl  = seconds * flow / 60.0f;
+  if (wantMl <= headMl + 0.01f) return seconds;   // slack: an already clamped run passes again
+
+  const float allowed = headMl * 60.0f / flow;
+  governorLimitedRuns++;
+  Serial.printf("GOVERNOR: pump %d wants %.1fml, 24h headroom %.1fml (%.1fml delivered)\n",
+                pump, wantMl, headMl, governorSumMl[pump - 1]);
+  governorAlertBody = "pump=" + String(pump) + " want=" + String(wantMl, 1) + "ml allowed=" + String(headMl, 1) + "ml";
+  governorAlertWhen = getLocalTimeString();
+  return (allowed < GOVERNOR_MIN_RUN_SEC) ? 0.0f : allowed;
+}
 
-  // Basic sanity
-  if (!isfinite(nk) || nk < 0) nk = dosing.ml_per_day_kalk;
-  if (!isfinite(na) || na < 0) na = dosing.ml_per_day_afr;
-  if (!isfinite(nm) || nm < 0) nm = dosing.ml_per_day_mg;
-  if (!isfinite(nt) || nt < 0) nt = dosing.ml_per_day_tbd;
+// loop(): send the newest queued governor alert.
+void serviceGovernorAlert() {
+  if (!governorAlertBody.length() || WiFi.status() != WL_CONNECTED) return;
+  firebasePushAlert("safety",
+                    "Dose limited by 24h governor",
+                    governorAlertBody,
+                    governorAlertWhen,
+                    "governor",
+                    60ULL*60ULL*1000ULL);  // 1 hour
+  governorAlertBody = "";
+}
 
-  // Clamp to safety caps
-  nk = clampf(nk, 0.0f, MAX_KALK_ML_PER_DAY);
-  na = clampf(na, 0.0f, MAX_AFR_ML_PER_DAY);
-  nm = clampf(nm, 0.0f, MAX_MG_ML_PER_DAY);
-  nt = clampf(nt, 0.0f, MAX_TBD_ML_PER_DAY);
+static void governorSeedRun(const LedgerRun& r) {
+  if (r.source == LEDGER_SRC_CALIBRATE) return;   // into a cup, not the tank
+  const int64_t ageSec = (int64_t)time(NULL) - (int64_t)r.ts;
+  if (ageSec < 0) return;
+  governorAddAt(r.pump, r.ml, governorHourNow() - (int32_t)(ageSec / 3600));
+}
 
-  auto diff = [](float a, float b){ return fabsf(a-b); };
-  bool changed =
-      diff(nk, dosing.ml_per_day_kalk) > 0.01f ||
-      diff(na, dosing.ml_per_day_afr)  > 0.01f ||
-      diff(nm, dosing.ml_per_day_mg)   > 0.01f ||
-      diff(nt, dosing.ml_per_day_tbd)  > 0.01f;
+bool governorSeeded = false;
+
+// Once LittleFS is up and the clock is set: refill the window from the last 24h of
+// ledger runs. Without a clock it does nothing; serviceFastBoot() calls it again
+// after NTP syncs.
+void governorSeedFromLedger() {
+  const uint32_t now = (uint32_t)time(NULL);
+  if (governorSeeded || now < LEDGER_MIN_EPOCH) return;
+  governorSeeded = true;
+  ledgerForEachRun(now - 86400UL, governorSeedRun);
+  Serial.printf("GOVERNOR: last 24h KALK=%.1f AFR=%.1f MG=%.1f TBD=%.1f ml\n",
+                governorSumMl[0], governorSumMl[1], governorSumMl[2], governorSumMl[3]);
+}
 
-  if (!changed) return;
+String governorSummaryJson() {
+  governorAdvance(governorHourNow());
+  float alk, ca, mg;
+  governorWindowRise(alk, ca, mg);
+  String json = "{\"ml24h\":[";
+  for (int p = 0; p < 4; p++) {
+    if (p) json += ",";
+    json += String(governorSumMl[p], 1);
+  }
+  json += "],\"alkRise\":" + String(alk, 3);
+  json += ",\"caRise\":" + String(ca, 2);
+  json += ",\"mgRise\":" + String(mg, 2);
+  json += ",\"limited\":" + String(governorLimitedRuns) + "}";
+  return json;
+}
 
-  Serial.printf(">>> Dosing plan UPDATED from /dosingPlan: kalk=%.2f afr=%.2f mg=%.2f tbd=%.2f\n",
-                nk, na, nm, nt);
 
-  dosing.ml_per_day_kalk = nk;
-  dosing.ml_per_day_afr  = na;
-  dosing.ml_per_day_mg   = nm;
-  dosing.ml_per_day_tbd  = nt;
+// ===================== OUTAGE CATCH-UP =====================
+// primeDoseSlotsForToday() marks every slot that passed while we were down (or had
+// no time) as done. Instead of writing that volume off, the slots scheduled between
+// the last slot that fired (lastSlotEpoch, persisted) and now are priced at the
+// current plan and profile, up to catchUpCfg.maxHours back, together with whatever
+// was left in the pending buckets. The total is cut so plan + replay stays inside
+// the daily rise limits enforceChemSafetyCaps() uses, then replayed on top of the
+// coming slots: 1/spreadSlots of it per slot, never more than maxSlotFactor x an
+// average slot share. The 24h governor still bounds every run.
 
-  updatePumpSchedules();
-  saveDosingToPrefs();
-  clearPendingBuckets("plan changed");
+static int catchUpSlotStartMin(int i) {
+  if (doseScheduleCfg.enabled) {
+    return clampInt(doseScheduleCfg.startHour, 0, 23) * 60 + i * clampInt(doseScheduleCfg.everyMin, 1, 240);
+  }
+  return DOSE_HOURS[i] * 60 + DOSE_MINUTES[i];
 }
-///////////////////////////////////////////////////////////////////////////////
 
-bool firebaseCheckAndHandleCalibrate() {
-  if (WiFi.status() != WL_CONNECTED) return false;
+// Local midnight `daysAgo` days before `now`.
+static uint32_t catchUpMidnight(const tm& now, int daysAgo) {
+  tm d = now;
+  d.tm_hour = d.tm_min = d.tm_sec = 0;
+  d.tm_mday -= daysAgo;
+  d.tm_isdst = -1;
+  return (uint32_t)mktime(&d);
+}
 
-  String path = "/devices/" + String(DEVICE_ID) + "/commands/calibrate";
-  String payload = firebaseGetJson(path);
-  if (payload.length() == 0 || payload == "null") return false;
+// Plan volume of the slots scheduled in (from, to]. Windows that started up to
+// a day before the oldest covered day are included (they can wrap past midnight).
+static int catchUpMissedSlots(const tm& now, uint32_t from, uint32_t to, float missed[4]) {
+  const float plan[4] = {dosing.ml_per_day_kalk, dosing.ml_per_day_afr, dosing.ml_per_day_mg, dosing.ml_per_day_tbd};
+  int n = 0;
+  for (int k = (int)((to - from) / 86400UL) + 1; k >= 0; k--) {
+    const uint32_t base = catchUpMidnight(now, k);
+    for (int i = 0; i < DOSE_SLOTS_PER_DAY; i++) {
+      const uint32_t e = base + (uint32_t)catchUpSlotStartMin(i) * 60UL;
+      if (e <= from || e > to) continue;
+      n++;
+      for (int p = 0; p < 4; p++) missed[p] += plan[p] * slotShare[p][i];
+    }
+  }
+  return n;
+}
 
-  Serial.print("calibrate payload: ");
-  Serial.println(payload);
+// Largest fraction of `ml` that fits next to the plan under the daily rise limits.
+static float catchUpRiseScale(const float ml[4]) {
+  const int   params[3]  = {PARAM_ALK, PARAM_CA, PARAM_MG};
+  const float maxRise[3] = {MAX_ALK_RISE_DKH_PER_DAY, MAX_CA_RISE_PPM_PER_DAY, MAX_MG_RISE_PPM_PER_DAY};
+  float scale = 1.0f;
+  for (int k = 0; k < 3; k++) {
+    float rise = 0.0f;
+    for (int p = 0; p < 4; p++) rise += ml[p] * reagentEffectPerMl(p + 1, params[k]);
+    const float head = max(0.0f, maxRise[k] - planRise(params[k]));
+    if (rise > head && rise > 0.0f) scale = min(scale, head / rise);
+  }
+  return scale;
+}
 
-  // trigger
-  int trigIdx = payload.indexOf("\"trigger\"");
-  if (trigIdx < 0) return false;
-  int colonIdx = payload.indexOf(':', trigIdx);
-  if (colonIdx < 0) return false;
-  String valStr = payload.substring(colonIdx + 1);
-  valStr.trim();
-  bool trigger = valStr.startsWith("true");
+// Right after primeDoseSlotsForToday() (boot, or time arriving late). Replaces the
+// old "clear the buckets" step; with catch-up off (or no slot on record) it still is.
+void catchUpAfterPrime() {
+  float* const pending[4] = {&pendingKalkMl, &pendingAfrMl, &pendingMgMl, &pendingTbdMl};
+  const uint32_t nowEpoch = (uint32_t)time(NULL);
+  struct tm now;
+  if (!catchUpCfg.enabled || lastSlotEpoch == 0 || nowEpoch <= lastSlotEpoch ||
+      !getLocalTime(&now, 0) || !isTimeValid(now)) {
+    clearPendingBuckets("boot prime");
+    return;
+  }
 
-  if (!trigger) return false;
+  const uint32_t horizon = (uint32_t)catchUpCfg.maxHours * 3600UL;
+  const uint32_t from = (nowEpoch - lastSlotEpoch > horizon) ? nowEpoch - horizon : lastSlotEpoch;
+  float total[4] = {0, 0, 0, 0};
+  const int missedSlots = catchUpMissedSlots(now, from, nowEpoch, total);
+  for (int p = 0; p < 4; p++) {
+    total[p] += catchUpMl[p] + *pending[p];
+    *pending[p] = 0.0f;
+  }
 
-  // pump number (default 1)
-  int pump = 1;
-  int pIdx = payload.indexOf("\"pump\"");
-  if (pIdx >= 0) {
-    int pColon = payload.indexOf(':', pIdx);
-    if (pColon >= 0) {
-      String pStr = payload.substring(pColon + 1);
-      pStr.trim();
-      pump = pStr.toInt();
-    }
+  const float scale = catchUpRiseScale(total);
+  const float plan[4] = {dosing.ml_per_day_kalk, dosing.ml_per_day_afr, dosing.ml_per_day_mg, dosing.ml_per_day_tbd};
+  const int slots = max(1, DOSE_SLOTS_PER_DAY);
+  for (int p = 0; p < 4; p++) {
+    catchUpMl[p] = total[p] * scale;
+    catchUpPerSlotMl[p] = min(catchUpMl[p] / max(1, catchUpCfg.spreadSlots),
+                              catchUpCfg.maxSlotFactor * plan[p] / slots);
+    if (catchUpPerSlotMl[p] <= 0.0f) catchUpMl[p] = 0.0f;   // pump has no plan: nothing to ride on
   }
 
-  // duration seconds (default 60)
-  int durationSec = 60;
-  int dIdx = payload.indexOf("\"durationSec\"");
-  if (dIdx >= 0) {
-    int dColon = payload.indexOf(':', dIdx);
-    if (dColon >= 0) {
-      String dStr = payload.substring(dColon + 1);
-      dStr.trim();
-      durationSec = dStr.toInt();
-      if (durationSec <= 0) durationSec = 60;
-      if (durationSec > 300) durationSec = 300; // safety cap
-    }
+  Serial.printf("Catch-up: %d missed slots since %lu, replaying KALK=%.1f AFR=%.1f MG=%.1f TBD=%.1f ml "
+                "(scale %.2f, per slot %.1f/%.1f/%.1f/%.1f)\n",
+                missedSlots, (unsigned long)lastSlotEpoch,
+                catchUpMl[0], catchUpMl[1], catchUpMl[2], catchUpMl[3], scale,
+                catchUpPerSlotMl[0], catchUpPerSlotMl[1], catchUpPerSlotMl[2], catchUpPerSlotMl[3]);
+  configCommit();
+  wsPublishPending();
+}
+
+// maybeDosePumpsRealTime(): this slot's share of the replay, per pump.
+void catchUpTakeForSlot(float extraMl[4]) {
+  for (int p = 0; p < 4; p++) {
+    extraMl[p] = min(catchUpMl[p], catchUpPerSlotMl[p]);
+    catchUpMl[p] -= extraMl[p];
+    if (catchUpMl[p] < 0.01f) catchUpMl[p] = 0.0f;
   }
+}
 
-  int pin = pumpNumToPin(pump);
-  if (pin < 0) {
-    Serial.println("Calibrate: invalid pump number");
+String catchUpSummaryJson() {
+  String json = "{\"enabled\":" + String(catchUpCfg.enabled ? "true" : "false") + ",\"ml\":[";
+  for (int p = 0; p < 4; p++) {
+    if (p) json += ",";
+    json += String(catchUpMl[p], 1);
+  }
+  json += "],\"lastSlot\":" + String((unsigned long)lastSlotEpoch) + "}";
+  return json;
+}
+
+
+// ===================== DOSE JOURNAL (WRITE-AHEAD) =====================
+// Every pump run is journaled before the pin goes HIGH so a reboot mid-dose
+// (brownout, watchdog, OTA restart) neither drops nor repeats volume. Pumps can run
+// concurrently (packed slots), so there is one journal entry per pump.
+//  - NVS ("journal"/"run1".."run4"): written at start and when the run is closed out.
+//    Survives power loss but holds no progress.
+//  - RTC slow memory: same record plus the run time so far, updated while the
+//    pump runs. Survives resets but not power loss.
+// At boot doseJournalReconcile() works out what was delivered: the RTC progress
+// when it matches the NVS record, otherwise the full planned run (we'd rather
+// under-dose by one run than dose it twice). The delivered part is logged as a
+// "recovered" run; an undelivered scheduled remainder goes back into its bucket.
+
+const uint32_t DOSE_JOURNAL_MAGIC = 0x444A524EUL;   // "DJRN"
+
+enum DoseJournalState : uint8_t { JOURNAL_IDLE, JOURNAL_RUNNING, JOURNAL_DELIVERED, JOURNAL_RECOVERED };
+enum DoseJournalKind  : uint8_t {
+  JOURNAL_SCHEDULE, JOURNAL_LIVE,
+  JOURNAL_CALIBRATE = 0xFE,   // into a cup: not journaled, own pump guard bound
+  JOURNAL_NONE = 0xFF,        // not journaled
+};
+
+const uint8_t DOSE_JOURNAL_BOOKED = 0x01;   // recovered run is in the ledger / rollups / SLA
+
+static inline bool doseJournalTracks(uint8_t kind) {
+  return kind == JOURNAL_SCHEDULE || kind == JOURNAL_LIVE;
+}
+
+struct DoseJournalEntry {
+  uint32_t magic;
+  uint32_t seq;
+  uint8_t  state;
+  uint8_t  pump;          // 1..4
+  uint8_t  kind;
+  uint8_t  flags;         // DOSE_JOURNAL_BOOKED
+  uint32_t startEpoch;
+  float    plannedSec;
+  float    flowMlPerMin;
+  float    ranSec;        // progress (RTC copy) or reconciled run time
+  uint32_t crc;
+};
+
+RTC_NOINIT_ATTR DoseJournalEntry doseJournalRtc[4];   // by pump - 1
+uint32_t doseJournalSeq = 0;
+uint8_t  doseJournalNeedsLog = 0;          // bit per pump: recovered run not yet in RTDB
+uint32_t doseJournalBookedSeq[4] = {};     // newest schedule run already settled in its bucket (RTC snapshot)
+DoseJournalEntry doseJournalRecovered[4] = {};
+
+static uint32_t doseJournalCrc(const DoseJournalEntry& e) {
+  return crc32Bytes(&e, offsetof(DoseJournalEntry, crc));
+}
+
+static bool doseJournalValid(const DoseJournalEntry& e) {
+  return e.magic == DOSE_JOURNAL_MAGIC && e.crc == doseJournalCrc(e) && e.pump >= 1 && e.pump <= 4;
+}
+
+static void doseJournalSeal(DoseJournalEntry& e) {
+  e.magic = DOSE_JOURNAL_MAGIC;
+  e.crc = doseJournalCrc(e);
+}
+
+static void doseJournalKey(int pump, char key[5]) {
+  snprintf(key, 5, "run%d", pump);
+}
+
+static void doseJournalWriteFlash(const DoseJournalEntry& e) {
+  NvsPrefs prefs;
+  if (!prefs.begin("journal", false)) {
+    Serial.println("Prefs: failed to open journal (write)");
+    return;
+  }
+  char key[5];
+  doseJournalKey(e.pump, key);
+  prefs.putBytes(key, &e, sizeof(e));
+  prefs.end();
+}
+
+// A new run may take over the pump's journal slot once a recovered run there is
+// booked locally; only its RTDB post may still be owed (kept in RAM until sent).
+bool doseJournalCanBegin(int pump) {
+  if (pump < 1 || pump > 4) return true;
+  return !(doseJournalNeedsLog & (1 << (pump - 1))) || (doseJournalRecovered[pump - 1].flags & DOSE_JOURNAL_BOOKED);
+}
+
+// Before the pump starts.
+void doseJournalBegin(int pump, DoseJournalKind kind, float plannedSec, float flowMlPerMin) {
+  if (pump < 1 || pump > 4 || !doseJournalTracks(kind)) return;
+  DoseJournalEntry e = {};
+  e.seq          = ++doseJournalSeq;
+  e.state        = JOURNAL_RUNNING;
+  e.pump         = (uint8_t)pump;
+  e.kind         = kind;
+  e.startEpoch   = epochSeconds();
+  e.plannedSec   = plannedSec;
+  e.flowMlPerMin = flowMlPerMin;
+  doseJournalSeal(e);
+  doseJournalRtc[pump - 1] = e;
+  doseJournalWriteFlash(e);
+}
+
+// While the pump runs (RTC only, cheap; called from the pump driver tick).
+void doseJournalProgress(int pump, float ranSec) {
+  if (pump < 1 || pump > 4) return;
+  DoseJournalEntry& e = doseJournalRtc[pump - 1];
+  if (e.state != JOURNAL_RUNNING) return;
+  e.ranSec = ranSec;
+  doseJournalSeal(e);
+}
+
+// Pump is off; run time is final but the run isn't logged/booked yet (RTC only).
+void doseJournalDelivered(int pump, float ranSec) {
+  if (pump < 1 || pump > 4) return;
+  DoseJournalEntry& e = doseJournalRtc[pump - 1];
+  if (e.state != JOURNAL_RUNNING) return;
+  e.state  = JOURNAL_DELIVERED;
+  e.ranSec = ranSec;
+  doseJournalSeal(e);
+}
+
+// Run logged and its bucket updated: nothing left to recover.
+void doseJournalCommit(int pump) {
+  if (pump < 1 || pump > 4) return;
+  DoseJournalEntry& e = doseJournalRtc[pump - 1];
+  if (e.state == JOURNAL_IDLE || !doseJournalValid(e)) return;
+  if (e.state == JOURNAL_RECOVERED && (doseJournalNeedsLog & (1 << (pump - 1)))) return;   // still owed to RTDB
+  e.state = JOURNAL_IDLE;
+  doseJournalSeal(e);
+  doseJournalWriteFlash(e);
+}
+
+static float* pendingBucketForPump(int pump) {
+  switch (pump) {
+    case 1: return &pendingKalkMl;
+    case 2: return &pendingAfrMl;
+    case 3: return &pendingMgMl;
+    case 4: return &pendingTbdMl;
+    default: return nullptr;
+  }
+}
+
+static const char* pumpNameForNum(int pump) {
+  static const char* const names[4] = {"kalk", "afr", "mg", "tbd"};
+  return (pump >= 1 && pump <= 4) ? names[pump - 1] : "?";
+}
+
+// Boot, before anything doses. No network; a few NVS reads at most.
+static void doseJournalReconcilePump(int pump, const DoseJournalEntry& flash) {
+  DoseJournalEntry& rtc = doseJournalRtc[pump - 1];
+  const bool rtcOk = doseJournalValid(rtc) && rtc.pump == pump;
+  if (flash.state == JOURNAL_IDLE) return;
+  if (flash.state == JOURNAL_RECOVERED) {          // reconciled last boot, log still owed
+    doseJournalRecovered[pump - 1] = flash;
+    doseJournalNeedsLog |= (uint8_t)(1 << (pump - 1));
+    return;
+  }
+
+  DoseJournalEntry e = flash;
+  const bool haveProgress = rtcOk && rtc.seq == flash.seq && rtc.state != JOURNAL_IDLE;
+  if (haveProgress) {
+    e.ranSec = rtc.ranSec;
   } else {
-    Serial.printf("Calibrate: running pump %d on pin %d for %d sec...\n", pump, pin, durationSec);
-    giveDose(pin, (float)durationSec);
-Serial.println("Calibrate: done.");
+    e.ranSec = e.plannedSec;   // power was lost: assume the run completed
   }
+  if (e.ranSec > e.plannedSec) e.ranSec = e.plannedSec;
+  if (e.ranSec < 0.0f) e.ranSec = 0.0f;
+
+  e.state = JOURNAL_RECOVERED;
+  doseJournalSeal(e);
+  doseJournalWriteFlash(e);
+  rtc = e;
+  doseJournalRecovered[pump - 1] = e;
+  doseJournalNeedsLog |= (uint8_t)(1 << (pump - 1));
+
+  Serial.printf("Dose journal: run #%lu on %s interrupted after %.1fs of %.1fs (%s)\n",
+                (unsigned long)e.seq, pumpNameForNum(e.pump), e.ranSec, e.plannedSec,
+                haveProgress ? "RTC progress" : "assumed complete");
+
+  // Scheduled remainder goes back into the bucket; applied after the boot-time
+  // bucket reset so it isn't wiped (or counted twice if we reboot again).
+}
 
-  // Clear trigger and write lastRun
-  time_t nowSec = time(NULL);
-  uint64_t tsMs = (nowSec > 0) ? (uint64_t)nowSec * 1000ULL : (uint64_t)millis();
+void doseJournalReconcile() {
+  DoseJournalEntry flash[4] = {};
+  {
+    NvsPrefs prefs;
+    if (prefs.begin("journal", false)) {
+      for (int p = 1; p <= 4; p++) {
+        char key[5];
+        doseJournalKey(p, key);
+        if (prefs.getBytes(key, &flash[p - 1], sizeof(flash[p - 1])) != sizeof(flash[p - 1])) flash[p - 1] = {};
+      }
+      // Single-entry journal from older firmware: adopt it into its pump's slot.
+      DoseJournalEntry legacy = {};
+      if (prefs.isKey("run")) {
+        if (prefs.getBytes("run", &legacy, sizeof(legacy)) == sizeof(legacy) && doseJournalValid(legacy) &&
+            !doseJournalValid(flash[legacy.pump - 1])) {
+          flash[legacy.pump - 1] = legacy;
+          char key[5];
+          doseJournalKey(legacy.pump, key);
+          prefs.putBytes(key, &legacy, sizeof(legacy));
+        }
+        prefs.remove("run");
+      }
+      prefs.end();
+    }
+  }
 
-  String clearJson = "{";
-  clearJson += "\"trigger\":false,";
-  clearJson += "\"lastRun\":" + String((unsigned long long)tsMs) + ",";
-  clearJson += "\"pump\":" + String(pump) + ",";
-  clearJson += "\"durationSec\":" + String(durationSec);
-  clearJson += "}";
+  doseJournalSeq = 0;
+  for (int p = 1; p <= 4; p++) {
+    const DoseJournalEntry& rtc = doseJournalRtc[p - 1];
+    if (doseJournalValid(rtc) && rtc.seq > doseJournalSeq) doseJournalSeq = rtc.seq;
+    if (!doseJournalValid(flash[p - 1]) || flash[p - 1].pump != p) continue;
+    if (flash[p - 1].seq > doseJournalSeq) doseJournalSeq = flash[p - 1].seq;
+    doseJournalReconcilePump(p, flash[p - 1]);
+  }
+}
 
-  firebasePutJson(path, clearJson);
+// Boot, after the pending buckets were primed/cleared. After a warm reset the
+// buckets come back from RTC still holding the whole run, so the delivered part
+// is taken off instead (once: doseJournalBookedSeq).
+void doseJournalRestoreRemainder() {
+  bool changed = false;
+  for (int p = 1; p <= 4; p++) {
+    const DoseJournalEntry& e = doseJournalRecovered[p - 1];
+    if (!(doseJournalNeedsLog & (1 << (p - 1))) || e.kind != JOURNAL_SCHEDULE) continue;
+    float* bucket = pendingBucketForPump(p);
+    if (!bucket) continue;
+
+    if (rtcRuntimeRestored) {
+      if (e.seq <= doseJournalBookedSeq[p - 1]) continue;
+      const float deliveredMl = e.ranSec * e.flowMlPerMin / 60.0f;
+      *bucket = max(0.0f, *bucket - deliveredMl);
+      Serial.printf("Dose journal: took %.2fml delivered off the %s bucket\n", deliveredMl, pumpNameForNum(p));
+    } else {
+      const float remainderMl = (e.plannedSec - e.ranSec) * e.flowMlPerMin / 60.0f;
+      if (remainderMl > 0.0f) {
+        *bucket += remainderMl;
+        Serial.printf("Dose journal: returned %.2fml to the %s bucket\n", remainderMl, pumpNameForNum(p));
+      }
+    }
+    doseJournalBookedSeq[p - 1] = e.seq;
+    changed = true;
+  }
+  if (changed) configCommit();
+}
 
+// Ledger, rollups and SLA for a recovered run, once (the flag is persisted with
+// the entry). Needs the clock and the filesystem, not WiFi.
+static bool doseJournalBookLocal(int pump) {
+  DoseJournalEntry& e = doseJournalRecovered[pump - 1];
+  if (e.flags & DOSE_JOURNAL_BOOKED) return true;
+  if (!fsMounted || time(NULL) < (time_t)LEDGER_MIN_EPOCH) return false;
+  const float deliveredMl = e.ranSec * e.flowMlPerMin / 60.0f;
+  ledgerRecordRun(pump, deliveredMl, e.ranSec, "recovered");
+  rollupAddRun(pump, deliveredMl);
+  if (e.kind == JOURNAL_SCHEDULE) slaDoseDelivered(pump, deliveredMl);
+  e.flags |= DOSE_JOURNAL_BOOKED;
+  doseJournalSeal(e);
+  DoseJournalEntry& rtc = doseJournalRtc[pump - 1];
+  if (rtc.seq == e.seq) {
+    rtc = e;
+    doseJournalWriteFlash(e);
+  }
   return true;
 }
 
-// ===================== FIREBASE: READ CALIBRATION VALUES =====================
-// UI saves to:
-//  devices/<id>/calibration/pumps/pumpN = {ml_per_min:<float>, ts:<ms>}
-// ESP32 pulls these periodically and updates FLOW_* variables + persists them.
-bool firebaseSyncFlowCalibrationOnce() {
-  if (WiFi.status() != WL_CONNECTED) return false;
+// loop(): book recovered runs locally right away, post them to RTDB once we're
+// online, then close their journal entries.
+void serviceDoseJournal() {
+  if (!doseJournalNeedsLog) return;
+  for (int p = 1; p <= 4; p++) {
+    const uint8_t bit = (uint8_t)(1 << (p - 1));
+    if (!(doseJournalNeedsLog & bit)) continue;
+    if (!doseJournalBookLocal(p)) continue;
+    if (WiFi.status() != WL_CONNECTED) continue;
+    const DoseJournalEntry& e = doseJournalRecovered[p - 1];
+    const float deliveredMl = e.ranSec * e.flowMlPerMin / 60.0f;
+    if (deliveredMl > 0.0f &&
+        !firebaseLogDoseRun(p, pumpNameForNum(p), deliveredMl, e.ranSec, e.flowMlPerMin, "recovered")) {
+      return;   // retry next loop
+    }
+    doseJournalNeedsLog &= (uint8_t)~bit;
+    if (doseJournalRtc[p - 1].seq == e.seq) doseJournalCommit(p);   // not if a newer run took the slot
+  }
+}
 
-  String path = "/devices/" + String(DEVICE_ID) + "/calibration/pumps";
-  String payload = firebaseGetJson(path);
-  if (payload.length() == 0 || payload == "null") return false;
+// ===================== PUMP DRIVER (NON-BLOCKING) =====================
+// One channel per pump, switched by a periodic esp_timer (PUMP_DRIVER_TICK_US) so
+// several pumps can run at once and loop() keeps polling while they do. loop() owns
+// an IDLE or DONE channel, the tick owns a WAITING or ON one; the state changes
+// under pumpDriverMux. The tick also honours the E-stop (pins are already LOW, it
+// just books the partial run) and keeps the RTC journal progress current.
+// Governor headroom is reserved when a run is queued and the unused part refunded
+// when loop() takes the result, so runs in flight count against each other.
+
+const uint32_t PUMP_DRIVER_TICK_US = 20000;
+volatile uint32_t pumpDriverTicks = 0;   // liveness, for otaServiceValidation()
+
+enum PumpChannelState : uint8_t { PUMP_CH_IDLE, PUMP_CH_WAITING, PUMP_CH_ON, PUMP_CH_DONE };
+
+struct PumpChannel {
+  PumpChannelState state;
+  int      pin;
+  uint8_t  journalKind;     // DoseJournalKind; JOURNAL_CALIBRATE / JOURNAL_NONE aren't journaled
+  bool     cancelled;       // E-stop before or during the run
+  uint32_t estopCount;      // estopEngageCount when queued; any change cancels the run
+  bool     announced;       // "pon" published
+  uint32_t startAtMs;       // millis() the pump may switch on
+  uint32_t onMs;
+  float    requestedSec;
+  float    allowedSec;      // after the 24h governor; 0 = refused
+  float    flow;
+  float    ranSec;
+  int32_t  reservedHour;    // governor bucket the reservation went into; -1 = calibration, not governed
+};
 
-  // Very small JSON pull parser (no ArduinoJson dependency).
-  auto extractFloat = [&](const String& key, float currentVal) -> float {
-    int k = payload.indexOf(key);
-    if (k < 0) return currentVal;
-    int c = payload.indexOf(':', k);
-    if (c < 0) return currentVal;
-    String s = payload.substring(c + 1);
-    s.trim();
-    // stop at comma/brace
-    int end = s.indexOf(',');
-    if (end < 0) end = s.indexOf('}');
-    if (end > 0) s = s.substring(0, end);
-    s.trim();
-    float v = s.toFloat();
-    if (v <= 0.0f) return currentVal;
-    return v;
-  };
+struct PumpRunResult {
+  float requestedSec;
+  float allowedSec;
+  float ranSec;
+  float flow;
+  bool  cancelled;
+  bool  complete;           // ran the full requested time
+};
 
-  float newK = extractFloat("\"ml_per_min\"", FLOW_KALK_ML_PER_MIN); // pump1 likely first hit
-  // Because keys repeat per pump, we parse per pump blocks:
-  auto parsePump = [&](int pump, float currentVal) -> float {
-    String pumpKey = "\"pump" + String(pump) + "\"";
-    int p = payload.indexOf(pumpKey);
-    if (p < 0) return currentVal;
-    int mp = payload.indexOf("\"ml_per_min\"", p);
-    if (mp < 0) return currentVal;
-    int c = payload.indexOf(':', mp);
-    if (c < 0) return currentVal;
-    String s = payload.substring(c + 1);
-    s.trim();
-    int end = s.indexOf(',');
-    if (end < 0) end = s.indexOf('}');
-    if (end > 0) s = s.substring(0, end);
-    s.trim();
-    float v = s.toFloat();
-    if (v <= 0.0f) return currentVal;
-    return v;
-  };
+PumpChannel pumpChannels[4] = {};
+portMUX_TYPE pumpDriverMux = portMUX_INITIALIZER_UNLOCKED;
+esp_timer_handle_t pumpDriverTimer = nullptr;
 
-  float fk = parsePump(1, FLOW_KALK_ML_PER_MIN);
-  float fa = parsePump(2, FLOW_AFR_ML_PER_MIN);
-  float fm = parsePump(3, FLOW_MG_ML_PER_MIN);
-  float fx = parsePump(4, FLOW_TBD_ML_PER_MIN);
+static void pumpDriverFinish(PumpChannel& c, int pump, uint32_t stopMs) {
+  c.ranSec = (c.state == PUMP_CH_ON) ? (stopMs - c.onMs) / 1000.0f : 0.0f;
+  c.state  = PUMP_CH_DONE;
+  if (doseJournalTracks(c.journalKind)) doseJournalDelivered(pump, c.ranSec);
+}
 
-  bool changed = (fk != FLOW_KALK_ML_PER_MIN) || (fa != FLOW_AFR_ML_PER_MIN) || (fm != FLOW_MG_ML_PER_MIN) || (fx != FLOW_TBD_ML_PER_MIN);
+// esp_timer task, every PUMP_DRIVER_TICK_US.
+// An E-stop raised and released between two ticks has still forced the pins LOW,
+// so runs cancel on any raise since they were queued, not just on the flag.
+static void pumpDriverTick(void*) {
+  pumpDriverTicks++;
+  const uint32_t now = millis();
+  if (PIN_ESTOP_BUTTON >= 0) estopButtonConfirm(now);
+  const bool estopOn = globalEmergencyStop;
+  const uint32_t estopCount = estopEngageCount;
+  for (int i = 0; i < 4; i++) {
+    PumpChannel& c = pumpChannels[i];
+    const bool estop = estopOn || estopCount != c.estopCount;
+    portENTER_CRITICAL(&pumpDriverMux);
+    if (c.state == PUMP_CH_WAITING) {
+      if (estop) {
+        c.cancelled = true;
+        pumpDriverFinish(c, i + 1, now);
+      } else if ((int32_t)(now - c.startAtMs) >= 0) {
+        c.onMs  = now;
+        c.state = PUMP_CH_ON;
+        pumpOn(c.pin, c.allowedSec, c.journalKind == JOURNAL_CALIBRATE);
+        if (globalEmergencyStop || estopEngageCount != c.estopCount) pumpOff(c.pin);   // E-stop raced the switch-on
+      }
+    } else if (c.state == PUMP_CH_ON) {
+      const uint32_t elapsed = now - c.onMs;
+      if (estop) {
+        pumpOff(c.pin);
+        uint32_t stopMs = now;
+        const uint32_t engaged = estopEngagedMs;
+        if ((int32_t)(engaged - c.onMs) >= 0 && (int32_t)(now - engaged) >= 0) stopMs = engaged;
+        c.cancelled = true;
+        pumpDriverFinish(c, i + 1, stopMs);
+      } else if (elapsed >= (uint32_t)(c.allowedSec * 1000.0f)) {
+        pumpOff(c.pin);
+        pumpDriverFinish(c, i + 1, now);
+      } else if (doseJournalTracks(c.journalKind)) {
+        doseJournalProgress(i + 1, elapsed / 1000.0f);
+      }
+    }
+    portEXIT_CRITICAL(&pumpDriverMux);
+  }
+}
 
-  FLOW_KALK_ML_PER_MIN = fk;
-  FLOW_AFR_ML_PER_MIN  = fa;
-  FLOW_MG_ML_PER_MIN   = fm;
-  FLOW_TBD_ML_PER_MIN  = fx;
-  FLOW_AUX_ML_PER_MIN  = fx; // keep in sync (legacy)
+void pumpDriverBegin() {
+  for (int i = 0; i < 4; i++) pumpChannels[i].pin = pumpGuard[i].pin;
+  esp_timer_create_args_t args = {};
+  args.callback = &pumpDriverTick;
+  args.name     = "pumpDrv";
+  if (esp_timer_create(&args, &pumpDriverTimer) != ESP_OK ||
+      esp_timer_start_periodic(pumpDriverTimer, PUMP_DRIVER_TICK_US) != ESP_OK) {
+    Serial.println("Pump driver: failed to start tick timer");
+  }
+}
 
-  if (changed) {
-    Serial.print("Flow updated from RTDB: KALK=");
-    Serial.print(FLOW_KALK_ML_PER_MIN);
-    Serial.print(" AFR=");
-    Serial.print(FLOW_AFR_ML_PER_MIN);
-    Serial.print(" MG=");
-    Serial.print(FLOW_MG_ML_PER_MIN);
-    Serial.print(" AUX=");
-    Serial.println(FLOW_AUX_ML_PER_MIN);
-    saveFlowToPrefs();
-    firebaseSetCalibrationStatus();
+bool pumpDriverIdle() {
+  for (int i = 0; i < 4; i++) {
+    if (pumpChannels[i].state != PUMP_CH_IDLE) return false;
   }
+  return true;
+}
 
-  return changed;
+// Queue a run on a pin's channel. The channel must be IDLE; a run the governor or
+// the E-stop refuses still goes through DONE (ranSec 0) so callers book it uniformly.
+bool pumpDriverStart(int pin, float seconds, uint32_t startAtMs, uint8_t journalKind) {
+  const int pump = pinToPumpNum(pin);
+  if (pump < 1 || seconds <= 0.0f) return false;
+  PumpChannel& c = pumpChannels[pump - 1];
+  if (c.state != PUMP_CH_IDLE) return false;
+  if (doseJournalTracks(journalKind) && !doseJournalCanBegin(pump)) {
+    Serial.printf("Pump %d: recovered run not booked yet (no clock), run held back.\n", pump);
+    return false;
+  }
+
+  c.estopCount   = estopEngageCount;   // before the flag check: a raise in between still cancels
+  c.requestedSec = seconds;
+  c.flow         = pinFlowMlPerMin(pin);
+  const bool governed = (journalKind != JOURNAL_CALIBRATE);
+  c.allowedSec   = globalEmergencyStop ? 0.0f : governed ? governorAllowedSec(pin, seconds)
+                                       : min(seconds, (float)CALIBRATE_MAX_SEC);
+  c.ranSec       = 0.0f;
+  c.cancelled    = globalEmergencyStop;
+  c.announced    = false;
+  c.journalKind  = journalKind;
+  c.startAtMs    = startAtMs;
+  c.reservedHour = governed ? governorHourNow() : -1;
+
+  portENTER_CRITICAL(&pumpDriverMux);
+  if (c.allowedSec <= 0.0f) {
+    c.state = PUMP_CH_DONE;
+    portEXIT_CRITICAL(&pumpDriverMux);
+    if (!c.cancelled) Serial.printf("Pump on pin %d refused by the 24h governor.\n", pin);
+    return true;
+  }
+  portEXIT_CRITICAL(&pumpDriverMux);
+
+  if (governed) governorAddAt(pump, c.allowedSec * c.flow / 60.0f, c.reservedHour);
+  if (doseJournalTracks(journalKind)) {
+    doseJournalBegin(pump, (DoseJournalKind)journalKind, c.allowedSec, c.flow);
+  }
+  portENTER_CRITICAL(&pumpDriverMux);
+  c.state = PUMP_CH_WAITING;
+  portEXIT_CRITICAL(&pumpDriverMux);
+  return true;
 }
 
+// loop(): collect a finished run and free the channel. False while it's still going.
+bool pumpDriverTake(int pump, PumpRunResult& out) {
+  if (pump < 1 || pump > 4) return false;
+  PumpChannel& c = pumpChannels[pump - 1];
+  portENTER_CRITICAL(&pumpDriverMux);
+  const bool done = (c.state == PUMP_CH_DONE);
+  portEXIT_CRITICAL(&pumpDriverMux);
+  if (!done) return false;
+
+  out.requestedSec = c.requestedSec;
+  out.allowedSec   = c.allowedSec;
+  out.ranSec       = c.ranSec;
+  out.flow         = c.flow;
+  out.cancelled    = c.cancelled;
+  out.complete     = !c.cancelled && c.allowedSec >= c.requestedSec && c.ranSec > 0.0f;
+
+  // Book what actually went in against the reservation made in pumpDriverStart()
+  if (c.allowedSec > 0.0f && c.reservedHour >= 0) {
+    governorAddAt(pump, (c.ranSec - c.allowedSec) * c.flow / 60.0f, c.reservedHour);
+  }
+  if (c.ranSec > 0.0f || c.announced) {
+    wsPublishPump(false, c.pin, c.ranSec);
+    wsFlush();
+  }
+  if (c.cancelled && c.ranSec > 0.0f) {
+    Serial.printf("E-Stop: pump on pin %d cut after %.2fs of %.2fs\n", c.pin, c.ranSec, c.allowedSec);
+  }
+  portENTER_CRITICAL(&pumpDriverMux);
+  c.state = PUMP_CH_IDLE;
+  portEXIT_CRITICAL(&pumpDriverMux);
+  return true;
+}
 
-// ===================== FIREBASE: CALIBRATION STATUS (ACK) =====================
-// Writes /devices/<id>/calibration/status so the UI can show "ESP applied" acknowledgement.
-void firebaseSetCalibrationStatus() {
-  String path = "/devices/" + String(DEVICE_ID) + "/calibration/status";
+// loop(): publish switch-ons the tick made since the last pass.
+void pumpDriverService() {
+  for (int i = 0; i < 4; i++) {
+    PumpChannel& c = pumpChannels[i];
+    if (c.announced || c.state != PUMP_CH_ON) continue;
+    c.announced = true;
+    wsPublishPump(true, c.pin, c.allowedSec);
+  }
+}
 
-  // Use epoch ms
-  uint64_t tsMs = getEpochMillis();
-  String json = "{";
-  json += "\"appliedAt\":" + String((unsigned long long)tsMs) + ",";
-  json += "\"flows\":{";
-  json += "\"kalk\":" + String(FLOW_KALK_ML_PER_MIN, 2) + ",";
-  json += "\"afr\":" + String(FLOW_AFR_ML_PER_MIN, 2) + ",";
-  json += "\"mg\":" + String(FLOW_MG_ML_PER_MIN, 2) + ",";
-  json += "\"aux\":" + String(FLOW_AUX_ML_PER_MIN, 2);
-  json += "}";
-  json += "}";
-  firebasePutJson(path, json);
+
+// ===================== SLOT PACKER =====================
+// Lays one slot's runs out on a timeline instead of back to back. Constraints:
+//  - REAGENT_GAP_SEC: two reagents that must not meet in the sump (kalk precipitates
+//    the carbonate in AFR and the Mg) need this much idle time between their runs;
+//    0 means they may overlap.
+//  - PUMP_CURRENT_BUDGET_MA: the pumps share one supply; the heads running at any
+//    instant may not draw more than this. A head that alone exceeds it still runs,
+//    just never next to another.
+// Every run order is tried (4! = 24) and each run takes its earliest feasible start;
+// the order with the smallest makespan wins, ties keep pump order.
+
+const float    PUMP_CURRENT_MA[4]      = {350.0f, 350.0f, 350.0f, 350.0f};
+const float    PUMP_CURRENT_BUDGET_MA  = 700.0f;
+const float    REAGENT_GAP_SEC[4][4] = {
+  //  kalk    afr     mg      aux
+  {   0.0f, 300.0f, 120.0f,   0.0f },   // kalk
+  { 300.0f,   0.0f,   0.0f,   0.0f },   // afr
+  { 120.0f,   0.0f,   0.0f,   0.0f },   // mg
+  {   0.0f,   0.0f,   0.0f,   0.0f },   // aux
+};
+
+// Draw of the placed runs at instant t, plus run i if it were there too.
+static float packCurrentAt(float t, int i, const float dur[4], const float start[4], const bool placed[4]) {
+  float ma = PUMP_CURRENT_MA[i];
+  for (int j = 0; j < 4; j++) {
+    if (placed[j] && start[j] <= t && t < start[j] + dur[j]) ma += PUMP_CURRENT_MA[j];
+  }
+  return ma;
+}
+
+static bool packFits(int i, float t, const float dur[4], const float start[4], const bool placed[4]) {
+  const float end = t + dur[i];
+  bool overlaps = false;
+  for (int j = 0; j < 4; j++) {
+    if (!placed[j]) continue;
+    const float gap = REAGENT_GAP_SEC[i][j];
+    const float jEnd = start[j] + dur[j];
+    if (t < jEnd + gap && start[j] < end + gap) {
+      if (gap > 0.0f) return false;
+      overlaps = true;
+    }
+  }
+  if (!overlaps) return true;
+
+  // Draw only rises when a run starts: check at t and at every start inside [t, end)
+  if (packCurrentAt(t, i, dur, start, placed) > PUMP_CURRENT_BUDGET_MA) return false;
+  for (int j = 0; j < 4; j++) {
+    if (placed[j] && start[j] > t && start[j] < end &&
+        packCurrentAt(start[j], i, dur, start, placed) > PUMP_CURRENT_BUDGET_MA) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// dur[p]: run time of pump p + 1 in seconds (<= 0 = not running).
+// Fills start[] with offsets from the slot start; returns the makespan.
+float packSlot(const float dur[4], float start[4]) {
+  int order[4] = {0, 1, 2, 3};
+  float best = -1.0f;
+  for (int i = 0; i < 4; i++) start[i] = 0.0f;
+
+  do {
+    float s[4] = {0, 0, 0, 0};
+    bool placed[4] = {false, false, false, false};
+    float makespan = 0.0f;
+    for (int k = 0; k < 4; k++) {
+      const int i = order[k];
+      if (dur[i] <= 0.0f) continue;
+      // Candidates: slot start, or right after / one gap after a placed run
+      float cand[9];
+      int n = 0;
+      cand[n++] = 0.0f;
+      for (int j = 0; j < 4; j++) {
+        if (!placed[j]) continue;
+        cand[n++] = s[j] + dur[j];
+        cand[n++] = s[j] + dur[j] + REAGENT_GAP_SEC[i][j];
+      }
+      std::sort(cand, cand + n);
+      float t = cand[n - 1];   // after every placed run and its gap: always fits
+      for (int c = 0; c < n; c++) {
+        if (packFits(i, cand[c], dur, s, placed)) { t = cand[c]; break; }
+      }
+      s[i] = t;
+      placed[i] = true;
+      makespan = max(makespan, t + dur[i]);
+    }
+    if (best < 0.0f || makespan < best) {
+      best = makespan;
+      for (int i = 0; i < 4; i++) start[i] = s[i];
+    }
+  } while (std::next_permutation(order, order + 4));
+  return best;
+}
+
+
+// ===================== PUMP SCHEDULER (REAL-TIME SLOTS) =====================
+
+void slotRunnerService();
+int pumpNumToPin(int pump);
+
+// One pass of a blocking wait on the pump driver: yield, keep the slot runner and
+// the websocket going, and the device marked online while a long dose runs.
+static void pumpDriverWaitStep(uint32_t& lastBeat) {
+  const uint32_t beatEveryMs = 5000;   // keep RTDB heartbeat fresh while dosing
+  delay(50);                           // yield to WiFi stack
+  pumpDriverService();
+  slotRunnerService();
+  wsFlush();
+  if ((uint32_t)(millis() - lastBeat) >= beatEveryMs) {
+    lastBeat = millis();
+    firebaseSendStateHeartbeat();
+  }
+}
+
+// Blocking single run (live dose, calibration) on top of the pump driver. Waits
+// for a packed slot still in flight so these never overlap it.
+// result (optional): the run as the driver finished it (ranSec, cancelled, allowedSec).
+// Returns true only if the full run completed; an E-stop or the 24h governor cuts
+// it short (pumpRunStopReason() says which).
+bool giveDose(int pin, float seconds, PumpRunResult* result = nullptr, uint8_t journalKind = JOURNAL_NONE) {
+  if (result) {
+    *result = {};
+    result->requestedSec = seconds;
+    result->allowedSec   = seconds;
+  }
+  if (globalEmergencyStop) {
+        Serial.println("Pump execution blocked: E-Stop is ACTIVE.");
+        if (result) result->cancelled = true;
+        return false;
+    }
+  if (seconds <= 0) return false;
+
+  uint32_t lastBeat = millis();
+  while (!pumpDriverIdle()) pumpDriverWaitStep(lastBeat);
+
+  const int pump = pinToPumpNum(pin);
+  if (!pumpDriverStart(pin, seconds, millis(), journalKind)) return false;
+  PumpRunResult r;
+  while (!pumpDriverTake(pump, r)) pumpDriverWaitStep(lastBeat);
+
+  if (result) *result = r;
+  return r.complete;   // false on E-stop or when the governor shortened/refused it
+}
+
+// Why a run didn't complete, for logs and acks.
+static const char* pumpRunStopReason(const PumpRunResult& r) {
+  if (r.cancelled) return "E-stop";
+  if (r.allowedSec < r.requestedSec) return "limited by 24h governor";
+  return "incomplete";
+}
+
+
+
+// Doses a specific amount on a specific pump, then logs it to RTDB.
+void doseAndLog(int pumpIndex, const String& pumpName, int pin, float ml, float flowMlPerMin, const String& source) {
+  if (ml <= 0.0f || flowMlPerMin <= 0.0f) return;
+  const float durationSec = (ml / flowMlPerMin) * 60.0f;
+  PumpRunResult r;
+  if (giveDose(pin, durationSec, &r, JOURNAL_LIVE)) {
+    recordDoseRun(pumpIndex, pumpName, ml, durationSec, flowMlPerMin, source);
+  } else {
+    Serial.printf("%s: ran %.2fs of %.2fs (%s).\n", pumpName.c_str(), r.ranSec, durationSec, pumpRunStopReason(r));
+    // Cut short: log what actually went in
+    if (r.ranSec > 0.0f) {
+      recordDoseRun(pumpIndex, pumpName, r.ranSec * flowMlPerMin / 60.0f, r.ranSec, flowMlPerMin, source);
+    }
+  }
+  doseJournalCommit(pumpIndex);
+}
+
+
+// A slot in flight: the pending buckets are queued on the pump driver at the
+// offsets packSlot() chose, and booked one by one as their runs finish.
+struct SlotRun {
+  bool  active;
+  int   idx;
+  bool  owned[4];       // channel queued by this slot, result not yet taken
+  float plannedMl[4];
+  float plannedSec[4];
+  float shareMl[4];
+};
+SlotRun slotRun = {};
+
+static const char* const SLOT_PUMP_NAMES[4] = {"kalk", "afr", "mg", "tbd"};
+
+// Packs and queues the pending buckets for slot idx. Under MIN_DOSE_SEC a bucket
+// carries over to the next slot.
+static void slotRunnerStart(int idx, const float shareMl[4]) {
+  float dur[4] = {0, 0, 0, 0};
+  float sequential = 0.0f;
+  for (int p = 1; p <= 4; p++) {
+    const float pendingMl = *pendingBucketForPump(p);
+    const float flow = pinFlowMlPerMin(pumpNumToPin(p));
+    if (pendingMl <= 0.0f || flow <= 0.0f) continue;
+
+    const float sec = (pendingMl / flow) * 60.0f;
+    if (sec < MIN_DOSE_SEC) {
+      Serial.printf("%s deferred (under %.0fs).\n", SLOT_PUMP_NAMES[p - 1], MIN_DOSE_SEC);
+      slaDoseDeferred(p, shareMl[p - 1]);
+      continue;
+    }
+    // Pack what the governor will let through, not what's pending: a cut run would
+    // otherwise hold its full slot on the timeline (and its reagent gaps) for nothing.
+    dur[p - 1] = globalEmergencyStop ? sec : governorAllowedSec(pumpNumToPin(p), sec);
+    if (dur[p - 1] <= 0.0f) {
+      Serial.printf("%s held back by the 24h governor, kept for the next slot.\n", SLOT_PUMP_NAMES[p - 1]);
+      continue;
+    }
+    sequential += dur[p - 1];
+  }
+
+  float start[4];
+  const float makespan = packSlot(dur, start);
+  const uint32_t t0 = millis();
+
+  slotRun = {};
+  slotRun.idx = idx;
+  String timeline;
+  for (int p = 1; p <= 4; p++) {
+    if (dur[p - 1] <= 0.0f) continue;
+    slotRun.plannedMl[p - 1]  = min(*pendingBucketForPump(p), dur[p - 1] * pinFlowMlPerMin(pumpNumToPin(p)) / 60.0f);
+    slotRun.plannedSec[p - 1] = dur[p - 1];
+    slotRun.shareMl[p - 1]    = shareMl[p - 1];
+    if (!pumpDriverStart(pumpNumToPin(p), dur[p - 1], t0 + (uint32_t)(start[p - 1] * 1000.0f), JOURNAL_SCHEDULE)) {
+      Serial.printf("%s: pump channel busy, kept for the next slot.\n", SLOT_PUMP_NAMES[p - 1]);
+      continue;
+    }
+    slotRun.owned[p - 1] = true;
+    slotRun.active = true;
+    timeline += " " + String(SLOT_PUMP_NAMES[p - 1]) + "@" + String(start[p - 1], 0) + "s/" + String(dur[p - 1], 0) + "s";
+  }
+  if (slotRun.active) {
+    Serial.printf("Slot %d packed:%s, makespan %.0fs (sequential %.0fs)\n",
+                  idx + 1, timeline.c_str(), makespan, sequential);
+  }
+}
+
+// Books one finished run: zero the share it delivered off the bucket, or keep
+// what an E-stop / the governor stopped from going in.
+static void slotRunnerBook(int p, const PumpRunResult& r) {
+  const char* name = SLOT_PUMP_NAMES[p - 1];
+  float& pendingMl = *pendingBucketForPump(p);
+  const float plannedMl = slotRun.plannedMl[p - 1];
+
+  if (r.complete) {
+    recordDoseRun(p, name, plannedMl, slotRun.plannedSec[p - 1], r.flow, "schedule");
+    slaDoseDelivered(p, r.ranSec * r.flow / 60.0f);
+    slaDoseOnTime(slotRun.plannedSec[p - 1], r.ranSec);
+    pendingMl = max(0.0f, pendingMl - plannedMl);
+  } else {
+    const float deliveredMl = min(plannedMl, r.ranSec * r.flow / 60.0f);
+    if (deliveredMl > 0.0f) {
+      recordDoseRun(p, name, deliveredMl, r.ranSec, r.flow, "schedule");
+      slaDoseDelivered(p, deliveredMl);
+      pendingMl = max(0.0f, pendingMl - deliveredMl);
+    }
+    Serial.printf("%s stopped early (E-stop or 24h governor), kept %.2fml pending.\n", name, pendingMl);
+    slaDoseSkipped(p, min(slotRun.shareMl[p - 1], pendingMl));
+  }
+  doseJournalBookedSeq[p - 1] = doseJournalRtc[p - 1].seq;
+  rtcSaveRuntime();
+  doseJournalCommit(p);
+}
+
+// loop() and blocking waits: take finished runs; once the slot is done, save
+// the buckets so they survive a reboot.
+void slotRunnerService() {
+  if (!slotRun.active) return;
+  bool running = false;
+  for (int p = 1; p <= 4; p++) {
+    if (!slotRun.owned[p - 1]) continue;
+    PumpRunResult r;
+    if (!pumpDriverTake(p, r)) {
+      running = true;
+      continue;
+    }
+    slotRun.owned[p - 1] = false;
+    slotRunnerBook(p, r);
+    wsPublishPending();
+  }
+  if (running) return;
+
+  slotRun.active = false;
+  configCommit();
+  wsPublishPending();
+  Serial.printf("Slot %d done.\n", slotRun.idx + 1);
+}
+
+// Needs only a valid clock (kept across warm resets), not WiFi: the doseRuns
+// POST fails on its own offline; the ledger and the rollup queue keep the run.
+void maybeDosePumpsRealTime() {
+  struct tm timeinfo;
+  if (!getLocalTime(&timeinfo, 0)) return;
+  if (!isTimeValid(timeinfo)) return;
+
+  // ... [Day change logic remains exactly as you have it] ...
+  const int windowDay = doseScheduleCfg.enabled ? windowStartYday(timeinfo, doseScheduleCfg.startHour, doseScheduleCfg.endHour)
+                                                 : timeinfo.tm_yday;
+
+  if (!doseSlotsPrimed) {
+    // Time arrived after boot (NTP was late): prime like setup() does
+    primeDoseSlotsForToday();
+    if (!doseSlotsPrimed) return;
+    catchUpAfterPrime();
+  } else if (windowDay != lastDoseWindowDay) {
+    // [Your existing Day Change code here]
+    lastDoseWindowDay = windowDay; 
+    doseSlotsPrimed = true; 
+    rebuildScheduleSlots();
+    for (int i = 0; i < DOSE_SLOTS_PER_DAY; i++) slotDone[i] = false;
+    rtcSaveRuntime();
+    // ...
+  }
+
+  // Determine nowIdx as you already do...
+  int nowIdx = -1;
+  if (doseScheduleCfg.enabled) {
+    nowIdx = scheduleSlotIndex(timeinfo, doseScheduleCfg.startHour, doseScheduleCfg.endHour, doseScheduleCfg.everyMin);
+  } else {
+    // legacy window logic...
+  }
+
+  // --- ACCUMULATION DOSING LOGIC WITH MEMORY ---
+  if (nowIdx >= 0 && nowIdx < DOSE_SLOTS_PER_DAY) {
+    if (!slotDone[nowIdx] && !slotRun.active) {   // a slot still in flight holds the next one back
+      
+      // 1. Buckets are already in RAM (restored from the config blob at boot)
+
+      // 2. Add current slot's requirement (time-of-day weighted, see rebuildSlotShares)
+      //    plus this slot's part of any outage catch-up (counted as planned by the SLA)
+      float extraMl[4];
+      catchUpTakeForSlot(extraMl);
+      const float shareMl[4] = {
+        dosing.ml_per_day_kalk * slotShare[0][nowIdx] + extraMl[0],
+        dosing.ml_per_day_afr  * slotShare[1][nowIdx] + extraMl[1],
+        dosing.ml_per_day_mg   * slotShare[2][nowIdx] + extraMl[2],
+        dosing.ml_per_day_tbd  * slotShare[3][nowIdx] + extraMl[3],
+      };
+      lastSlotEpoch = (uint32_t)time(NULL);
+      pendingKalkMl += shareMl[0];
+      pendingAfrMl  += shareMl[1];
+      pendingMgMl   += shareMl[2];
+      pendingTbdMl   += shareMl[3];
+
+      slaSlotFired(timeinfo, nowIdx, shareMl);
+      wsPublishSlot(nowIdx);
+      wsPublishPending();
+      Serial.printf("Slot %d: Buckets Loaded (Kalk:%.2fml, AFR:%.2fml, MG:%.2fml, TBD:%.2fml)\n", nowIdx + 1, pendingKalkMl, pendingAfrMl,pendingMgMl,pendingTbdMl);
+
+      // Loaded buckets + slot done go to RTC before any pump starts
+      slotDone[nowIdx] = true;
+      rtcSaveRuntime();
+
+      // 3. Pack the buckets onto the pump driver; slotRunnerService() books each run
+      //    as it finishes and saves the buckets once the slot is done
+      slotRunnerStart(nowIdx, shareMl);
+
+      // 4. Nothing queued: SAVE the loaded buckets now so they survive a reboot
+      if (!slotRun.active) {
+        configCommit();
+        wsPublishPending();
+      }
+    }
+  }
+}
+
+// ===================== TEST SYNC (CURSOR + BACKFILL) =====================
+// Tests live under /devices/<id>/tests ordered by "timestamp".
+// lastRemoteTestTimestampMs is the cursor; every test newer than it is fed to the
+// controller oldest-first, so two tests entered between polls are both applied.
+// At boot the last TEST_BACKFILL_COUNT tests are pulled in one request to rebuild history.
+const int TEST_SYNC_PAGE_SIZE = 8;   // tests per incremental page
+const int TEST_SYNC_MAX_PAGES = 4;   // pages per poll (bounds catch-up time per loop)
+const int TEST_BACKFILL_COUNT = 16;  // tests pulled at boot / after AI reset
+
+struct RemoteTest {
+  uint64_t ts;
+  float ca;
+  float alk;
+  float mg;
+  float ph;
+  float aux;   // optional: what the aux reagent doses (K, I, ...); NaN = not tested
+};
+
+// Pull one page of tests (query appended after orderBy) into out[], oldest first.
+// Returns number of tests, or -1 on error.
+static int fetchTestPage(const String& query, RemoteTest* out, int maxOut) {
+  // IMPORTANT: encode quotes as %22 for Firebase REST query params
+  String path = "/devices/" + String(DEVICE_ID) + "/tests?orderBy=%22timestamp%22&" + query;
+
+  // Only keep the fields we use; everything else is skipped while streaming.
+  JsonDocument filter;
+  filter["*"]["timestamp"] = true;
+  filter["*"]["ca"]  = true;
+  filter["*"]["alk"] = true;
+  filter["*"]["mg"]  = true;
+  filter["*"]["ph"]  = true;
+  filter["*"]["aux"] = true;
+
+  JsonDocument doc;
+  if (!firebaseGetJsonDoc(path, doc, &filter)) return -1;
+  if (doc.isNull()) return 0; // no tests
+
+  int n = 0;
+  for (JsonPair kv : doc.as<JsonObject>()) {
+    if (n >= maxOut) break;
+    JsonObject test = kv.value().as<JsonObject>();
+
+    uint64_t ts = test["timestamp"] | 0ULL;
+    if (ts == 0) continue;
+
+    RemoteTest& rt = out[n++];
+    rt.ts  = ts;
+    rt.ca  = test["ca"]  | NAN;
+    rt.alk = test["alk"] | NAN;
+    rt.mg  = test["mg"]  | NAN;
+    rt.ph  = test["ph"]  | NAN;
+    rt.aux = test["aux"] | NAN;
+  }
+
+  // RTDB REST doesn't guarantee key order in the response body, so sort by timestamp.
+  for (int i = 1; i < n; i++) {
+    RemoteTest cur = out[i];
+    int j = i - 1;
+    while (j >= 0 && out[j].ts > cur.ts) { out[j + 1] = out[j]; j--; }
+    out[j + 1] = cur;
+  }
+  return n;
+}
+
+static bool remoteTestValid(const RemoteTest& rt) {
+  return isfinite(rt.ca) && isfinite(rt.alk) && isfinite(rt.mg) && isfinite(rt.ph);
+}
+
+// Feed a new test to the controller (dosing may change).
+static void feedRemoteTest(const RemoteTest& rt) {
+  if (!remoteTestValid(rt)) {
+    Serial.println("NEW TEST invalid (NaN) -> ignoring");
+    return;
+  }
+
+  Serial.printf("NEW TEST DETECTED ts=%llu ca=%.1f alk=%.2f mg=%.1f ph=%.2f\n",
+                (unsigned long long)rt.ts, rt.ca, rt.alk, rt.mg, rt.ph);
+
+  onNewTestInput(rt.ca, rt.alk, rt.mg, rt.ph, isfinite(rt.aux) ? rt.aux : 0.0f, (uint32_t)(rt.ts / 1000ULL));
+}
+
+// Put an already-applied test back into history and make it the controller baseline
+// (no dosing change).
+static void seedHistoryWithTest(const RemoteTest& rt) {
+  if (!remoteTestValid(rt)) return;
+
+  TestPoint tp = {(uint32_t)(rt.ts / 1000ULL), rt.ca, rt.alk, rt.mg, rt.ph, isfinite(rt.aux) ? rt.aux : 0.0f};
+  pushHistory(tp);
+  lastTest    = {0, 0, 0, 0, 0};
+  currentTest = tp;
+  rtcSaveHistory();
+}
+
+// Boot backfill: one request for the last TEST_BACKFILL_COUNT tests.
+// Tests at/below the cursor were applied before the restart and only rebuild history;
+// newer ones are fed to the controller. With no cursor yet, everything is history
+// (same as the old "first test is the baseline" behavior).
+// Returns true if the device is caught up, false if an incremental sync is still needed.
+bool testSyncBackfill() {
+  RemoteTest page[TEST_BACKFILL_COUNT];
+  int n = fetchTestPage("limitToLast=" + String(TEST_BACKFILL_COUNT), page, TEST_BACKFILL_COUNT);
+  if (n < 0) return false; // retry on next poll
+
+  const uint64_t cursor = lastRemoteTestTimestampMs;
+
+  // A full page whose oldest test is already newer than the cursor means there may be
+  // unseen tests before it. Let the incremental sync walk them in order instead.
+  const bool gap = (cursor != 0 && n == TEST_BACKFILL_COUNT && page[0].ts > cursor);
+
+  int seeded = 0, fed = 0;
+  for (int i = 0; i < n; i++) {
+    if (cursor == 0 || page[i].ts <= cursor) {
+      seedHistoryWithTest(page[i]);
+      seeded++;
+    } else if (!gap) {
+      feedRemoteTest(page[i]);
+      fed++;
+    } else {
+      continue;
+    }
+    if (page[i].ts > lastRemoteTestTimestampMs) lastRemoteTestTimestampMs = page[i].ts;
+  }
+
+  testSyncNeedsBackfill = false;
+  rtcSaveRuntime();
+  if (lastRemoteTestTimestampMs != cursor) configCommit();
+
+  Serial.printf("TestSync: backfill %d tests (%d history, %d new)%s\n",
+                n, seeded, fed, gap ? " - gap, paging from cursor" : "");
+  return !gap;
+}
+
+// Incremental sync: page forward from the cursor (startAt=cursor+1), oldest first.
+void testSyncIncremental() {
+  RemoteTest page[TEST_SYNC_PAGE_SIZE];
+
+  for (int p = 0; p < TEST_SYNC_MAX_PAGES; p++) {
+    String query = "startAt=" + String((unsigned long long)(lastRemoteTestTimestampMs + 1)) +
+                   "&limitToFirst=" + String(TEST_SYNC_PAGE_SIZE);
+    int n = fetchTestPage(query, page, TEST_SYNC_PAGE_SIZE);
+    if (n <= 0) return;
+
+    for (int i = 0; i < n; i++) {
+      if (page[i].ts <= lastRemoteTestTimestampMs) continue;
+      // Advance first: an invalid test is skipped for good, like before.
+      lastRemoteTestTimestampMs = page[i].ts;
+      feedRemoteTest(page[i]);
+    }
+    configCommit();
+
+    if (n < TEST_SYNC_PAGE_SIZE) return; // last page
+  }
+}
+
+void checkForNewTest() {
+  if (WiFi.status() != WL_CONNECTED) return;
+
+  if (testSyncNeedsBackfill) {
+    bool caughtUp = testSyncBackfill();
+    if (caughtUp || testSyncNeedsBackfill) return; // done, or failed (retry next poll)
+  }
+
+  testSyncIncremental();
+}
+
+// ===================== FIREBASE: resetAi COMMAND =====================
+
+// resetAi payload: true / "true". Resets the AI if set.
+// Shared by the RTDB poll and the local API. Returns true if a reset was performed.
+bool handleResetAiPayload(const String& payload) {
+  if (payload.indexOf("true") == -1) return false;
+  resetAIState();
+  return true;
+}
+
+// Check /devices/{DEVICE_ID}/commands/resetAi
+// If true, reset AI and clear the flag.
+// Returns true if a reset was performed.
+bool firebaseCheckAndHandleResetAi() {
+  if (WiFi.status() != WL_CONNECTED) {
+    return false;
+  }
+
+  String path = "/devices/" + String(DEVICE_ID) + "/commands/resetAi";
+  String payload = firebaseGetJson(path);
+  if (payload.length() == 0 || payload == "null") {
+    return false;
+  }
+
+  Serial.print("resetAi payload: ");
+  Serial.println(payload);
+
+  if (handleResetAiPayload(payload)) {
+    // Clear the flag back to false
+    firebasePutJson(path, "false");
+    Serial.println("resetAi flag cleared in Firebase.");
+    return true;
+  }
+
+  return false;
+}
+
+
+// ===================== FIREBASE: Live Dose COMMAND =====================
+
+// Perform one "live" dose using current per-day plan (one of the 3 doses)
+void runLiveDoseOnce() {
+  Serial.println("=== LIVE DOSE REQUESTED ===");
+
+  // This function is used by the web UI "dose now" action (if you keep it),
+  // and it doses one "slot" worth (SEC_PER_DOSE_*) for each pump.
+  if (SEC_PER_DOSE_KALK > 0.0f) {
+    const float ml = (SEC_PER_DOSE_KALK / 60.0f) * FLOW_KALK_ML_PER_MIN;
+    doseAndLog(1, "kalk", PIN_PUMP_KALK, ml, FLOW_KALK_ML_PER_MIN, "slot");
+  }
+  if (SEC_PER_DOSE_AFR > 0.0f) {
+    const float ml = (SEC_PER_DOSE_AFR / 60.0f) * FLOW_AFR_ML_PER_MIN;
+    doseAndLog(2, "afr", PIN_PUMP_AFR, ml, FLOW_AFR_ML_PER_MIN, "slot");
+  }
+  if (SEC_PER_DOSE_MG > 0.0f) {
+    const float ml = (SEC_PER_DOSE_MG / 60.0f) * FLOW_MG_ML_PER_MIN;
+    doseAndLog(3, "mg", PIN_PUMP_MG, ml, FLOW_MG_ML_PER_MIN, "slot");
+  }
+  if (SEC_PER_DOSE_TBD > 0.0f) {
+    const float ml = (SEC_PER_DOSE_TBD / 60.0f) * FLOW_TBD_ML_PER_MIN;
+    doseAndLog(4, "tbd", PIN_PUMP_TBD, ml, FLOW_TBD_ML_PER_MIN, "slot");
+  }
+
+  Serial.println("=== LIVE DOSE COMPLETE ===");
+}
+
+// liveDose payload: {"trigger":true,"pump":1,"ml":5}
+// Shared by the RTDB poll and the local API. Returns true if the command was consumed
+// (dosed or rejected); ackJson then holds the trigger-cleared node to write back.
+bool handleLiveDosePayload(const String& payload, String& ackJson) {
+  StaticJsonDocument<256> doc;
+  DeserializationError err = parseJsonTimed(doc, payload);
+  if (err) {
+    Serial.println("LiveDose: JSON parse error, ignoring");
+    return false;
+  }
+
+  bool trigger = doc["trigger"] | false;
+  if (!trigger) return false;
+
+  int pump = doc["pump"] | 0;
+  float ml = doc["ml"] | 0.0f;
+
+  // Safety sanity checks
+  if (pump < 1 || pump > 4 || ml <= 0.0f) {
+    Serial.println("LiveDose: invalid pump/ml, clearing trigger");
+    ackJson = "{\"trigger\":false,\"lastRun\":" + String((unsigned long long)getEpochMillis()) + "}";
+    return true;
+  }
+
+  int pin = -1;
+  float flow = 0.0f;
+  String pumpName;
+
+  switch (pump) {
+    case 1: pin = PIN_PUMP_KALK; flow = FLOW_KALK_ML_PER_MIN; pumpName = "kalk"; break;
+    case 2: pin = PIN_PUMP_AFR;  flow = FLOW_AFR_ML_PER_MIN;  pumpName = "afr";  break;
+    case 3: pin = PIN_PUMP_MG;   flow = FLOW_MG_ML_PER_MIN;   pumpName = "mg";   break;
+    case 4: pin = PIN_PUMP_TBD;  flow = FLOW_TBD_ML_PER_MIN;  pumpName = "tbd";  break;
+  }
+
+  if (pin < 0 || flow <= 0.0f) {
+    Serial.println("LiveDose: invalid pin/flow, clearing trigger");
+    ackJson = "{\"trigger\":false,\"lastRun\":" + String((unsigned long long)getEpochMillis()) + "}";
+    return true;
+  }
+
+  // Clamp to something sane so you don't accidentally run for hours from a typo.
+  const float maxMl = 2000.0f; // adjust later if you want
+  if (ml > maxMl) ml = maxMl;
+
+  const float durationSec = (ml / flow) * 60.0f;
+  Serial.printf("LiveDose: pump %d (%s) pin %d, %.2f ml @ %.2f ml/min => %.2f sec\n",
+                pump, pumpName.c_str(), pin, ml, flow, durationSec);
+
+  doseAndLog(pump, pumpName, pin, ml, flow, "live");
+
+  // Clear trigger + record lastRun + echo values
+  StaticJsonDocument<128> out;
+  out["trigger"] = false;
+  out["lastRun"] = (unsigned long long)getEpochMillis();
+  out["pump"] = pump;
+  out["ml"] = ml;
+  ackJson = "";
+  serializeJson(out, ackJson);
+  return true;
+}
+
+// Check /devices/{DEVICE_ID}/commands/liveDose
+bool firebaseCheckAndHandleLiveDose() {
+  const String path = "/devices/" + String(DEVICE_ID) + "/commands/liveDose";
+  String payload = firebaseGetJson(path);
+
+  // Typical payload:
+  // {"trigger":true,"pump":1,"ml":5}
+  if (payload.length() == 0 || payload == "null") return false;
+
+  String ackJson;
+  if (!handleLiveDosePayload(payload, ackJson)) return false;
+
+  firebasePutJson(path, ackJson);
+  return true;
+}
+
+// Reagent effects are given for 300g (1135.6L); scale them to TANK_VOLUME_L.
+void applyTankVolumeScaling() {
+  reagentRebuildMatrix();
+}
+
+void firebaseSyncTankSize() {
+  String path = "/devices/" + String(DEVICE_ID) + "/settings/tankSize";
+  String val = firebaseGetJson(path);
+
+  if (val != "" && val != "null") {
+    float gallons = val.toFloat();
+    if (gallons > 0) {
+      float newLiters = gallons * 3.78541f;
+      
+      if (abs(newLiters - TANK_VOLUME_L) > 0.1f) {
+        Serial.print("TANK UPDATE DETECTED! New Gallons: ");
+        Serial.println(gallons);
+
+        TANK_VOLUME_L = newLiters;
+        applyTankVolumeScaling();
+        configCommit();
+
+        updatePumpSchedules(); 
+      }
+    }
+  }
+}
+
+// Pull settings/reagents and adopt it when it differs from the registry in use.
+// Absent or empty keeps what we have (NVS copy or the built-in set).
+bool firebaseSyncReagentsOnce() {
+  if (WiFi.status() != WL_CONNECTED) return false;
+
+  JsonDocument doc;
+  if (!firebaseGetJsonDoc("/devices/" + String(DEVICE_ID) + "/settings/reagents", doc, nullptr)) return false;
+  JsonObject obj = doc.as<JsonObject>();
+  if (obj.isNull()) return false;
+
+  Reagent next[REAGENT_MAX];
+  memset(next, 0, sizeof(next));
+  int n = 0;
+  for (JsonPair kv : obj) {
+    if (n >= REAGENT_MAX) {
+      Serial.printf("Reagents: more than %d in RTDB, rest ignored\n", REAGENT_MAX);
+      break;
+    }
+    JsonObject r = kv.value().as<JsonObject>();
+    if (r.isNull()) continue;
+    Reagent& e = next[n];
+    strncpy(e.name, kv.key().c_str(), REAGENT_NAME_LEN - 1);
+    const int pump = r["pump"] | 0;
+    e.pump     = (uint8_t)((pump >= 1 && pump <= 4) ? pump : 0);
+    e.raisesPh = (r["raisesPh"] | false) ? 1 : 0;
+    bool ok = true;
+    for (int k = 0; k < PARAM_COUNT; k++) {
+      e.effect[k] = r[PARAM_NAMES[k]] | 0.0f;
+      ok &= isfinite(e.effect[k]);
+    }
+    if (!ok) {
+      Serial.printf("Reagents: %s has a bad effect value, skipped\n", e.name);
+      continue;
+    }
+    n++;
+  }
+  if (n == 0) return false;
+  if (n == reagentCount && memcmp(next, reagents, sizeof(Reagent) * n) == 0) return false;
+
+  memcpy(reagents, next, sizeof(reagents));
+  reagentCount = n;
+  reagentSave();
+  reagentRebuildMatrix();
+  Serial.printf("Reagents updated from RTDB: %d registered\n", reagentCount);
+  for (int p = 0; p < 4; p++) {
+    if (reagentOnPump[p] < 0) continue;
+    const Reagent& e = reagents[reagentOnPump[p]];
+    Serial.printf("  pump %d: %-15s alk=%.5f ca=%.5f mg=%.5f aux=%.5f%s\n", p + 1, e.name,
+                  e.effect[PARAM_ALK], e.effect[PARAM_CA], e.effect[PARAM_MG], e.effect[PARAM_AUX],
+                  e.raisesPh ? " (raises pH)" : "");
+  }
+  enforceChemSafetyCaps();
+  updatePumpSchedules();
+  configCommit();
+  return true;
+}
+
+// doseSchedule payload:
+// { "enabled": true, "startHour": 0, "endHour": 9, "everyMin": 15, "updatedAt": 1234567890,
+//   "profile": { "kalk": [24 hourly weights], "afr": [...], "mg": [...], "tbd": [...] },   (optional)
+//   "catchUp": { "enabled": true, "maxHours": 24, "spreadSlots": 4, "maxSlotFactor": 1.0 } } (optional)
+// Shared by the RTDB poll and the local API. Returns true if the schedule changed.
+bool applyDoseSchedulePayload(const String& payload) {
+  JsonDocument doc;
+  DeserializationError err = parseJsonTimed(doc, payload);
+  if (err) return false;
+
+  bool enabled    = doc["enabled"]   | false;
+  int  startHour  = doc["startHour"] | 0;
+  int  endHour    = doc["endHour"]   | 0;
+  int  everyMin   = doc["everyMin"]  | 60;
+
+  // Optional time-of-day profile; a missing pump (or profile) means uniform
+  static const char* const profileKeys[4] = {"kalk", "afr", "mg", "tbd"};
+  float profile[4][24] = {};
+  JsonObject prof = doc["profile"];
+  for (int p = 0; p < 4; p++) {
+    JsonArray w = prof[profileKeys[p]];
+    if (w.isNull() && p == 3) w = prof["aux"];
+    if (w.size() != 24) continue;
+    for (int h = 0; h < 24; h++) profile[p][h] = max(0.0f, w[h].as<float>());
+  }
+
+  // Optional catch-up policy; missing fields keep their defaults
+  CatchUpCfg catchUp;
+  JsonObject cu = doc["catchUp"];
+  if (!cu.isNull()) {
+    catchUp.enabled       = cu["enabled"] | catchUp.enabled;
+    catchUp.maxHours      = clampInt(cu["maxHours"] | catchUp.maxHours, 0, 72);
+    catchUp.spreadSlots   = clampInt(cu["spreadSlots"] | catchUp.spreadSlots, 1, MAX_DOSE_SLOTS);
+    catchUp.maxSlotFactor = clampf(cu["maxSlotFactor"] | catchUp.maxSlotFactor, 0.0f, 4.0f);
+  }
+  const bool catchUpChanged = catchUp.enabled != catchUpCfg.enabled ||
+                              catchUp.maxHours != catchUpCfg.maxHours ||
+                              catchUp.spreadSlots != catchUpCfg.spreadSlots ||
+                              catchUp.maxSlotFactor != catchUpCfg.maxSlotFactor;
+  if (catchUpChanged) {
+    catchUpCfg = catchUp;
+    if (!catchUpCfg.enabled) memset(catchUpMl, 0, sizeof(catchUpMl));
+    Serial.printf(">>> Catch-up policy: %s, %dh, %d slots, x%.2f\n", catchUpCfg.enabled ? "on" : "off",
+                  catchUpCfg.maxHours, catchUpCfg.spreadSlots, catchUpCfg.maxSlotFactor);
+  }
+
+  // --- THE NEW GATEKEEPER ---
+  // Compare current values against the NEW values from Firebase
+  if (enabled == doseScheduleCfg.enabled &&
+      startHour == doseScheduleCfg.startHour &&
+      endHour == doseScheduleCfg.endHour &&
+      everyMin == doseScheduleCfg.everyMin &&
+      memcmp(profile, doseProfile, sizeof(profile)) == 0) {
+      // Only the catch-up policy (if anything) changed: no re-prime, buckets kept
+      if (catchUpChanged) configCommit();
+      return catchUpChanged;
+  }
+
+  // If we got here, something actually changed!
+  Serial.println(">>> New Dose Schedule detected. Updating...");
+
+  doseScheduleCfg.enabled = enabled;
+  doseScheduleCfg.startHour = clampInt(startHour, 0, 23);
+  doseScheduleCfg.endHour   = clampInt(endHour,   0, 23);
+  doseScheduleCfg.everyMin  = clampInt(everyMin,  1, 240);
+  doseScheduleCfg.updatedAt = doc["updatedAt"] | getEpochMillis();
+  memcpy(doseProfile, profile, sizeof(doseProfile));
+
+  rebuildScheduleSlots();
+  doseSlotsPrimed = false;
+  primeDoseSlotsForToday();
+  updatePumpSchedules();
+  clearPendingBuckets("schedule changed");
+
+  Serial.println(">>> Schedule update complete.");
+  return true;
+}
+
+// Pull /settings/doseSchedule.json and apply changes.
+void firebaseSyncDoseScheduleOnce() {
+  if (pendingCloudMirror & MIRROR_DOSE_SCHEDULE) return; // local change not written back yet
+
+  String path = "/devices/" + String(DEVICE_ID) + "/settings/doseSchedule.json";
+  String payload = firebaseGetJson(path);
+  if (payload.length() == 0 || payload == "null") return;
+
+  applyDoseSchedulePayload(payload);
+}
+
+
+
+// ===================== FIREBASE: CALIBRATE COMMAND =====================
+// UI writes:
+//  devices/<id>/commands/calibrate = {trigger:true, pump:1..4, durationSec:60, ts:<ms>}
+// ESP32 runs that pump for durationSec seconds, then clears trigger and stores lastRun.
+int pumpNumToPin(int pump) {
+  switch (pump) {
+    case 1: return PIN_PUMP_KALK;
+    case 2: return PIN_PUMP_AFR;
+    case 3: return PIN_PUMP_MG;
+    case 4: return PIN_PUMP_TBD;
+    default: return -1;
+  }
+}
+//////////////////////////////////////////////////////////////////////////////////
+// dosingPlan payload: {"kalk":120,"afr":40,"mg":10,"tbd":0, ...}
+// We IGNORE "alk" (it's not a dose; sometimes a string).
+// Shared by the RTDB poll and the local API. Returns true if the plan changed.
+bool applyDosingPlanPayload(const String& payload) {
+  StaticJsonDocument<256> doc;
+  DeserializationError err = parseJsonTimed(doc, payload);
+  if (err) return false;
+
+  // helper: accept float or string
+  auto readFloat = [&](const char* key, float fallback) -> float {
+    if (!doc.containsKey(key)) return fallback;
+    JsonVariant v = doc[key];
+    if (v.is<float>() || v.is<int>() || v.is<double>()) return (float)v.as<double>();
+    if (v.is<const char*>()) return String(v.as<const char*>()).toFloat();
+    return fallback;
+  };
+
+  float nk = readFloat("kalk", dosing.ml_per_day_kalk);
+  float na = readFloat("afr",  dosing.ml_per_day_afr);
+  float nm = readFloat("mg",   dosing.ml_per_day_mg);
+  float nt = readFloat("tbd",  dosing.ml_per_day_tbd); // optional, default stays
+
+  // Basic sanity
+  if (!isfinite(nk) || nk < 0) nk = dosing.ml_per_day_kalk;
+  if (!isfinite(na) || na < 0) na = dosing.ml_per_day_afr;
+  if (!isfinite(nm) || nm < 0) nm = dosing.ml_per_day_mg;
+  if (!isfinite(nt) || nt < 0) nt = dosing.ml_per_day_tbd;
+
+  // Clamp to safety caps
+  nk = clampf(nk, 0.0f, MAX_KALK_ML_PER_DAY);
+  na = clampf(na, 0.0f, MAX_AFR_ML_PER_DAY);
+  nm = clampf(nm, 0.0f, MAX_MG_ML_PER_DAY);
+  nt = clampf(nt, 0.0f, MAX_TBD_ML_PER_DAY);
+
+  auto diff = [](float a, float b){ return fabsf(a-b); };
+  bool changed =
+      diff(nk, dosing.ml_per_day_kalk) > 0.01f ||
+      diff(na, dosing.ml_per_day_afr)  > 0.01f ||
+      diff(nm, dosing.ml_per_day_mg)   > 0.01f ||
+      diff(nt, dosing.ml_per_day_tbd)  > 0.01f;
+
+  if (!changed) return false;
+
+  Serial.printf(">>> Dosing plan UPDATED: kalk=%.2f afr=%.2f mg=%.2f tbd=%.2f\n",
+                nk, na, nm, nt);
+
+  dosing.ml_per_day_kalk = nk;
+  dosing.ml_per_day_afr  = na;
+  dosing.ml_per_day_mg   = nm;
+  dosing.ml_per_day_tbd  = nt;
+
+  updatePumpSchedules();
+  configCommit();
+  clearPendingBuckets("plan changed");
+  return true;
+}
+
+// Pull /devices/<id>/dosingPlan and apply if changed.
+void firebaseSyncDosingPlanOnce() {
+  if (pendingCloudMirror & MIRROR_DOSING_PLAN) return; // local change not written back yet
+
+  String path = "/devices/" + String(DEVICE_ID) + "/dosingPlan.json";
+  String payload = firebaseGetJson(path);
+
+  Serial.println("DOSING PLAN payload: " + payload);
+  if (payload.length() == 0 || payload == "null") return;
+
+  applyDosingPlanPayload(payload);
+}
+///////////////////////////////////////////////////////////////////////////////
+
+// calibrate payload: {"trigger":true,"pump":1..4,"durationSec":60}
+// Shared by the RTDB poll and the local API. Returns true if the command was consumed;
+// ackJson then holds the trigger-cleared node to write back.
+bool handleCalibratePayload(const String& payload, String& ackJson) {
+  // trigger
+  int trigIdx = payload.indexOf("\"trigger\"");
+  if (trigIdx < 0) return false;
+  int colonIdx = payload.indexOf(':', trigIdx);
+  if (colonIdx < 0) return false;
+  String valStr = payload.substring(colonIdx + 1);
+  valStr.trim();
+  bool trigger = valStr.startsWith("true");
+
+  if (!trigger) return false;
+
+  // pump number (default 1)
+  int pump = 1;
+  int pIdx = payload.indexOf("\"pump\"");
+  if (pIdx >= 0) {
+    int pColon = payload.indexOf(':', pIdx);
+    if (pColon >= 0) {
+      String pStr = payload.substring(pColon + 1);
+      pStr.trim();
+      pump = pStr.toInt();
+    }
+  }
+
+  // duration seconds (default 60)
+  int durationSec = 60;
+  int dIdx = payload.indexOf("\"durationSec\"");
+  if (dIdx >= 0) {
+    int dColon = payload.indexOf(':', dIdx);
+    if (dColon >= 0) {
+      String dStr = payload.substring(dColon + 1);
+      dStr.trim();
+      durationSec = dStr.toInt();
+      if (durationSec <= 0) durationSec = 60;
+      if (durationSec > CALIBRATE_MAX_SEC) durationSec = CALIBRATE_MAX_SEC; // safety cap
+    }
+  }
+
+  int pin = pumpNumToPin(pump);
+  PumpRunResult run = {};
+  bool aborted = false;
+  if (pin < 0) {
+    Serial.println("Calibrate: invalid pump number");
+  } else {
+    Serial.printf("Calibrate: running pump %d on pin %d for %d sec...\n", pump, pin, durationSec);
+    if (!giveDose(pin, (float)durationSec, &run, JOURNAL_CALIBRATE)) aborted = true;
+    if (aborted) {
+      Serial.printf("Calibrate: aborted after %.2fs (%s).\n", run.ranSec, pumpRunStopReason(run));
+    } else {
+      Serial.println("Calibrate: done.");
+    }
+    // Booked as "calibrate": kept in the history, skipped by the governor's 24h seed
+    ledgerRecordRun(pump, run.ranSec * run.flow / 60.0f, run.ranSec, "calibrate");
+  }
+
+  // Clear trigger and write lastRun
+  time_t nowSec = time(NULL);
+  uint64_t tsMs = (nowSec > 0) ? (uint64_t)nowSec * 1000ULL : (uint64_t)millis();
+
+  ackJson = "{";
+  ackJson += "\"trigger\":false,";
+  ackJson += "\"lastRun\":" + String((unsigned long long)tsMs) + ",";
+  ackJson += "\"pump\":" + String(pump) + ",";
+  ackJson += "\"durationSec\":" + String(durationSec);
+  if (aborted) {
+    // Partial run: the measured volume can't be used as a calibration
+    ackJson += ",\"aborted\":true,\"ranSec\":" + String(run.ranSec, 2);
+    ackJson += ",\"reason\":\"" + String(run.cancelled ? "estop" : run.allowedSec < run.requestedSec ? "governor" : "incomplete") + "\"";
+  }
+  ackJson += "}";
+
+  return true;
+}
+
+bool firebaseCheckAndHandleCalibrate() {
+  if (WiFi.status() != WL_CONNECTED) return false;
+
+  String path = "/devices/" + String(DEVICE_ID) + "/commands/calibrate";
+  String payload = firebaseGetJson(path);
+  if (payload.length() == 0 || payload == "null") return false;
+
+  Serial.print("calibrate payload: ");
+  Serial.println(payload);
+
+  String ackJson;
+  if (!handleCalibratePayload(payload, ackJson)) return false;
+
+  firebasePutJson(path, ackJson);
+  return true;
+}
+
+// ===================== FIREBASE: READ CALIBRATION VALUES =====================
+// UI saves to:
+//  devices/<id>/calibration/pumps/pumpN = {ml_per_min:<float>, ts:<ms>}
+// ESP32 pulls these periodically and updates FLOW_* variables + persists them.
+bool firebaseSyncFlowCalibrationOnce() {
+  if (WiFi.status() != WL_CONNECTED) return false;
+
+  String path = "/devices/" + String(DEVICE_ID) + "/calibration/pumps";
+  String payload = firebaseGetJson(path);
+  if (payload.length() == 0 || payload == "null") return false;
+
+  // Very small JSON pull parser (no ArduinoJson dependency).
+  auto extractFloat = [&](const String& key, float currentVal) -> float {
+    int k = payload.indexOf(key);
+    if (k < 0) return currentVal;
+    int c = payload.indexOf(':', k);
+    if (c < 0) return currentVal;
+    String s = payload.substring(c + 1);
+    s.trim();
+    // stop at comma/brace
+    int end = s.indexOf(',');
+    if (end < 0) end = s.indexOf('}');
+    if (end > 0) s = s.substring(0, end);
+    s.trim();
+    float v = s.toFloat();
+    if (v <= 0.0f) return currentVal;
+    return v;
+  };
+
+  float newK = extractFloat("\"ml_per_min\"", FLOW_KALK_ML_PER_MIN); // pump1 likely first hit
+  // Because keys repeat per pump, we parse per pump blocks:
+  auto parsePump = [&](int pump, float currentVal) -> float {
+    String pumpKey = "\"pump" + String(pump) + "\"";
+    int p = payload.indexOf(pumpKey);
+    if (p < 0) return currentVal;
+    int mp = payload.indexOf("\"ml_per_min\"", p);
+    if (mp < 0) return currentVal;
+    int c = payload.indexOf(':', mp);
+    if (c < 0) return currentVal;
+    String s = payload.substring(c + 1);
+    s.trim();
+    int end = s.indexOf(',');
+    if (end < 0) end = s.indexOf('}');
+    if (end > 0) s = s.substring(0, end);
+    s.trim();
+    float v = s.toFloat();
+    if (v <= 0.0f) return currentVal;
+    return v;
+  };
+
+  float fk = parsePump(1, FLOW_KALK_ML_PER_MIN);
+  float fa = parsePump(2, FLOW_AFR_ML_PER_MIN);
+  float fm = parsePump(3, FLOW_MG_ML_PER_MIN);
+  float fx = parsePump(4, FLOW_TBD_ML_PER_MIN);
+
+  bool changed = (fk != FLOW_KALK_ML_PER_MIN) || (fa != FLOW_AFR_ML_PER_MIN) || (fm != FLOW_MG_ML_PER_MIN) || (fx != FLOW_TBD_ML_PER_MIN);
+
+  FLOW_KALK_ML_PER_MIN = fk;
+  FLOW_AFR_ML_PER_MIN  = fa;
+  FLOW_MG_ML_PER_MIN   = fm;
+  FLOW_TBD_ML_PER_MIN  = fx;
+  FLOW_AUX_ML_PER_MIN  = fx; // keep in sync (legacy)
+
+  if (changed) {
+    Serial.print("Flow updated from RTDB: KALK=");
+    Serial.print(FLOW_KALK_ML_PER_MIN);
+    Serial.print(" AFR=");
+    Serial.print(FLOW_AFR_ML_PER_MIN);
+    Serial.print(" MG=");
+    Serial.print(FLOW_MG_ML_PER_MIN);
+    Serial.print(" AUX=");
+    Serial.println(FLOW_AUX_ML_PER_MIN);
+    configCommit();
+    pumpGuardUpdateLimits();
+    firebaseSetCalibrationStatus();
+  }
+
+  return changed;
+}
+
+
+// ===================== FIREBASE: CALIBRATION STATUS (ACK) =====================
+// Writes /devices/<id>/calibration/status so the UI can show "ESP applied" acknowledgement.
+void firebaseSetCalibrationStatus() {
+  String path = "/devices/" + String(DEVICE_ID) + "/calibration/status";
+
+  // Use epoch ms
+  uint64_t tsMs = getEpochMillis();
+  String json = "{";
+  json += "\"appliedAt\":" + String((unsigned long long)tsMs) + ",";
+  json += "\"flows\":{";
+  json += "\"kalk\":" + String(FLOW_KALK_ML_PER_MIN, 2) + ",";
+  json += "\"afr\":" + String(FLOW_AFR_ML_PER_MIN, 2) + ",";
+  json += "\"mg\":" + String(FLOW_MG_ML_PER_MIN, 2) + ",";
+  json += "\"aux\":" + String(FLOW_AUX_ML_PER_MIN, 2);
+  json += "}";
+  json += "}";
+  firebasePutJson(path, json);
+}
+
+// ===================== FIREBASE: OTA STATUS & REQUEST =====================
+// The image is firmware.bin next to firmware.bin.gz and their manifest
+// firmware.json on Hosting (scripts/build_ota_manifest.py writes all three):
+//   {"version":"1.0.5","build":"...","sha256":"<64 hex>","size":1234567,"gzSize":712345}
+// With "gzSize" the .gz is fetched and inflated on the fly (OtaInflate); without
+// it, or if the .gz isn't deployed, firmware.bin. sha256 / size are always the
+// image as flashed. The download comes in OTA_CHUNK_BYTES Range requests, straight
+// into the update partition, with SHA-256 run over every byte as it is written. A dropped
+// connection or a stalled read resumes at the byte where it stopped; only
+// OTA_MAX_STALLS attempts in a row without a single new byte give up. The new
+// partition is only made bootable when size and digest match the manifest.
+// All of that runs in otaTask at low priority while dosing carries on; the
+// restart waits for otaSafeToActivate(), and the new image only stays once
+// otaServiceValidation() has seen it run (otherwise the bootloader rolls back).
+// otaStatus: {"status","error","bytes","total","pct","retries","updatedAt"}
+//   status: starting / downloading / staged / activating / success / error
+
+const uint32_t OTA_CHUNK_BYTES     = 65536;
+const int      OTA_MAX_STALLS      = 8;
+const uint32_t OTA_READ_TIMEOUT_MS = 15000;
+const uint32_t OTA_PROGRESS_MS     = 5000;
+const size_t   OTA_BUF_LEN         = 2048;
+const uint32_t OTA_TASK_STACK      = 12288;
+const int      OTA_ACTIVATE_CLEAR_MIN = 5;       // no slot due for this long (or half the slot interval)
+const uint32_t OTA_VALIDATE_MS     = 180000;     // new image: loop clean and timers ticking this long
+const uint32_t OTA_VALIDATE_STALL_MS = 30000;    // a loop pass longer than this restarts the window
+const uint32_t OTA_VALIDATE_DEADLINE_MS = 900000; // ... or roll back
+
+void firebaseSetOtaStatus(const String& status, const String& error,
+                          uint32_t bytes = 0, uint32_t total = 0, int retries = 0) {
+  String path = "/devices/" + String(DEVICE_ID) + "/otaStatus";
+
+  time_t nowSec = time(NULL);
+  uint64_t tsMs = (nowSec > 0) ? (uint64_t)nowSec * 1000ULL : (uint64_t)millis();
+
+  String json = "{";
+  json += "\"status\":\"" + status + "\"";
+  if (error.length() > 0) {
+    json += ",\"error\":\"" + jsonEscape(error) + "\"";
+  }
+  if (total > 0) {
+    json += ",\"bytes\":" + String((unsigned long)bytes);
+    json += ",\"total\":" + String((unsigned long)total);
+    json += ",\"pct\":" + String(100.0f * (float)bytes / (float)total, 1);
+    json += ",\"retries\":" + String(retries);
+  }
+  json += ",\"updatedAt\":" + String((unsigned long long)tsMs);
+  json += "}";
+
+  firebasePutJson(path, json);
+}
+
+// Streaming SHA-256 (mbedtls; the _ret names are the non-deprecated ones before 3.0).
+struct OtaSha256 {
+  mbedtls_sha256_context ctx;
+  OtaSha256() {
+    mbedtls_sha256_init(&ctx);
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    mbedtls_sha256_starts(&ctx, 0);
+#else
+    mbedtls_sha256_starts_ret(&ctx, 0);
+#endif
+  }
+  ~OtaSha256() { mbedtls_sha256_free(&ctx); }
+  void update(const uint8_t* data, size_t len) {
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    mbedtls_sha256_update(&ctx, data, len);
+#else
+    mbedtls_sha256_update_ret(&ctx, data, len);
+#endif
+  }
+  String hex() {
+    uint8_t digest[32];
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    mbedtls_sha256_finish(&ctx, digest);
+#else
+    mbedtls_sha256_finish_ret(&ctx, digest);
+#endif
+    char out[65];
+    for (int i = 0; i < 32; i++) snprintf(out + 2 * i, 3, "%02x", digest[i]);
+    return String(out);
+  }
+};
+
+struct OtaManifest {
+  String   version;
+  String   sha256;      // lowercase hex
+  uint32_t size = 0;    // 0 = not given
+  uint32_t gzSize = 0;  // 0 = no compressed image
+};
+
+static bool otaHexDigestValid(const String& hex) {
+  if (hex.length() != 64) return false;
+  for (size_t i = 0; i < hex.length(); i++) {
+    if (!isxdigit((unsigned char)hex[i])) return false;
+  }
+  return true;
+}
+
+static bool otaFetchManifest(WiFiClientSecure& client, const String& url, OtaManifest& m, String& err) {
+  HTTPClient https;
+  if (!https.begin(client, url)) {
+    err = "manifest begin failed";
+    return false;
+  }
+  https.setTimeout(OTA_READ_TIMEOUT_MS);
+  const int code = https.GET();
+  if (code != HTTP_CODE_OK) {
+    err = "manifest HTTP " + String(code);
+    https.end();
+    return false;
+  }
+  const String body = https.getString();
+  https.end();
+
+  JsonDocument doc;
+  if (parseJsonTimed(doc, body)) {
+    err = "manifest is not JSON";
+    return false;
+  }
+  m.version = doc["version"] | "";
+  m.sha256  = doc["sha256"] | "";
+  m.sha256.toLowerCase();
+  m.size    = doc["size"] | 0;
+  m.gzSize  = doc["gzSize"] | 0;
+  if (!otaHexDigestValid(m.sha256)) {
+    err = "manifest has no sha256";
+    return false;
+  }
+  return true;
+}
+
+// Streaming gunzip: the ROM inflater (tinfl) writing into its 32 KB circular
+// dictionary, which is flushed into the partition as it fills. About 43 KB of
+// heap, only while a compressed update runs. Takes the gzip the build writes
+// (no name/extra fields); the 8-byte trailer is left to the SHA-256 check.
+struct OtaInflate {
+  tinfl_decompressor* inflator = nullptr;
+  uint8_t* dict = nullptr;
+  size_t   dictOfs = 0;
+  uint8_t  header[10];
+  size_t   headerLen = 0;
+  bool     done = false;
+  OtaInflate() {
+    inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+    dict     = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+    if (inflator) tinfl_init(inflator);
+  }
+  ~OtaInflate() {
+    free(inflator);
+    free(dict);
+  }
+  bool ok() const { return inflator && dict; }
+};
+
+struct OtaDownload {
+  uint32_t    offset = 0;       // bytes downloaded (compressed for a .gz)
+  uint32_t    total  = 0;       // download size, from the first response
+  uint32_t    written = 0;      // image bytes written to the update partition (and hashed)
+  uint32_t    imageSize = 0;    // Update.begin() size: the manifest's for a .gz, else total
+  bool        begun  = false;   // Update.begin() done
+  bool        notFound = false; // 404 before anything was written
+  int         retries = 0;      // requests that ended short
+  uint32_t    lastReportMs = 0;
+  OtaSha256   sha;
+  OtaInflate* gz = nullptr;     // set: inflate the download into the partition
+  String      error;            // set = give up, no retry
+};
+
+static void otaReportProgress(OtaDownload& dl, bool force) {
+  if (!force && millis() - dl.lastReportMs < OTA_PROGRESS_MS) return;
+  dl.lastReportMs = millis();
+  Serial.printf("OTA: %lu / %lu bytes%s (%d retries)\n",
+                (unsigned long)dl.offset, (unsigned long)dl.total, dl.gz ? " gz" : "", dl.retries);
+  firebaseSetOtaStatus("downloading", "", dl.offset, dl.total, dl.retries);
+}
+
+static bool otaWriteImage(OtaDownload& dl, const uint8_t* data, size_t len) {
+  if (dl.written + len > dl.imageSize) {
+    dl.error = "image larger than manifest size";
+    return false;
+  }
+  if (Update.write((uint8_t*)data, len) != len) {
+    dl.error = "flash write failed: " + String(Update.errorString());
+    return false;
+  }
+  dl.sha.update(data, len);
+  dl.written += (uint32_t)len;
+  return true;
+}
+
+// Downloaded bytes in order: straight to flash, or through the inflater.
+static bool otaConsume(OtaDownload& dl, const uint8_t* in, size_t len) {
+  if (!dl.gz) return otaWriteImage(dl, in, len);
+  OtaInflate& z = *dl.gz;
+
+  while (len > 0 && z.headerLen < sizeof(z.header)) {
+    z.header[z.headerLen++] = *in++;
+    len--;
+  }
+  if (z.headerLen < sizeof(z.header)) return true;
+  if (z.header[0] != 0x1f || z.header[1] != 0x8b || z.header[2] != 8 || z.header[3] != 0) {
+    dl.error = "unsupported gzip header";
+    return false;
+  }
+
+  while (!z.done) {
+    size_t inBytes  = len;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - z.dictOfs;
+    const tinfl_status st = tinfl_decompress(z.inflator, in, &inBytes, z.dict, z.dict + z.dictOfs,
+                                             &outBytes, TINFL_FLAG_HAS_MORE_INPUT);
+    in  += inBytes;
+    len -= inBytes;
+    if (outBytes > 0) {
+      if (!otaWriteImage(dl, z.dict + z.dictOfs, outBytes)) return false;
+      z.dictOfs = (z.dictOfs + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+    if (st == TINFL_STATUS_DONE) {
+      z.done = true;
+    } else if (st < 0) {
+      dl.error = "gzip data corrupt (" + String((int)st) + ")";
+      return false;
+    } else if (st == TINFL_STATUS_NEEDS_MORE_INPUT) {
+      break;
+    }
+  }
+  return true;
+}
+
+// One Range request from dl.offset. Whatever arrives before a drop or a stall is
+// written and kept. Returns the HTTP code (< 0: transport error).
+static int otaFetchChunk(HTTPClient& https, WiFiClientSecure& client, const String& url,
+                         OtaDownload& dl, uint8_t* buf) {
+  if (!https.begin(client, url)) return HTTPC_ERROR_CONNECTION_REFUSED;
+  https.setTimeout(OTA_READ_TIMEOUT_MS);
+  https.setReuse(true);
+  uint32_t last = dl.offset + OTA_CHUNK_BYTES - 1;
+  if (dl.total > 0 && last >= dl.total) last = dl.total - 1;
+  https.addHeader("Range", "bytes=" + String((unsigned long)dl.offset) + "-" + String((unsigned long)last));
+  static const char* headerKeys[] = {"Content-Range"};
+  https.collectHeaders(headerKeys, 1);
+
+  const int code = https.GET();
+  if (code != HTTP_CODE_PARTIAL_CONTENT && code != HTTP_CODE_OK) {
+    if (code == 404 && dl.written == 0) dl.notFound = true;
+    https.end();
+    return code;
+  }
+
+  uint32_t total = 0, len = 0, skip = 0;
+  if (code == HTTP_CODE_PARTIAL_CONTENT) {
+    unsigned long a = 0, b = 0, t = 0;
+    if (sscanf(https.header("Content-Range").c_str(), "bytes %lu-%lu/%lu", &a, &b, &t) != 3 ||
+        a != dl.offset || b < a || t == 0) {
+      dl.error = "bad Content-Range";
+      https.end();
+      return code;
+    }
+    total = (uint32_t)t;
+    len   = (uint32_t)(b - a + 1);
+  } else {
+    // Server ignored the Range header: whole file again, skip what we have
+    const int size = https.getSize();
+    if (size <= 0 || (uint32_t)size < dl.offset) {
+      dl.error = "Content length not set";
+      https.end();
+      return code;
+    }
+    total = (uint32_t)size;
+    skip  = dl.offset;
+    len   = total - dl.offset;
+  }
+
+  if (dl.total == 0) {
+    dl.total = total;
+    if (!dl.gz) dl.imageSize = total;
+  } else if (total != dl.total) {
+    dl.error = "image changed during download";
+    https.end();
+    return code;
+  }
+  if (!dl.begun) {
+    if (!Update.begin(dl.imageSize)) {
+      dl.error = "Not enough space";
+      https.end();
+      return code;
+    }
+    dl.begun = true;
+  }
+
+  WiFiClient* stream = https.getStreamPtr();
+  uint32_t lastDataMs = millis();
+  while (len > 0) {
+    const int avail = stream->available();
+    if (avail <= 0) {
+      if (!stream->connected() || millis() - lastDataMs > OTA_READ_TIMEOUT_MS) break;
+      delay(2);
+      continue;
+    }
+    const size_t want = min((size_t)avail, min(OTA_BUF_LEN, (size_t)(skip ? skip : len)));
+    const int n = stream->read(buf, want);
+    if (n <= 0) continue;
+    lastDataMs = millis();
+    if (skip) {
+      skip -= (uint32_t)n;
+      continue;
+    }
+    if (!otaConsume(dl, buf, (size_t)n)) break;
+    dl.offset += (uint32_t)n;
+    len -= (uint32_t)n;
+    otaReportProgress(dl, false);
+  }
+
+  https.end();
+  if (len > 0) {
+    dl.retries++;
+    client.stop();   // don't reuse a half-read connection
+  }
+  return code;
+}
+
+// Download `url` into the update partition and check it against the manifest.
+// True = verified and Update.end() done. Errors are reported, except a 404 on
+// the .gz (dl.notFound), which the caller falls back from.
+static bool otaDownloadImage(WiFiClientSecure& client, const String& url, const OtaManifest& manifest,
+                             OtaDownload& dl) {
+  static uint8_t buf[OTA_BUF_LEN];
+  HTTPClient https;
+  int stalls = 0;
+  Serial.println("OTA: downloading " + url);
+  firebaseSetOtaStatus("downloading", "", 0, dl.gz ? manifest.gzSize : manifest.size);
+
+  while (dl.total == 0 || dl.offset < dl.total) {
+    const uint32_t before = dl.offset;
+    const int code = otaFetchChunk(https, client, url, dl, buf);
+    if (dl.error.length() > 0 || dl.notFound) break;
+    const uint32_t expect = dl.gz ? manifest.gzSize : manifest.size;
+    if (expect > 0 && dl.total > 0 && dl.total != expect) {
+      dl.error = "size " + String((unsigned long)dl.total) + " != manifest " + String((unsigned long)expect);
+      break;
+    }
+    if (code >= 400 && code < 500 && code != 408 && code != 429) {
+      dl.error = "HTTP code " + String(code);
+      break;
+    }
+    if (dl.offset > before) {
+      stalls = 0;
+      continue;
+    }
+    if (++stalls >= OTA_MAX_STALLS) {
+      dl.error = "stalled at " + String((unsigned long)dl.offset) + " bytes (last code " + String(code) + ")";
+      break;
+    }
+    Serial.printf("OTA: no data (code %d), retry %d/%d from byte %lu\n",
+                  code, stalls, OTA_MAX_STALLS, (unsigned long)dl.offset);
+    client.stop();
+    delay(1000UL * stalls);
+  }
+
+  if (dl.error.length() == 0 && !dl.notFound && dl.gz && (!dl.gz->done || dl.written != dl.imageSize)) {
+    dl.error = "gzip stream truncated";
+  }
+  if (dl.error.length() > 0 || dl.notFound) {
+    if (dl.begun) Update.abort();
+    if (dl.notFound) return false;
+    Serial.println("OTA: " + dl.error);
+    firebaseSetOtaStatus("error", dl.error, dl.offset, dl.total, dl.retries);
+    return false;
+  }
+  otaReportProgress(dl, true);
+
+  const String digest = dl.sha.hex();
+  if (digest != manifest.sha256) {
+    Update.abort();
+    Serial.println("OTA: sha256 mismatch, got " + digest);
+    firebaseSetOtaStatus("error", "sha256 mismatch", dl.offset, dl.total, dl.retries);
+    return false;
+  }
+
+  if (!Update.end()) {
+    Serial.print("OTA: Update.end() error: ");
+    Serial.println(Update.getError());
+    firebaseSetOtaStatus("error", "Update.end failed");
+    return false;
+  }
+
+  if (!Update.isFinished()) {
+    Serial.println("OTA: Update not finished");
+    firebaseSetOtaStatus("error", "Update not finished");
+    return false;
+  }
+  return true;
+}
+
+// Download + verify from a HTTPS URL into the update partition (bootable from the
+// next restart); the manifest is firmware.json in the same folder. Runs in otaTask.
+bool performOtaFromUrl(const String& url) {
+  firebaseSetOtaStatus("starting", "");
+
+  if (WiFi.status() != WL_CONNECTED) {
+    firebaseSetOtaStatus("error", "WiFi not connected");
+    return false;
+  }
+
+  WiFiClientSecure otaClient;
+  otaClient.setInsecure();
+
+  Serial.print("Starting OTA from URL: ");
+  Serial.println(url);
+
+  const String manifestUrl = url.substring(0, url.lastIndexOf('/') + 1) + "firmware.json";
+  OtaManifest manifest;
+  String err;
+  if (!otaFetchManifest(otaClient, manifestUrl, manifest, err)) {
+    Serial.println("OTA: " + err);
+    firebaseSetOtaStatus("error", err);
+    return false;
+  }
+  Serial.printf("OTA: manifest version %s, %lu bytes (gz %lu), sha256 %s\n",
+                manifest.version.c_str(), (unsigned long)manifest.size,
+                (unsigned long)manifest.gzSize, manifest.sha256.c_str());
+
+  bool ok = false;
+  bool fallBack = true;
+  uint32_t downloaded = 0;
+  int retries = 0;
+  if (manifest.gzSize > 0 && manifest.size > 0) {
+    OtaInflate inflate;
+    if (inflate.ok()) {
+      OtaDownload dl;
+      dl.gz = &inflate;
+      dl.imageSize = manifest.size;
+      ok = otaDownloadImage(otaClient, url + ".gz", manifest, dl);
+      fallBack = !ok && dl.notFound;
+      downloaded = dl.total;
+      retries = dl.retries;
+      if (fallBack) Serial.println("OTA: no firmware.bin.gz deployed, using firmware.bin");
+    } else {
+      Serial.println("OTA: no heap for the inflater, using firmware.bin");
+    }
+  }
+  if (!ok && fallBack) {
+    OtaDownload dl;
+    ok = otaDownloadImage(otaClient, url, manifest, dl);
+    if (!ok && dl.notFound) firebaseSetOtaStatus("error", "HTTP code 404");
+    downloaded = dl.total;
+    retries = dl.retries;
+  }
+  if (!ok) return false;
+
+  Serial.printf("OTA: %s staged, %lu bytes verified (sha256 ok, %lu downloaded, %d retries)\n",
+                manifest.version.c_str(), (unsigned long)manifest.size, (unsigned long)downloaded, retries);
+  firebaseSetOtaStatus("staged", "", downloaded, downloaded, retries);
+
+  // Clear otaRequest so we don't try again after reboot
+  firebasePutJson("/devices/" + String(DEVICE_ID) + "/otaRequest", "null");
+  return true;
+}
+
+enum OtaStage : uint8_t { OTA_IDLE, OTA_DOWNLOADING, OTA_STAGED };
+volatile OtaStage otaStage = OTA_IDLE;
+String otaStageUrl;
+
+void otaTask(void*) {
+  const bool ok = performOtaFromUrl(otaStageUrl);
+  otaStage = ok ? OTA_STAGED : OTA_IDLE;
+  if (ok) Serial.println("OTA: waiting for a safe point to restart");
+  vTaskDelete(nullptr);
+}
+
+// Start the download in the background. One at a time; a staged image waits.
+bool otaStageBegin(const String& url) {
+  if (otaStage != OTA_IDLE) {
+    Serial.println("OTA: already downloading or staged, request ignored");
+    return false;
+  }
+  otaStageUrl = url;
+  otaStage = OTA_DOWNLOADING;
+  // Core 0, priority 1: off loop()'s core and below the E-stop stream and the WiFi stack
+  if (xTaskCreatePinnedToCore(otaTask, "ota", OTA_TASK_STACK, nullptr, 1, nullptr, 0) != pdPASS) {
+    otaStage = OTA_IDLE;
+    firebaseSetOtaStatus("error", "no memory for the OTA task");
+    return false;
+  }
+  return true;
+}
+
+// Minutes until the next slot that hasn't fired (0 = one is due now), -1 without a clock.
+static int otaMinutesToNextSlot() {
+  struct tm t;
+  if (!getLocalTime(&t, 0) || !isTimeValid(t)) return -1;
+  const int nowMin = t.tm_hour * 60 + t.tm_min;
+  int best = 24 * 60;
+  for (int i = 0; i < DOSE_SLOTS_PER_DAY; i++) {
+    const int d = (DOSE_HOURS[i] * 60 + DOSE_MINUTES[i] - nowMin + 24 * 60) % (24 * 60);
+    if (d == 0 && slotDone[i]) continue;   // this minute's slot already ran
+    best = min(best, d);
+  }
+  return best;
+}
+
+// Safe to restart: nothing pumping or queued, and no slot due before we're back.
+static bool otaSafeToActivate() {
+  if (!pumpDriverIdle() || slotRun.active) return false;
+  const int toNext = otaMinutesToNextSlot();
+  if (toNext < 0) return true;   // no clock: the slot loop isn't dosing either
+  int clearMin = OTA_ACTIVATE_CLEAR_MIN;
+  if (doseScheduleCfg.enabled) clearMin = min(clearMin, clampInt(doseScheduleCfg.everyMin, 1, 240) / 2);
+  return toNext > clearMin;
+}
+
+// loop(): restart into a staged image at the first safe point.
+void otaServiceActivation() {
+  if (otaStage != OTA_STAGED || !otaSafeToActivate()) return;
+  Serial.println("OTA: safe point reached, restarting into the new image");
+  firebaseSetOtaStatus("activating", "");
+  configCommit();
+  delay(500);
+  ESP.restart();
+}
+
+// Tell the Arduino core we validate a freshly flashed image ourselves (below);
+// a reset before that makes the bootloader go back to the previous one.
+extern "C" bool verifyRollbackLater() { return true; }
+
+// loop(): keep a new image once it has shown it can dose on its own: the config
+// was readable, and for OTA_VALIDATE_MS loop() kept coming round (no pass over
+// OTA_VALIDATE_STALL_MS) while the pump driver and the pump guard timers ticked
+// at at least half their rate. WiFi is not a condition (an outage or a dead
+// router must not roll a good image back); it's only logged, and the "success"
+// status waits for it. Rolls back if that hasn't happened by OTA_VALIDATE_DEADLINE_MS.
+void otaServiceValidation() {
+  static bool checked = false;
+  static bool reportPending = false;
+  static uint32_t cleanSinceMs = 0, lastPassMs = 0, driverTicks0 = 0, guardTicks0 = 0;
+
+  if (reportPending && WiFi.status() == WL_CONNECTED) {
+    reportPending = false;
+    firebaseSetOtaStatus("success", "");
+  }
+  if (checked) return;
+  esp_ota_img_states_t state;
+  if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) != ESP_OK ||
+      state != ESP_OTA_IMG_PENDING_VERIFY) {
+    checked = true;
+    configDropLegacy();
+    return;
+  }
+  if (configUnreadable) {
+    Serial.println("OTA: new image can't read the saved config, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+    return;
+  }
+
+  const uint32_t now = millis();
+  if (cleanSinceMs == 0 || now - lastPassMs > OTA_VALIDATE_STALL_MS) {
+    if (cleanSinceMs) Serial.printf("OTA: loop stalled %lu ms, validation restarts\n", (unsigned long)(now - lastPassMs));
+    cleanSinceMs = now | 1;
+    driverTicks0 = pumpDriverTicks;
+    guardTicks0  = pumpGuardNowTick;
+  }
+  lastPassMs = now;
+
+  if (now - cleanSinceMs >= OTA_VALIDATE_MS) {
+    const uint32_t span = now - cleanSinceMs;
+    const bool driverOk = pumpDriverTicks - driverTicks0 >= span / (PUMP_DRIVER_TICK_US / 1000) / 2;
+    const bool guardOk  = pumpGuardNowTick - guardTicks0 >= span / PUMP_GUARD_TICK_MS / 2;
+    if (driverOk && guardOk) {
+      checked = true;
+      esp_ota_mark_app_valid_cancel_rollback();
+      configDropLegacy();
+      Serial.printf("OTA: image %s validated (WiFi %s)\n", FW_VERSION,
+                    WiFi.status() == WL_CONNECTED ? "up" : "down");
+      reportPending = true;
+      return;
+    }
+    Serial.printf("OTA: %s%s not ticking, validation restarts\n",
+                  driverOk ? "" : "pump driver ", guardOk ? "" : "pump guard ");
+    cleanSinceMs = 0;
+  }
+  if (now >= OTA_VALIDATE_DEADLINE_MS) {
+    Serial.println("OTA: new image not healthy, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+}
+
+// Check /devices/{DEVICE_ID}/commands/otaRequest for an update trigger
+void firebaseCheckAndHandleOtaRequest() {
+  if (WiFi.status() != WL_CONNECTED) return;
+
+  // This ensures we are looking at the "reefDoser6" folder in the database
+  String path = "/devices/" + String(DEVICE_ID) + "/commands/otaRequest";
+  
+  String payload = firebaseGetJson(path);
+  
+  // If nothing is there, or it's "null", just exit
+  if (payload.length() == 0 || payload == "null") return;
+
+  Serial.println("OTA Trigger command detected!");
+
+  // HARD-FIX: We ignore the URL inside the payload. 
+  // We force it to use reefDoser6 based on the DEVICE_ID at the top of this file.
+  String myCorrectUrl = "https://aidoser.web.app/devices/" + String(DEVICE_ID) + "/firmware.bin";
+
+  Serial.print("Forcing update from: ");
+  Serial.println(myCorrectUrl);
+
+  // 1. CLEANUP: Clear the request in Firebase so it doesn't reboot into an infinite update loop
+  firebasePutJson(path, "null");
+
+  // 2. EXECUTE: download in the background; otaServiceActivation() restarts later
+  otaStageBegin(myCorrectUrl);
+}
+
+// Fallback poll of settings/killSwitch (the stream in E-STOP FAST PATH is the fast one).
+void checkEmergencyStop() {
+    if (pendingCloudMirror & MIRROR_KILL_SWITCH) return; // local change not written back yet
+
+    // We check a specific "killSwitch" path in your RTDB
+    String stopStatus = firebaseGetJson("/devices/" + String(DEVICE_ID) + "/settings/killSwitch");
+    if (stopStatus.length() == 0) return; // no answer (offline/timeout): keep current state
+
+    applyCloudKillSwitch(stopStatus == "true", "firebase");
+}
+
+// ===================== FIREBASE: STATE HEARTBEAT =====================
+
+void firebaseSendStateHeartbeat() {
+  if (WiFi.status() != WL_CONNECTED) return;
+
+  time_t nowSec = time(NULL);
+  uint64_t tsMs = (nowSec > 0) ? (uint64_t)nowSec * 1000ULL : (uint64_t)millis();
+
+  // Pending buckets (so UI can explain catch-up)
+  const float pk = pendingKalkMl, pa = pendingAfrMl, pm = pendingMgMl, pt = pendingTbdMl;
+
+  int activeSlots = (doseScheduleCfg.enabled) ? DOSE_SLOTS_PER_DAY : 3;
+  if (activeSlots < 1) activeSlots = 1;
+
+  String path = "/devices/" + String(DEVICE_ID) + "/state";
+
+  String json = "{";
+  json += "\"online\":true,";
+  json += "\"fwVersion\":\"" + String(FW_VERSION) + "\",";
+  json += "\"lastSeen\":" + String((unsigned long long)tsMs) + ",";
+
+  json += "\"dosingMlPerDay\":{";
+  json += "\"kalk\":" + String(dosing.ml_per_day_kalk, 2) + ",";
+  json += "\"afr\":"  + String(dosing.ml_per_day_afr,  2) + ",";
+  json += "\"mg\":"   + String(dosing.ml_per_day_mg,   2) + ",";
+  json += "\"tbd\":"  + String(dosing.ml_per_day_tbd,  2);
+  json += "},";
+
+  json += "\"doseSlotsPerDay\":" + String(activeSlots) + ",";
+
+  json += "\"pendingMl\":{";
+  json += "\"kalk\":" + String(pk, 2) + ",";
+  json += "\"afr\":"  + String(pa, 2) + ",";
+  json += "\"mg\":"   + String(pm, 2) + ",";
+  json += "\"tbd\":"  + String(pt, 2);
+  json += "},";
+
+  json += "\"flowMlPerMin\":{";
+  json += "\"kalk\":" + String(FLOW_KALK_ML_PER_MIN, 2) + ",";
+  json += "\"afr\":"  + String(FLOW_AFR_ML_PER_MIN,  2) + ",";
+  json += "\"mg\":"   + String(FLOW_MG_ML_PER_MIN,   2) + ",";
+  json += "\"tbd\":"  + String(FLOW_TBD_ML_PER_MIN,  2);
+  json += "},";
+
+  json += "\"metrics\":" + metricsSummaryJson() + ",";
+  json += "\"doseSla\":" + slaSummaryJson() + ",";
+  json += "\"governor\":" + governorSummaryJson() + ",";
+  json += "\"catchUp\":" + catchUpSummaryJson();
+
+  json += "}";
+
+  firebasePutJson(path, json);
+}
+
+
+// ===================== HTTP HANDLERS (local debug/legacy) =====================
+
+// ---------- local command queue ----------
+// Async handlers run in the AsyncTCP task and must never block (no pumps, NVS or
+// Firebase calls from there). They queue work here; loop() executes it.
+enum LocalCmdType : uint8_t {
+  LOCAL_CMD_SUBMIT_TEST,
+  LOCAL_CMD_LIVE_DOSE,
+  LOCAL_CMD_CALIBRATE,
+  LOCAL_CMD_RESET_AI,
+  LOCAL_CMD_DOSING_PLAN,
+  LOCAL_CMD_DOSE_SCHEDULE,
+  LOCAL_CMD_KILL_SWITCH,   // E-stop already applied by the handler; loop mirrors it to RTDB
+};
+
+const int LOCAL_CMD_PAYLOAD_MAX = 768;   // fits a doseSchedule with four 24h profiles
+
+struct LocalCmd {
+  LocalCmdType type;
+  float ca;
+  float alk;
+  float mg;
+  float ph;
+  char  payload[LOCAL_CMD_PAYLOAD_MAX]; // same JSON the RTDB node would hold
+};
+
+const int LOCAL_CMD_QUEUE_LEN = 8;
+QueueHandle_t localCmdQueue = nullptr;
+
+bool queueLocalCmd(const LocalCmd& cmd) {
+  if (!localCmdQueue) return false;
+  return xQueueSend(localCmdQueue, &cmd, 0) == pdTRUE;
+}
+
+void serviceLocalCommands() {
+  if (!localCmdQueue) return;
+
+  LocalCmd cmd;
+  while (xQueueReceive(localCmdQueue, &cmd, 0) == pdTRUE) {
+    const String payload(cmd.payload);
+    String ackJson;
+
+    switch (cmd.type) {
+      case LOCAL_CMD_SUBMIT_TEST:
+        onNewTestInput(cmd.ca, cmd.alk, cmd.mg, cmd.ph, 0.0f);
+        break;
+      case LOCAL_CMD_LIVE_DOSE:
+        handleLiveDosePayload(payload, ackJson);
+        break;
+      case LOCAL_CMD_CALIBRATE:
+        handleCalibratePayload(payload, ackJson);
+        break;
+      case LOCAL_CMD_RESET_AI:
+        handleResetAiPayload(payload);
+        break;
+      case LOCAL_CMD_DOSING_PLAN:
+        if (applyDosingPlanPayload(payload)) pendingCloudMirror |= MIRROR_DOSING_PLAN;
+        break;
+      case LOCAL_CMD_DOSE_SCHEDULE:
+        if (applyDoseSchedulePayload(payload)) pendingCloudMirror |= MIRROR_DOSE_SCHEDULE;
+        break;
+      case LOCAL_CMD_KILL_SWITCH:
+        pendingCloudMirror |= MIRROR_KILL_SWITCH;
+        break;
+    }
+  }
+}
+
+// Query-string or form-body argument (form body wins), like WebServer::arg().
+static String requestArg(AsyncWebServerRequest* request, const char* name) {
+  const AsyncWebParameter* p = request->getParam(name, true);
+  if (!p) p = request->getParam(name);
+  return p ? p->value() : String();
+}
+
+void handleRoot(AsyncWebServerRequest* request){
+  request->send(200, "text/html", MAIN_PAGE_HTML);
+}
+
+// ---------- static web assets (LittleFS) ----------
+// scripts/build_web_assets.py gzips webstuff/ into /www/<name>.gz and writes
+// /www/manifest.txt: "<name> <content-type> <etag>" per line.
+// Files go out as stored (Content-Encoding: gzip, streamed from flash) with a strong
+// ETag; a matching If-None-Match gets 304 so repeat loads are a few hundred bytes.
+struct WebAsset {
+  String name;
+  String type;
+  String etag; // quoted, ready for the header
+};
+
+const int MAX_WEB_ASSETS = 16;
+WebAsset webAssets[MAX_WEB_ASSETS];
+int webAssetCount = 0;
+
+void loadWebAssetManifest() {
+  webAssetCount = 0;
+  if (!fsMounted) return;
+
+  File f = LittleFS.open("/www/manifest.txt", FILE_READ);
+  if (!f) {
+    Serial.println("Web assets: no /www/manifest.txt (run pio run -t uploadfs)");
+    return;
+  }
+
+  while (f.available() && webAssetCount < MAX_WEB_ASSETS) {
+    String line = f.readStringUntil('\n');
+    line.trim();
+    int sp1 = line.indexOf(' ');
+    int sp2 = (sp1 > 0) ? line.indexOf(' ', sp1 + 1) : -1;
+    if (sp1 <= 0 || sp2 <= sp1) continue;
+
+    WebAsset& a = webAssets[webAssetCount++];
+    a.name = line.substring(0, sp1);
+    a.type = line.substring(sp1 + 1, sp2);
+    a.etag = "\"" + line.substring(sp2 + 1) + "\"";
+  }
+  f.close();
+
+  Serial.printf("Web assets: %d files in manifest\n", webAssetCount);
+}
+
+void handleWebAsset(AsyncWebServerRequest* request, const WebAsset& asset) {
+  const AsyncWebHeader* inm = request->getHeader("If-None-Match");
+  if (inm && inm->value().indexOf(asset.etag) >= 0) {
+    AsyncWebServerResponse* resp = request->beginResponse(304);
+    resp->addHeader("ETag", asset.etag);
+    resp->addHeader("Cache-Control", "no-cache");
+    request->send(resp);
+    return;
+  }
+
+  AsyncWebServerResponse* resp =
+      request->beginResponse(LittleFS, "/www/" + asset.name + ".gz", asset.type);
+  resp->addHeader("Content-Encoding", "gzip");
+  resp->addHeader("ETag", asset.etag);
+  resp->addHeader("Cache-Control", "no-cache"); // always revalidate; cheap thanks to the ETag
+  request->send(resp);
+}
+
+// Registers one route per manifest entry; "/" serves index.html when present.
+void registerWebAssetRoutes() {
+  bool haveIndex = false;
+  for (int i = 0; i < webAssetCount; i++) {
+    const WebAsset* asset = &webAssets[i];
+    server.on(("/" + asset->name).c_str(), HTTP_GET, [asset](AsyncWebServerRequest* request) {
+      handleWebAsset(request, *asset);
+    });
+    if (asset->name == "index.html") {
+      server.on("/", HTTP_GET, [asset](AsyncWebServerRequest* request) {
+        handleWebAsset(request, *asset);
+      });
+      haveIndex = true;
+    }
+  }
+  if (!haveIndex) server.on("/", HTTP_GET, handleRoot);
+}
+
+void handleSubmitTest(AsyncWebServerRequest* request){
+  if (request->method() != HTTP_POST) {
+    request->send(405, "text/plain", "Method Not Allowed");
+    return;
+  }
+
+  LocalCmd cmd = {};
+  cmd.type = LOCAL_CMD_SUBMIT_TEST;
+  cmd.ca   = requestArg(request, "ca").toFloat();
+  cmd.alk  = requestArg(request, "alk").toFloat();
+  cmd.mg   = requestArg(request, "mg").toFloat();
+  cmd.ph   = requestArg(request, "ph").toFloat();
+
+  if (!queueLocalCmd(cmd)) {
+    request->send(503, "text/plain", "Busy, try again");
+    return;
+  }
+
+  AsyncWebServerResponse* resp = request->beginResponse(303);
+  resp->addHeader("Location", "/");
+  request->send(resp);
+}
+
+// ---------- /api/history ----------
+// GET /api/history?since=<epochSec>&limit=<n>&points=<n>&series=alk|ca|mg|ph
+//  since : only tests with t >= since
+//  limit : keep the newest <limit> of those
+//  points: LTTB-downsample the selection to <points> (driven by <series>, default alk)
+// The response is streamed with chunked transfer encoding, one record at a time,
+// so RAM use doesn't depend on how much history is kept.
+
+enum HistorySeries { SERIES_ALK, SERIES_CA, SERIES_MG, SERIES_PH };
+
+static float historySeriesValue(const TestPoint& tp, HistorySeries series) {
+  switch (series) {
+    case SERIES_CA: return tp.ca;
+    case SERIES_MG: return tp.mg;
+    case SERIES_PH: return tp.ph;
+    default:        return tp.alk;
+  }
+}
+
+// Walks a window of history and yields the sequence numbers to send, one at a time.
+// With points >= 3 and fewer than the window size it runs Largest-Triangle-Three-Buckets
+// incrementally: O(1) state, each point is visited at most twice.
+// Caller holds HistoryLock around next().
+struct HistoryCursor {
+  uint32_t firstSeq = 0; // sequence number of the window start
+  int count  = 0;        // window size
+  int points = 0;        // LTTB target, 0 = send everything
+  HistorySeries series = SERIES_ALK;
+
+  int step = 0;          // points emitted so far
+  int prev = 0;          // last emitted (window-relative)
+
+  const TestPoint& at(int i) const { return historyBySeq(firstSeq + (uint32_t)i); }
+
+  // Returns a window-relative index, or -1 when done.
+  int next() {
+    if (points < 3 || points >= count) {
+      return (step < count) ? step++ : -1;
+    }
+    if (step >= points) return -1;
+    if (step == 0)          { step++; prev = 0; return 0; }
+    if (step == points - 1) { step++; return count - 1; }
+
+    const float every = float(count - 2) / float(points - 2);
+    const int   b     = step - 1; // bucket 0..points-3
+
+    // Average of the next bucket (the last point alone for the final bucket)
+    int avgStart = (int)((b + 1) * every) + 1;
+    int avgEnd   = (int)((b + 2) * every) + 1;
+    if (avgEnd > count) avgEnd = count;
+    if (avgStart >= avgEnd) avgStart = avgEnd - 1;
+    float avgX = 0.0f, avgY = 0.0f;
+    for (int i = avgStart; i < avgEnd; i++) {
+      avgX += (float)at(i).t;
+      avgY += historySeriesValue(at(i), series);
+    }
+    avgX /= (float)(avgEnd - avgStart);
+    avgY /= (float)(avgEnd - avgStart);
+
+    // Pick the point in this bucket forming the largest triangle with prev and the average
+    int rangeStart = (int)(b * every) + 1;
+    int rangeEnd   = (int)((b + 1) * every) + 1;
+    if (rangeEnd > count - 1) rangeEnd = count - 1;
+
+    const float ax = (float)at(prev).t;
+    const float ay = historySeriesValue(at(prev), series);
+
+    int   pick = rangeStart;
+    float best = -1.0f;
+    for (int i = rangeStart; i < rangeEnd; i++) {
+      float area = fabsf((ax - avgX) * (historySeriesValue(at(i), series) - ay) -
+                         (ax - (float)at(i).t) * (avgY - ay));
+      if (area > best) { best = area; pick = i; }
+    }
+
+    step++;
+    prev = pick;
+    return pick;
+  }
+};
+
+// Chunked-response state for /api/history. The filler runs in the AsyncTCP task
+// and pulls one record at a time into `pend`.
+struct HistoryStream {
+  HistoryCursor cur;
+  uint8_t stage      = 0;    // 0 header, 1 points, 2 footer, 3 done
+  bool    firstPoint = true;
+  char    pend[128];
+  size_t  pendLen = 0;
+  size_t  pendOff = 0;
+
+  // Render the next piece of the body into pend; false when finished.
+  bool produce() {
+    int n = 0;
+    while (n == 0) {
+      if (stage == 0) {
+        n = snprintf(pend, sizeof(pend), "{\"dosing\":{\"kalk\":%.1f,\"afr\":%.1f,\"mg\":%.1f},\"tests\":[",
+                     dosing.ml_per_day_kalk, dosing.ml_per_day_afr, dosing.ml_per_day_mg);
+        stage = 1;
+      } else if (stage == 1) {
+        TestPoint tp;
+        {
+          HistoryLock lock;
+          int i = cur.next();
+          if (i < 0) { stage = 2; continue; }
+          // Skip points overwritten by new tests since the request started
+          if (cur.firstSeq + (uint32_t)i < historyOldestSeq()) continue;
+          tp = cur.at(i);
+        }
+        n = snprintf(pend, sizeof(pend), "%s{\"t\":%lu,\"ca\":%.1f,\"alk\":%.2f,\"mg\":%.1f,\"ph\":%.2f}",
+                     firstPoint ? "" : ",", (unsigned long)tp.t, tp.ca, tp.alk, tp.mg, tp.ph);
+        firstPoint = false;
+      } else if (stage == 2) {
+        n = snprintf(pend, sizeof(pend), "]}");
+        stage = 3;
+      } else {
+        return false;
+      }
+    }
+    pendLen = (n < (int)sizeof(pend)) ? (size_t)n : sizeof(pend) - 1;
+    pendOff = 0;
+    return true;
+  }
+
+  size_t fill(uint8_t* buf, size_t maxLen) {
+    size_t n = 0;
+    while (n < maxLen) {
+      if (pendOff >= pendLen && !produce()) break;
+      size_t take = min(maxLen - n, pendLen - pendOff);
+      memcpy(buf + n, pend + pendOff, take);
+      n += take;
+      pendOff += take;
+    }
+    return n;
+  }
+};
+
+void handleApiHistory(AsyncWebServerRequest* request){
+  String sinceStr = requestArg(request, "since");
+  const uint32_t since = sinceStr.length() ? strtoul(sinceStr.c_str(), nullptr, 10) : 0;
+  const int limit  = (int)requestArg(request, "limit").toInt();
+  const int points = (int)requestArg(request, "points").toInt();
+
+  HistorySeries series = SERIES_ALK;
+  String s = requestArg(request, "series");
+  if (s == "ca") series = SERIES_CA;
+  else if (s == "mg") series = SERIES_MG;
+  else if (s == "ph") series = SERIES_PH;
+
+  std::shared_ptr<HistoryStream> stream = std::make_shared<HistoryStream>();
+  {
+    HistoryLock lock;
+    // History is chronological: skip everything before `since`, then keep the newest `limit`.
+    int first = 0;
+    while (first < historyCount && historyAt(first).t < since) first++;
+    int count = historyCount - first;
+    if (limit > 0 && count > limit) {
+      first += count - limit;
+      count  = limit;
+    }
+    stream->cur.firstSeq = historyOldestSeq() + (uint32_t)first;
+    stream->cur.count    = count;
+  }
+  stream->cur.points = points;
+  stream->cur.series = series;
+
+  AsyncWebServerResponse* resp = request->beginChunkedResponse("application/json",
+    [stream](uint8_t* buf, size_t maxLen, size_t index) -> size_t {
+      return stream->fill(buf, maxLen);
+    });
+  request->send(resp);
+}
+
+// GET /api/ledger?from=<epoch s>&to=<epoch s>&res=raw|hour|day
+// Dose history from the on-device ledger (default: raw runs of the last 24h).
+void handleApiLedger(AsyncWebServerRequest* request){
+  if (!fsMounted) {
+    request->send(503, "text/plain", "LittleFS not mounted");
+    return;
+  }
+
+  // Taken here, before any file is opened, so a compaction can't start under the stream
+  if (!ledgerReaderAcquire()) {
+    AsyncWebServerResponse* busy = request->beginResponse(503, "text/plain", "ledger compaction running, retry");
+    busy->addHeader("Retry-After", "2");
+    request->send(busy);
+    return;
+  }
+  std::shared_ptr<LedgerStream> stream = std::make_shared<LedgerStream>();
+  stream->held = true;
+  const uint32_t now = (uint32_t)time(NULL);
+  String fromStr = requestArg(request, "from");
+  String toStr   = requestArg(request, "to");
+  stream->from = fromStr.length() ? strtoul(fromStr.c_str(), nullptr, 10) : (now > 86400UL ? now - 86400UL : 0);
+  stream->to   = toStr.length()   ? strtoul(toStr.c_str(),   nullptr, 10) : UINT32_MAX;
+
+  String res = requestArg(request, "res");
+  if (res == "hour")     stream->res = LEDGER_RES_HOUR;
+  else if (res == "day") stream->res = LEDGER_RES_DAY;
+
+  AsyncWebServerResponse* resp = request->beginChunkedResponse("application/json",
+    [stream](uint8_t* buf, size_t maxLen, size_t index) -> size_t {
+      return stream->fill(buf, maxLen);
+    });
+  request->send(resp);
 }
 
-// ===================== FIREBASE: OTA STATUS & REQUEST =====================
+// GET /metrics: Prometheus scrape target. Reads only atomics, so it's safe here.
+void handleMetrics(AsyncWebServerRequest* request){
+  AsyncResponseStream* resp = request->beginResponseStream("text/plain; version=0.0.4");
+  metricsWritePrometheus(*resp);
+  request->send(resp);
+}
 
-void firebaseSetOtaStatus(const String& status, const String& error) {
-  String path = "/devices/" + String(DEVICE_ID) + "/otaStatus";
 
-  time_t nowSec = time(NULL);
-  uint64_t tsMs = (nowSec > 0) ? (uint64_t)nowSec * 1000ULL : (uint64_t)millis();
+// ===================== LOCAL CONTROL API =====================
+// Same command surface as RTDB, on the LAN, for when the cloud round trip is too slow
+// or the internet is down. Bodies are the exact JSON the matching RTDB node holds:
+//
+//  POST /api/commands/liveDose       {"trigger":true,"pump":1,"ml":5}
+//  POST /api/commands/calibrate      {"trigger":true,"pump":1,"durationSec":60}
+//  POST /api/commands/resetAi        true
+//  PUT  /api/settings/killSwitch     true | false      (applied immediately)
+//  PUT  /api/dosingPlan              {"kalk":120,"afr":40,"mg":10,"tbd":0}
+//  PUT  /api/settings/doseSchedule   {"enabled":true,"startHour":0,"endHour":9,"everyMin":15}
+//
+// Auth: "Authorization: Bearer <token>", token from /devices/<id>/settings/localApiToken
+// (cached in NVS so it works offline). No token configured = API disabled.
+// Commands are queued and run by loop() through the same handlers as the RTDB poll;
+// the E-stop is applied inside the request. Settings are written back to RTDB.
+
+const int LOCAL_API_TOKEN_MAX = 64;
+char localApiToken[LOCAL_API_TOKEN_MAX + 1] = "";
+portMUX_TYPE localApiTokenMux = portMUX_INITIALIZER_UNLOCKED;
+
+void setLocalApiToken(const String& token) {
+  portENTER_CRITICAL(&localApiTokenMux);
+  strncpy(localApiToken, token.c_str(), LOCAL_API_TOKEN_MAX);
+  localApiToken[LOCAL_API_TOKEN_MAX] = '\0';
+  portEXIT_CRITICAL(&localApiTokenMux);
+}
 
-  String json = "{";
-  json += "\"status\":\"" + status + "\"";
-  if (error.length() > 0) {
-    json += ",\"error\":\"" + error + "\"";
+// Keys: localapi/token
+void loadLocalApiTokenFromPrefs() {
+  NvsPrefs prefs;
+  if (!prefs.begin("localapi", true)) {
+    Serial.println("Prefs: failed to open localapi (read)");
+    return;
   }
-  json += ",\"updatedAt\":" + String((unsigned long long)tsMs);
-  json += "}";
-
-  firebasePutJson(path, json);
+  setLocalApiToken(prefs.getString("token", ""));
+  prefs.end();
 }
 
-// Perform OTA from a HTTPS URL
-bool performOtaFromUrl(const String& url) {
-  firebaseSetOtaStatus("starting", "");
+// Pull /settings/localApiToken (a JSON string) and cache it if it changed.
+void firebaseSyncLocalApiTokenOnce() {
+  String payload = firebaseGetJson("/devices/" + String(DEVICE_ID) + "/settings/localApiToken");
+  if (payload.length() == 0) return;
 
-  if (WiFi.status() != WL_CONNECTED) {
-    firebaseSetOtaStatus("error", "WiFi not connected");
-    return false;
+  String token;
+  if (payload != "null") {
+    JsonDocument doc;
+    if (parseJsonTimed(doc, payload)) return;
+    token = doc.as<String>();
   }
+  if (token.length() > (unsigned)LOCAL_API_TOKEN_MAX) token = token.substring(0, LOCAL_API_TOKEN_MAX);
+  if (token == String(localApiToken)) return;
 
-  WiFiClientSecure otaClient;
-  otaClient.setInsecure();
-
-  HTTPClient https;
-  Serial.print("Starting OTA from URL: ");
-  Serial.println(url);
+  setLocalApiToken(token);
 
-  if (!https.begin(otaClient, url)) {
-    https.setTimeout(30000);
-    https.setReuse(false);
-    Serial.println("OTA: https.begin failed");
-    firebaseSetOtaStatus("error", "https.begin failed");
-    return false;
+  NvsPrefs prefs;
+  if (!prefs.begin("localapi", false)) {
+    Serial.println("Prefs: failed to open localapi (write)");
+    return;
   }
+  prefs.putString("token", token);
+  prefs.end();
+  Serial.println(token.length() ? "Local API token updated" : "Local API disabled (no token)");
+}
 
-  int httpCode = https.GET();
-  if (httpCode != HTTP_CODE_OK) {
-    Serial.print("OTA: HTTP GET failed, code=");
-    Serial.println(httpCode);
-    firebaseSetOtaStatus("error", "HTTP code " + String(httpCode));
-    https.end();
-    return false;
+// Write locally changed settings back to RTDB; retried every poll until it sticks.
+void serviceCloudMirror() {
+  if (pendingCloudMirror == 0 || WiFi.status() != WL_CONNECTED) return;
+
+  const String base = "/devices/" + String(DEVICE_ID);
+
+  if (pendingCloudMirror & MIRROR_KILL_SWITCH) {
+    if (firebasePutJson(base + "/settings/killSwitch", globalEmergencyStop ? "true" : "false")) {
+      pendingCloudMirror &= ~MIRROR_KILL_SWITCH;
+    }
   }
 
-  int contentLength = https.getSize();
-  if (contentLength <= 0) {
-    Serial.println("OTA: Content-Length not set");
-    firebaseSetOtaStatus("error", "Content length not set");
-    https.end();
-    return false;
+  if (pendingCloudMirror & MIRROR_DOSING_PLAN) {
+    String json = "{";
+    json += "\"kalk\":" + String(dosing.ml_per_day_kalk, 2) + ",";
+    json += "\"afr\":"  + String(dosing.ml_per_day_afr,  2) + ",";
+    json += "\"mg\":"   + String(dosing.ml_per_day_mg,   2) + ",";
+    json += "\"tbd\":"  + String(dosing.ml_per_day_tbd,  2);
+    json += "}";
+    if (firebasePatchJson(base + "/dosingPlan", json)) {
+      pendingCloudMirror &= ~MIRROR_DOSING_PLAN;
+    }
   }
 
-  firebaseSetOtaStatus("downloading", "");
+  if (pendingCloudMirror & MIRROR_DOSE_SCHEDULE) {
+    String json = "{";
+    json += "\"enabled\":" + String(doseScheduleCfg.enabled ? "true" : "false") + ",";
+    json += "\"startHour\":" + String(doseScheduleCfg.startHour) + ",";
+    json += "\"endHour\":" + String(doseScheduleCfg.endHour) + ",";
+    json += "\"everyMin\":" + String(doseScheduleCfg.everyMin) + ",";
+    json += "\"updatedAt\":" + String((unsigned long long)doseScheduleCfg.updatedAt) + ",";
+    json += "\"profile\":" + doseProfileJson() + ",";
+    json += "\"catchUp\":{\"enabled\":" + String(catchUpCfg.enabled ? "true" : "false") +
+            ",\"maxHours\":" + String(catchUpCfg.maxHours) +
+            ",\"spreadSlots\":" + String(catchUpCfg.spreadSlots) +
+            ",\"maxSlotFactor\":" + String(catchUpCfg.maxSlotFactor, 2) + "}";
+    json += "}";
+    if (firebasePatchJson(base + "/settings/doseSchedule", json)) {
+      pendingCloudMirror &= ~MIRROR_DOSE_SCHEDULE;
+    }
+  }
+}
 
-  bool canBegin = Update.begin(contentLength);
-  if (!canBegin) {
-    Serial.println("OTA: Not enough space for update");
-    firebaseSetOtaStatus("error", "Not enough space");
-    https.end();
-    return false;
+static bool localApiAuthorized(AsyncWebServerRequest* request) {
+  char token[LOCAL_API_TOKEN_MAX + 1];
+  portENTER_CRITICAL(&localApiTokenMux);
+  memcpy(token, localApiToken, sizeof(token));
+  portEXIT_CRITICAL(&localApiTokenMux);
+
+  const size_t tokenLen = strlen(token);
+  if (tokenLen == 0) return false;
+
+  const AsyncWebHeader* h = request->getHeader("Authorization");
+  if (!h) return false;
+  const String& v = h->value();
+  if (!v.startsWith("Bearer ")) return false;
+
+  // Constant-time compare
+  const char* given = v.c_str() + 7;
+  const size_t givenLen = v.length() - 7;
+  uint8_t diff = (givenLen != tokenLen);
+  for (size_t i = 0; i < tokenLen; i++) {
+    diff |= (uint8_t)token[i] ^ (uint8_t)(i < givenLen ? given[i] : 0);
   }
+  return diff == 0;
+}
 
-  WiFiClient * stream = https.getStreamPtr();
-  size_t written = Update.writeStream(*stream);
-  if (written != (size_t)contentLength) {
-    Serial.print("OTA: Written only ");
-    Serial.print(written);
-    Serial.print(" / ");
-    Serial.println(contentLength);
-    firebaseSetOtaStatus("error", "WriteStream mismatch");
-    https.end();
-    return false;
+// Body handler: collects up to LOCAL_CMD_PAYLOAD_MAX-1 bytes into request->_tempObject
+// (freed by the request).
+static void collectLocalApiBody(AsyncWebServerRequest* request, uint8_t* data, size_t len,
+                                size_t index, size_t total) {
+  if (total >= (size_t)LOCAL_CMD_PAYLOAD_MAX) return; // too big, handler answers 413
+  if (index == 0 && !request->_tempObject) request->_tempObject = calloc(total + 1, 1);
+  if (request->_tempObject && index + len <= total) {
+    memcpy((char*)request->_tempObject + index, data, len);
   }
+}
 
-  if (!Update.end()) {
-    Serial.print("OTA: Update.end() error: ");
-    Serial.println(Update.getError());
-    firebaseSetOtaStatus("error", "Update.end failed");
-    https.end();
-    return false;
+static void handleLocalApiCommand(AsyncWebServerRequest* request, LocalCmdType type) {
+  if (!localApiAuthorized(request)) {
+    request->send(401, "application/json", "{\"error\":\"unauthorized\"}");
+    return;
+  }
+  const char* body = (const char*)request->_tempObject;
+  if (!body) {
+    request->send(413, "application/json", "{\"error\":\"missing or oversized body\"}");
+    return;
   }
 
-  https.end();
+  LocalCmd cmd = {};
+  cmd.type = type;
+  strncpy(cmd.payload, body, LOCAL_CMD_PAYLOAD_MAX - 1);
 
-  if (!Update.isFinished()) {
-    Serial.println("OTA: Update not finished");
-    firebaseSetOtaStatus("error", "Update not finished");
-    return false;
+  if (type == LOCAL_CMD_KILL_SWITCH) {
+    String v(body);
+    v.trim();
+    if (v != "true" && v != "false") {
+      request->send(400, "application/json", "{\"error\":\"expected true or false\"}");
+      return;
+    }
+    // The stop itself can't wait for loop(): pins go LOW before we answer.
+    setEmergencyStop(v == "true", "local");
+    queueLocalCmd(cmd); // RTDB write-back + notification from loop()
+    request->send(200, "application/json", String("{\"killSwitch\":") + v + "}");
+    return;
   }
 
-  Serial.println("OTA: Update successful, rebooting...");
-  firebaseSetOtaStatus("success", "");
+  if (!queueLocalCmd(cmd)) {
+    request->send(503, "application/json", "{\"error\":\"busy\"}");
+    return;
+  }
+  request->send(202, "application/json", "{\"queued\":true}");
+}
 
-  // Clear otaRequest so we don't try again after reboot
-  firebasePutJson("/devices/" + String(DEVICE_ID) + "/otaRequest", "null");
+void registerLocalApiRoutes() {
+  struct Route { const char* uri; WebRequestMethodComposite method; LocalCmdType type; };
+  static const Route routes[] = {
+    {"/api/commands/liveDose",     HTTP_POST,            LOCAL_CMD_LIVE_DOSE},
+    {"/api/commands/calibrate",    HTTP_POST,            LOCAL_CMD_CALIBRATE},
+    {"/api/commands/resetAi",      HTTP_POST,            LOCAL_CMD_RESET_AI},
+    {"/api/settings/killSwitch",   HTTP_PUT | HTTP_POST, LOCAL_CMD_KILL_SWITCH},
+    {"/api/dosingPlan",            HTTP_PUT | HTTP_POST, LOCAL_CMD_DOSING_PLAN},
+    {"/api/settings/doseSchedule", HTTP_PUT | HTTP_POST, LOCAL_CMD_DOSE_SCHEDULE},
+  };
 
-  delay(1000);
-  ESP.restart();
-  return true; // never reached
+  for (const Route& r : routes) {
+    const LocalCmdType type = r.type;
+    server.on(r.uri, r.method,
+              [type](AsyncWebServerRequest* request) { handleLocalApiCommand(request, type); },
+              nullptr, collectLocalApiBody);
+  }
 }
 
-// Check /devices/{DEVICE_ID}/commands/otaRequest for an update trigger
-void firebaseCheckAndHandleOtaRequest() {
-  if (WiFi.status() != WL_CONNECTED) return;
 
-  // This ensures we are looking at the "reefDoser6" folder in the database
-  String path = "/devices/" + String(DEVICE_ID) + "/commands/otaRequest";
-  
-  String payload = firebaseGetJson(path);
-  
-  // If nothing is there, or it's "null", just exit
-  if (payload.length() == 0 || payload == "null") return;
+// ===================== LOOP PROFILER =====================
+// Times each loop() stage with the CPU cycle counter. Per stage it keeps
+// min/avg/p99/max for the current and the last completed window (PROF_WINDOW_MS)
+// plus the worst case since boot. p99 comes from a log2 histogram, so it is an
+// upper bound within 2x. Everything runs on the loop task: no locks.
+// Report: serial "prof" / "prof reset", or RTDB commands/profile = true
+// (answer lands in devices/<id>/profile).
+
+enum ProfStageId : uint8_t {
+  PROF_LOCAL_CMDS, PROF_WS_FLUSH, PROF_WIFI_WATCH, PROF_SAFETY_BACKOFF, PROF_DOSING,
+  PROF_CLOUD_MIRROR, PROF_RESET_AI, PROF_LIVE_DOSE, PROF_OTA_REQUEST, PROF_CALIBRATE,
+  PROF_SCHEDULE_SYNC, PROF_PLAN_SYNC, PROF_TANK_SYNC, PROF_ESTOP, PROF_TEST_SYNC,
+  PROF_POLL_HEARTBEAT, PROF_PROFILE_CMD, PROF_FLOW_SYNC, PROF_TOKEN_SYNC, PROF_HEARTBEAT,
+  PROF_LEDGER, PROF_ROLLUPS, PROF_PUMP_DRIVER, PROF_REAGENT_SYNC,
+  PROF_SELF,            // overhead calibration only, not reported as a stage
+  PROF_STAGE_COUNT
+};
 
-  Serial.println("OTA Trigger command detected!");
+static const char* const PROF_STAGE_NAMES[PROF_STAGE_COUNT] = {
+  "localCmds", "wsFlush", "wifiWatch", "safetyBackoff", "dosing",
+  "cloudMirror", "resetAi", "liveDose", "otaRequest", "calibrate",
+  "scheduleSync", "planSync", "tankSync", "estop", "testSync",
+  "pollHeartbeat", "profileCmd", "flowSync", "tokenSync", "heartbeat",
+  "ledger", "rollups", "pumpDriver", "reagentSync",
+  "self"
+};
 
-  // HARD-FIX: We ignore the URL inside the payload. 
-  // We force it to use reefDoser6 based on the DEVICE_ID at the top of this file.
-  String myCorrectUrl = "https://aidoser.web.app/devices/" + String(DEVICE_ID) + "/firmware.bin";
+const uint32_t PROF_WINDOW_MS = 60000;
+const int      PROF_BUCKETS   = 20;    // bucket b holds [2^(b-1), 2^b) us; the last one is open-ended
+const int      PROF_REPORT_TOP = 8;
 
-  Serial.print("Forcing update from: ");
-  Serial.println(myCorrectUrl);
+struct ProfWindow {
+  uint32_t n;
+  uint32_t sumUs;
+  uint32_t minUs;
+  uint32_t maxUs;
+  uint32_t hist[PROF_BUCKETS];
+};
 
-  // 1. CLEANUP: Clear the request in Firebase so it doesn't reboot into an infinite update loop
-  firebasePutJson(path, "null");
+struct ProfStage {
+  ProfWindow cur;
+  ProfWindow last;
+  uint32_t worstUs;
+  uint32_t worstAt;     // epoch seconds
+};
+
+ProfStage profStages[PROF_STAGE_COUNT];
+uint32_t  profCyclesPerUs   = 240;
+uint32_t  profWindowStartMs = 0;
+uint32_t  profOverheadNs    = 0;
 
-  // 2. EXECUTE: Use the URL we just built
-  performOtaFromUrl(myCorrectUrl); 
+static void profResetWindow(ProfWindow& w) {
+  memset(&w, 0, sizeof(w));
+  w.minUs = UINT32_MAX;
 }
 
-void checkEmergencyStop() {
-    // We check a specific "killSwitch" path in your RTDB
-    String stopStatus = firebaseGetJson("/devices/" + String(DEVICE_ID) + "/settings/killSwitch");
-    
-    if (stopStatus == "true") {
-        if (!globalEmergencyStop) {
-            Serial.println("!!! EMERGENCY STOP ACTIVATED VIA FIREBASE !!!");
-            // Physical safety: Force all pins LOW immediately
-            digitalWrite(PIN_PUMP_KALK, LOW);
-            digitalWrite(PIN_PUMP_AFR,  LOW);
-            digitalWrite(PIN_PUMP_MG,   LOW);
-            digitalWrite(PIN_PUMP_TBD,  LOW);
-            
-            firebasePushNotification("CRITICAL", "E-STOP ACTIVE", "All dosing pumps have been hard-disabled.");
-        }
-        globalEmergencyStop = true;
-    } else {
-        globalEmergencyStop = false;
+static inline void profRecord(uint8_t id, uint32_t cycles, TickType_t ticks) {
+  // The cycle counter wraps every ~17 s at 240 MHz; long stages (pumps running) use ticks.
+  const uint32_t tickMs = ticks * portTICK_PERIOD_MS;
+  const uint32_t us = (tickMs > 10000) ? tickMs * 1000 : cycles / profCyclesPerUs;
+
+  ProfStage& s = profStages[id];
+  ProfWindow& w = s.cur;
+  w.n++;
+  w.sumUs += us;
+  if (us < w.minUs) w.minUs = us;
+  if (us > w.maxUs) w.maxUs = us;
+  int b = us ? 32 - __builtin_clz(us) : 0;
+  if (b >= PROF_BUCKETS) b = PROF_BUCKETS - 1;
+  w.hist[b]++;
+  if (us > s.worstUs) {
+    s.worstUs = us;
+    s.worstAt = epochSeconds();
+  }
+}
+
+// Times the enclosing block as one stage.
+struct ProfScope {
+  uint8_t    id;
+  uint32_t   c0;
+  TickType_t t0;
+  explicit ProfScope(uint8_t stage) : id(stage), c0(ESP.getCycleCount()), t0(xTaskGetTickCount()) {}
+  ~ProfScope() { profRecord(id, ESP.getCycleCount() - c0, xTaskGetTickCount() - t0); }
+};
+
+static uint32_t profP99(const ProfWindow& w) {
+  if (w.n == 0) return 0;
+  const uint32_t rank = w.n - w.n / 100;   // ceil(0.99 n) for n >= 1
+  uint32_t acc = 0;
+  for (int b = 0; b < PROF_BUCKETS; b++) {
+    acc += w.hist[b];
+    if (acc >= rank) {
+      const uint32_t upper = (b == 0) ? 0 : ((b >= 32) ? UINT32_MAX : (1UL << b) - 1);
+      return min(upper, w.maxUs);
     }
+  }
+  return w.maxUs;
 }
 
-// ===================== FIREBASE: STATE HEARTBEAT =====================
+void profReset() {
+  for (int i = 0; i < PROF_STAGE_COUNT; i++) {
+    profResetWindow(profStages[i].cur);
+    profResetWindow(profStages[i].last);
+    profStages[i].worstUs = 0;
+    profStages[i].worstAt = 0;
+  }
+  profWindowStartMs = millis();
+}
 
-void firebaseSendStateHeartbeat() {
-  if (WiFi.status() != WL_CONNECTED) return;
+// Boot-time setup: cycle scale + measured cost of one ProfScope.
+void profInit() {
+  profCyclesPerUs = max((uint32_t)1, (uint32_t)ESP.getCpuFreqMHz());
+  profReset();
+
+  const int N = 1000;
+  const uint32_t c0 = ESP.getCycleCount();
+  for (int i = 0; i < N; i++) { ProfScope p(PROF_SELF); }
+  const uint32_t cycles = ESP.getCycleCount() - c0;
+  profOverheadNs = (uint32_t)((uint64_t)cycles * 1000ULL / N / profCyclesPerUs);
+  profResetWindow(profStages[PROF_SELF].cur);
+  Serial.printf("Profiler: %lu ns per stage\n", (unsigned long)profOverheadNs);
+}
 
-  time_t nowSec = time(NULL);
-  uint64_t tsMs = (nowSec > 0) ? (uint64_t)nowSec * 1000ULL : (uint64_t)millis();
+// Called once per loop(): rotates the window.
+void profTick() {
+  if ((uint32_t)(millis() - profWindowStartMs) < PROF_WINDOW_MS) return;
+  profWindowStartMs = millis();
+  for (int i = 0; i < PROF_STAGE_COUNT; i++) {
+    profStages[i].last = profStages[i].cur;
+    profResetWindow(profStages[i].cur);
+  }
+}
 
-  // Pull pending buckets (so UI can explain catch-up)
-  float pk = 0, pa = 0, pm = 0, pt = 0;
-  {
-    Preferences prefs;
-    if (prefs.begin("doser-buckets", true)) {
-      pk = prefs.getFloat("p_kalk", 0.0f);
-      pa = prefs.getFloat("p_afr",  0.0f);
-      pm = prefs.getFloat("p_mg",   0.0f);
-      pt = prefs.getFloat("p_tbd",  0.0f);
-      prefs.end();
-    }
+// Window used for reporting: last completed one, or the current one right after boot/reset.
+static const ProfWindow& profReportWindow(int i) {
+  return profStages[i].last.n ? profStages[i].last : profStages[i].cur;
+}
+
+// Stage ids ordered by p99 (worst first); returns how many were written.
+static int profTopStages(uint8_t* out, int maxOut) {
+  uint8_t ids[PROF_STAGE_COUNT];
+  uint32_t p99[PROF_STAGE_COUNT];
+  int n = 0;
+  for (int i = 0; i < PROF_STAGE_COUNT; i++) {
+    if (i == PROF_SELF || profReportWindow(i).n == 0) continue;
+    const uint32_t p = profP99(profReportWindow(i));
+    int j = n++;
+    while (j > 0 && p99[j - 1] < p) { ids[j] = ids[j - 1]; p99[j] = p99[j - 1]; j--; }
+    ids[j] = (uint8_t)i;
+    p99[j] = p;
   }
+  if (n > maxOut) n = maxOut;
+  memcpy(out, ids, n);
+  return n;
+}
 
-  int activeSlots = (doseScheduleCfg.enabled) ? DOSE_SLOTS_PER_DAY : 3;
-  if (activeSlots < 1) activeSlots = 1;
+void profPrintReport() {
+  uint8_t top[PROF_REPORT_TOP];
+  const int n = profTopStages(top, PROF_REPORT_TOP);
+  Serial.printf("=== LOOP PROFILE (window %lus, overhead %luns/stage) ===\n",
+                (unsigned long)(PROF_WINDOW_MS / 1000), (unsigned long)profOverheadNs);
+  Serial.println("stage            n        min(us)   avg(us)   p99(us)   max(us)   worst(us)");
+  for (int k = 0; k < n; k++) {
+    const ProfStage& s = profStages[top[k]];
+    const ProfWindow& w = profReportWindow(top[k]);
+    Serial.printf("%-15s %-8lu %-9lu %-9lu %-9lu %-9lu %lu\n", PROF_STAGE_NAMES[top[k]],
+                  (unsigned long)w.n, (unsigned long)w.minUs, (unsigned long)(w.sumUs / w.n),
+                  (unsigned long)profP99(w), (unsigned long)w.maxUs, (unsigned long)s.worstUs);
+  }
+}
 
-  String path = "/devices/" + String(DEVICE_ID) + "/state";
+String profReportJson() {
+  uint8_t top[PROF_REPORT_TOP];
+  const int n = profTopStages(top, PROF_REPORT_TOP);
 
   String json = "{";
-  json += "\"online\":true,";
-  json += "\"fwVersion\":\"" + String(FW_VERSION) + "\",";
-  json += "\"lastSeen\":" + String((unsigned long long)tsMs) + ",";
+  json += "\"at\":" + String((unsigned long long)getEpochMillis()) + ",";
+  json += "\"windowSec\":" + String(PROF_WINDOW_MS / 1000) + ",";
+  json += "\"overheadNs\":" + String(profOverheadNs) + ",";
+  json += "\"top\":[";
+  for (int k = 0; k < n; k++) {
+    const ProfStage& s = profStages[top[k]];
+    const ProfWindow& w = profReportWindow(top[k]);
+    if (k) json += ",";
+    json += "{\"stage\":\"" + String(PROF_STAGE_NAMES[top[k]]) + "\",";
+    json += "\"n\":" + String(w.n) + ",";
+    json += "\"minUs\":" + String(w.minUs) + ",";
+    json += "\"avgUs\":" + String(w.sumUs / w.n) + ",";
+    json += "\"p99Us\":" + String(profP99(w)) + ",";
+    json += "\"maxUs\":" + String(w.maxUs) + ",";
+    json += "\"worstUs\":" + String(s.worstUs) + ",";
+    json += "\"worstAt\":" + String(s.worstAt) + "}";
+  }
+  json += "]}";
+  return json;
+}
 
-  json += "\"dosingMlPerDay\":{";
-  json += "\"kalk\":" + String(dosing.ml_per_day_kalk, 2) + ",";
-  json += "\"afr\":"  + String(dosing.ml_per_day_afr,  2) + ",";
-  json += "\"mg\":"   + String(dosing.ml_per_day_mg,   2) + ",";
-  json += "\"tbd\":"  + String(dosing.ml_per_day_tbd,  2);
-  json += "},";
+// RTDB: commands/profile = true -> write the report to devices/<id>/profile, clear the flag.
+bool firebaseCheckAndHandleProfileRequest() {
+  if (WiFi.status() != WL_CONNECTED) return false;
 
-  json += "\"doseSlotsPerDay\":" + String(activeSlots) + ",";
+  String path = "/devices/" + String(DEVICE_ID) + "/commands/profile";
+  String payload = firebaseGetJson(path);
+  if (payload != "true") return false;
 
-  json += "\"pendingMl\":{";
-  json += "\"kalk\":" + String(pk, 2) + ",";
-  json += "\"afr\":"  + String(pa, 2) + ",";
-  json += "\"mg\":"   + String(pm, 2) + ",";
-  json += "\"tbd\":"  + String(pt, 2);
-  json += "},";
+  firebasePutJson("/devices/" + String(DEVICE_ID) + "/profile", profReportJson());
+  firebasePutJson(path, "false");
+  return true;
+}
 
-  json += "\"flowMlPerMin\":{";
-  json += "\"kalk\":" + String(FLOW_KALK_ML_PER_MIN, 2) + ",";
-  json += "\"afr\":"  + String(FLOW_AFR_ML_PER_MIN,  2) + ",";
-  json += "\"mg\":"   + String(FLOW_MG_ML_PER_MIN,   2) + ",";
-  json += "\"tbd\":"  + String(FLOW_TBD_ML_PER_MIN,  2);
-  json += "}";
+// Line-based serial console: "prof" prints the report, "prof reset" clears it.
+void serviceSerialConsole() {
+  static char line[32];
+  static uint8_t len = 0;
+  while (Serial.available() > 0) {
+    const char c = (char)Serial.read();
+    if (c != '\n' && c != '\r') {
+      if (len < sizeof(line) - 1) line[len++] = c;
+      continue;
+    }
+    line[len] = 0;
+    len = 0;
+    if (strcmp(line, "prof") == 0) profPrintReport();
+    else if (strcmp(line, "prof reset") == 0) { profReset(); Serial.println("Profiler reset"); }
+  }
+}
 
-  json += "}";
 
-  firebasePutJson(path, json);
+// ===================== FAST BOOT (WIFI CACHE + DEFERRED NETWORK) =====================
+// setup() doesn't wait on the network. State comes back from the config blob and
+// the dose journal; WiFi rejoins the AP we last used straight away (BSSID + channel
+// cached in NVS, so no scan) with a static IP when /settings/network sets one (no
+// DHCP round trip). loop() drives the fallbacks: a full scan after
+// WIFI_FAST_TIMEOUT_MS, then the WiFiManager portal, non-blocking, after
+// WIFI_SCAN_TIMEOUT_MS. SNTP runs in the background; the clock survives a warm
+// reset, so slots prime in setup() and only a cold boot waits for the first sync.
+// The boot push runs in a one-shot task that waits for WiFi and time on its own.
+//
+// /settings/network: {"staticIp":"192.168.1.50","gateway":"192.168.1.1",
+//                     "subnet":"255.255.255.0","dns":"192.168.1.1"}   (null = DHCP)
+// Cached in NVS (wifi/cache); a change applies at the next boot.
+
+const uint32_t WIFI_FAST_TIMEOUT_MS = 6000;
+const uint32_t WIFI_SCAN_TIMEOUT_MS = 20000;
+const uint32_t WIFI_CACHE_MAGIC     = 0x57434631; // "WCF1"
+const uint32_t NETWORK_SYNC_MS      = 600000;
+
+struct WifiCache {
+  uint32_t magic;
+  uint8_t  bssid[6];
+  uint8_t  channel;       // 0 = no AP cached yet
+  uint8_t  useStatic;
+  uint32_t ip, gateway, subnet, dns;
+  uint32_t crc;
+};
+
+WifiCache wifiCache;
+
+enum WifiBootState : uint8_t { WIFI_BOOT_FAST, WIFI_BOOT_SCAN, WIFI_BOOT_PORTAL, WIFI_BOOT_DONE };
+WifiBootState wifiBootState = WIFI_BOOT_FAST;
+uint32_t wifiBootStateMs = 0;
+String wifiBootSsid, wifiBootPass;
+
+void wifiCacheLoad() {
+  memset(&wifiCache, 0, sizeof(wifiCache));
+  NvsPrefs prefs;
+  if (!prefs.begin("wifi", true)) return;   // first boot: namespace not created yet
+  WifiCache c;
+  const bool ok = prefs.getBytes("cache", &c, sizeof(c)) == sizeof(c) &&
+                  c.magic == WIFI_CACHE_MAGIC &&
+                  c.crc == crc32Bytes(&c, offsetof(WifiCache, crc));
+  prefs.end();
+  if (ok) wifiCache = c;
+}
+
+void wifiCacheSave() {
+  wifiCache.magic = WIFI_CACHE_MAGIC;
+  wifiCache.crc = crc32Bytes(&wifiCache, offsetof(WifiCache, crc));
+  NvsPrefs prefs;
+  if (!prefs.begin("wifi", false)) {
+    Serial.println("Prefs: failed to open wifi (write)");
+    return;
+  }
+  prefs.putBytes("cache", &wifiCache, sizeof(wifiCache));
+  prefs.end();
+}
+
+static void wifiStartPortal(const char* why) {
+  Serial.printf("WiFi: %s, config portal \"ESP32_Config\" is up (dosing continues)\n", why);
+  wm.setConfigPortalBlocking(false);
+  wm.startConfigPortal("ESP32_Config");
+  wifiBootState = WIFI_BOOT_PORTAL;
+  wifiBootStateMs = millis();
+}
+
+// setup(): start the connect and return; serviceFastBoot() takes it from here.
+void wifiFastBegin() {
+  wifiCacheLoad();
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  wifiBootSsid = wm.getWiFiSSID(true);
+  wifiBootPass = wm.getWiFiPass(true);
+  wifiBootStateMs = millis();
+
+  if (wifiBootSsid.length() == 0) {
+    wifiStartPortal("no saved network");
+    return;
+  }
+  if (wifiCache.useStatic) {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway),
+                IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+  }
+  if (wifiCache.channel) {
+    Serial.printf("WiFi: fast connect to %s (ch %u, cached BSSID%s)\n", wifiBootSsid.c_str(),
+                  wifiCache.channel, wifiCache.useStatic ? ", static IP" : "");
+    WiFi.begin(wifiBootSsid.c_str(), wifiBootPass.c_str(), wifiCache.channel, wifiCache.bssid, true);
+    wifiBootState = WIFI_BOOT_FAST;
+  } else {
+    Serial.printf("WiFi: connecting to %s\n", wifiBootSsid.c_str());
+    WiFi.begin(wifiBootSsid.c_str(), wifiBootPass.c_str());
+    wifiBootState = WIFI_BOOT_SCAN;
+  }
 }
 
+static void wifiBootConnected() {
+  if (wifiBootState == WIFI_BOOT_PORTAL) wm.stopConfigPortal();
+  wifiBootState = WIFI_BOOT_DONE;
+  Serial.printf("WiFi: connected %lu ms after boot, IP %s\n",
+                (unsigned long)millis(), WiFi.localIP().toString().c_str());
+
+  // The portal's own web server held port 80 until now; it never comes back after this
+  server.begin();
+  Serial.println("HTTP server started");
 
-// Remove the fixed values and use these formulas instead
-void updateChemistryConstants() {
-    if (TANK_VOLUME_L <= 0) return;
+  const uint8_t* bssid = WiFi.BSSID();
+  const uint8_t ch = (uint8_t)WiFi.channel();
+  if (!bssid || ch == 0) return;
+  if (ch == wifiCache.channel && memcmp(bssid, wifiCache.bssid, sizeof(wifiCache.bssid)) == 0) return;
+  memcpy(wifiCache.bssid, bssid, sizeof(wifiCache.bssid));
+  wifiCache.channel = ch;
+  wifiCacheSave();
+  Serial.printf("WiFi: cached AP on channel %u\n", ch);
+}
 
-    // Saturated Kalk: ~1.4 dKH per Liter. 
-    // Formulas: (Source Strength / Tank Volume)
-    DKH_PER_ML_KALK_TANK    = 1.4f / TANK_VOLUME_L; 
-    CA_PPM_PER_ML_KALK_TANK = 10.0f / TANK_VOLUME_L; // ~10ppm Ca per Liter
+// Pull /settings/network and cache it for the next boot.
+void firebaseSyncNetworkOnce() {
+  JsonDocument doc;
+  if (!firebaseGetJsonDoc("/devices/" + String(DEVICE_ID) + "/settings/network", doc, nullptr)) return;
 
-    // All-For-Reef: 160 dKH per Liter (approx)
-    DKH_PER_ML_AFR_TANK     = 160.0f / TANK_VOLUME_L;
-    CA_PPM_PER_ML_AFR_TANK  = 1140.0f / TANK_VOLUME_L;
-    MG_PPM_PER_ML_AFR_TANK  = 180.0f / TANK_VOLUME_L;
+  IPAddress ip, gw, sn, dns;
+  const bool useStatic = ip.fromString(doc["staticIp"] | "") && gw.fromString(doc["gateway"] | "");
+  if (useStatic) {
+    if (!sn.fromString(doc["subnet"] | "255.255.255.0")) sn = IPAddress(255, 255, 255, 0);
+    if (!dns.fromString(doc["dns"] | "")) dns = gw;
+  }
 
-    Serial.printf("AI Math Updated: 1ml Kalk = %.6f dKH | 1ml AFR = %.6f dKH\n", 
-                  DKH_PER_ML_KALK_TANK, DKH_PER_ML_AFR_TANK);
+  WifiCache next = wifiCache;
+  next.useStatic = useStatic ? 1 : 0;
+  next.ip      = useStatic ? (uint32_t)ip  : 0;
+  next.gateway = useStatic ? (uint32_t)gw  : 0;
+  next.subnet  = useStatic ? (uint32_t)sn  : 0;
+  next.dns     = useStatic ? (uint32_t)dns : 0;
+  if (next.useStatic == wifiCache.useStatic && next.ip == wifiCache.ip &&
+      next.gateway == wifiCache.gateway && next.subnet == wifiCache.subnet && next.dns == wifiCache.dns) {
+    return;
+  }
+  wifiCache = next;
+  wifiCacheSave();
+  Serial.printf("Network settings updated (%s), applied at next boot\n",
+                useStatic ? ip.toString().c_str() : "DHCP");
 }
 
-// ===================== HTTP HANDLERS (local debug/legacy) =====================
+// One-shot: wait for WiFi and (briefly) the clock, send the boot push, exit.
+void bootNetTask(void*) {
+  while (WiFi.status() != WL_CONNECTED) vTaskDelay(pdMS_TO_TICKS(250));
+  struct tm t;
+  for (int i = 0; i < 60 && !(getLocalTime(&t, 0) && isTimeValid(t)); i++) {
+    vTaskDelay(pdMS_TO_TICKS(250));
+  }
+  // Firebase: send ONE push per boot (Cloud Function will deliver to iPhone)
+  firebasePushNotificationThrottled("boot_push", 30ULL*60ULL*1000ULL,
+    "critical",
+    "ReefDoser Online",
+    String(DEVICE_ID) + " booted. IP " + WiFi.localIP().toString());
+  vTaskDelete(nullptr);
+}
 
-void handleRoot(){
-  server.send_P(200, "text/html", MAIN_PAGE_HTML);
+void bootNetworkBegin() {
+  xTaskCreatePinnedToCore(bootNetTask, "bootNet", 8192, nullptr, 1, nullptr, 0);
 }
 
-void handleSubmitTest(){
-  if (server.method() != HTTP_POST) {
-    server.send(405, "text/plain", "Method Not Allowed");
+// loop(): WiFi fallbacks, portal, and the boot work that needs a clock.
+void serviceFastBoot() {
+  governorSeedFromLedger();
+
+  static uint32_t lastNetworkSyncMs = 0;
+  if (WiFi.status() == WL_CONNECTED &&
+      (lastNetworkSyncMs == 0 || millis() - lastNetworkSyncMs >= NETWORK_SYNC_MS)) {
+    lastNetworkSyncMs = millis() | 1;
+    firebaseSyncNetworkOnce();
+  }
+
+  if (wifiBootState == WIFI_BOOT_DONE) return;
+  if (wifiBootState == WIFI_BOOT_PORTAL) wm.process();
+  if (WiFi.status() == WL_CONNECTED) {
+    wifiBootConnected();
     return;
   }
 
-  float ca  = server.arg("ca").toFloat();
-  float alk = server.arg("alk").toFloat();
-  float mg  = server.arg("mg").toFloat();
-  float ph  = server.arg("ph").toFloat();
+  const uint32_t elapsed = millis() - wifiBootStateMs;
+  if (wifiBootState == WIFI_BOOT_FAST && elapsed >= WIFI_FAST_TIMEOUT_MS) {
+    Serial.println("WiFi: cached AP not answering, scanning");
+    WiFi.disconnect();
+    WiFi.begin(wifiBootSsid.c_str(), wifiBootPass.c_str());
+    wifiBootState = WIFI_BOOT_SCAN;
+    wifiBootStateMs = millis();
+  } else if (wifiBootState == WIFI_BOOT_SCAN && elapsed >= WIFI_SCAN_TIMEOUT_MS) {
+    wifiStartPortal("can't connect");
+  }
+}
+
+
+// ===================== WARM RESET SNAPSHOT (RTC) =====================
+// A software restart (OTA, ESP.restart()), panic or watchdog reset keeps RTC slow
+// memory. The control state that otherwise lives only in RAM is mirrored there as
+// it changes, each record with a CRC:
+//  - runtime:  pending buckets, catch-up, slotDone[] + window day, the test cursor
+//              and whether history is complete, the last journal run per pump
+//              already settled in its bucket
+//  - history:  historyBuf and the last/current test
+//  - throttle: gThrottle cooldowns, matched by key
+// The config blob and the reagent registry keep their own RTC copies (CONFIG STORE,
+// REAGENT REGISTRY). After a warm reset a valid record replaces the NVS read, the
+// boot prime / bucket reset or the test backfill it stands for; an invalid one
+// (power-on, brownout, a write torn by the reset, a new layout) takes the cold
+// path for its part. Everything, dose journal included, is about 3.5 KB of the
+// 8 KB RTC slow memory; the largest write (history) is one 1.6 KB CRC per test.
+
+const uint32_t RTC_SNAPSHOT_MAGIC   = 0x52534E50UL;   // "RSNP"
+const uint16_t RTC_SNAPSHOT_VERSION = 1;
+const int      RTC_THROTTLE_MAX     = 24;
+
+struct RtcHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;            // sizeof the record: a layout change reads as invalid
+};
+
+struct RtcRuntime {
+  RtcHeader hdr;
+  uint64_t  testCursorMs;
+  float     pendingMl[4];
+  float     catchUpMl[4];
+  float     catchUpPerSlotMl[4];
+  uint32_t  lastSlotEpoch;
+  uint32_t  bookedSeq[4];
+  int16_t   lastDoseWindowDay;
+  uint8_t   slotsPrimed;
+  uint8_t   historyComplete;
+  uint16_t  slotCount;
+  uint8_t   slotDone[(MAX_DOSE_SLOTS + 7) / 8];
+  uint32_t  crc;
+};
+
+struct RtcHistory {
+  RtcHeader hdr;
+  int32_t   count;
+  uint32_t  head;
+  TestPoint last;
+  TestPoint current;
+  TestPoint buf[MAX_HISTORY];
+  uint32_t  crc;
+};
 
- onNewTestInput(ca, alk, mg, ph, 0.0f);
+struct RtcThrottle {
+  RtcHeader hdr;
+  uint32_t  count;
+  uint32_t  keyCrc[RTC_THROTTLE_MAX];
+  uint64_t  lastTs[RTC_THROTTLE_MAX];
+  uint32_t  crc;
+};
 
-  server.sendHeader("Location", "/");
-  server.send(303);
+RTC_NOINIT_ATTR RtcRuntime  rtcRuntime;
+RTC_NOINIT_ATTR RtcHistory  rtcHistory;
+RTC_NOINIT_ATTR RtcThrottle rtcThrottle;
+bool rtcSnapshotReady = false;   // no writes until boot has read the old records
+
+static void rtcSeal(void* rec, size_t size, size_t crcOffset) {
+  RtcHeader* h = (RtcHeader*)rec;
+  h->magic   = RTC_SNAPSHOT_MAGIC;
+  h->version = RTC_SNAPSHOT_VERSION;
+  h->size    = (uint16_t)size;
+  const uint32_t crc = crc32Bytes(rec, crcOffset);
+  memcpy((uint8_t*)rec + crcOffset, &crc, sizeof(crc));
 }
 
-void handleApiHistory(){
-  String json = "{";
+static bool rtcSealed(const void* rec, size_t size, size_t crcOffset) {
+  const RtcHeader* h = (const RtcHeader*)rec;
+  if (h->magic != RTC_SNAPSHOT_MAGIC || h->version != RTC_SNAPSHOT_VERSION || h->size != size) return false;
+  uint32_t crc;
+  memcpy(&crc, (const uint8_t*)rec + crcOffset, sizeof(crc));
+  return crc == crc32Bytes(rec, crcOffset);
+}
 
-  json += "\"dosing\":{";
-  json += "\"kalk\":" + String(dosing.ml_per_day_kalk, 1) + ",";
-  json += "\"afr\":"  + String(dosing.ml_per_day_afr,  1) + ",";
-  json += "\"mg\":"   + String(dosing.ml_per_day_mg,   1);
-  json += "},";
+static uint32_t rtcThrottleKey(const char* key) {
+  return crc32Bytes(key, strlen(key));
+}
 
-  json += "\"tests\":[";
-  for(int i = 0; i < historyCount; i++){
-    const TestPoint& tp = historyBuf[i];
-    if(i > 0) json += ",";
-    json += "{";
-    json += "\"t\":"   + String(tp.t);
-    json += ",\"ca\":" + String(tp.ca, 1);
-    json += ",\"alk\":"+ String(tp.alk,2);
-    json += ",\"mg\":" + String(tp.mg, 1);
-    json += ",\"ph\":" + String(tp.ph, 2);
-    json += "}";
+// Resets that keep RTC memory. Power-on, brownout and the EN pin don't.
+bool rtcResetKeepsMemory() {
+  switch (esp_reset_reason()) {
+    case ESP_RST_SW:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_DEEPSLEEP:
+      return true;
+    default:
+      return false;
   }
-  json += "]";
+}
 
-  json += "}";
+// Buckets, slots or the cursor changed (configCommit() calls this too).
+void rtcSaveRuntime() {
+  if (!rtcSnapshotReady) return;
+  RtcRuntime& r = rtcRuntime;
+  memset(&r, 0, sizeof(r));
+  r.testCursorMs = lastRemoteTestTimestampMs;
+  r.pendingMl[0] = pendingKalkMl;
+  r.pendingMl[1] = pendingAfrMl;
+  r.pendingMl[2] = pendingMgMl;
+  r.pendingMl[3] = pendingTbdMl;
+  memcpy(r.catchUpMl, catchUpMl, sizeof(catchUpMl));
+  memcpy(r.catchUpPerSlotMl, catchUpPerSlotMl, sizeof(catchUpPerSlotMl));
+  r.lastSlotEpoch = lastSlotEpoch;
+  memcpy(r.bookedSeq, doseJournalBookedSeq, sizeof(doseJournalBookedSeq));
+  r.lastDoseWindowDay = (int16_t)lastDoseWindowDay;
+  r.slotsPrimed       = doseSlotsPrimed ? 1 : 0;
+  r.historyComplete   = testSyncNeedsBackfill ? 0 : 1;
+  r.slotCount         = (uint16_t)DOSE_SLOTS_PER_DAY;
+  for (int i = 0; i < DOSE_SLOTS_PER_DAY; i++) {
+    if (slotDone[i]) r.slotDone[i / 8] |= (uint8_t)(1 << (i % 8));
+  }
+  rtcSeal(&r, sizeof(r), offsetof(RtcRuntime, crc));
+}
 
-  server.send(200, "application/json", json);
+// A test was added to history, or history was cleared.
+void rtcSaveHistory() {
+  if (!rtcSnapshotReady) return;
+  HistoryLock lock;
+  RtcHistory& h = rtcHistory;
+  h.count   = historyCount;
+  h.head    = historyHead;
+  h.last    = lastTest;
+  h.current = currentTest;
+  memcpy(h.buf, historyBuf, sizeof(historyBuf));
+  rtcSeal(&h, sizeof(h), offsetof(RtcHistory, crc));
 }
 
+// A cooldown was taken (allowThrottled(), under FirebaseLock).
+void rtcSaveThrottle() {
+  if (!rtcSnapshotReady) return;
+  RtcThrottle& t = rtcThrottle;
+  memset(&t, 0, sizeof(t));
+  t.count = (uint32_t)min(gThrottleCount, (size_t)RTC_THROTTLE_MAX);
+  for (uint32_t i = 0; i < t.count; i++) {
+    t.keyCrc[i] = rtcThrottleKey(gThrottle[i].key);
+    t.lastTs[i] = gThrottle[i].lastTs;
+  }
+  rtcSeal(&t, sizeof(t), offsetof(RtcThrottle, crc));
+}
 
+// Boot, after config and the slot table are loaded and before the dose journal
+// settles its runs into the buckets. Rewrites every record either way, so a stale
+// one can't come back on the next reset.
+void rtcSnapshotRestore() {
+  bool runtimeOk = false, historyOk = false, throttleOk = false;
+  if (rtcWarmBoot) {
+    runtimeOk  = rtcSealed(&rtcRuntime,  sizeof(rtcRuntime),  offsetof(RtcRuntime, crc));
+    historyOk  = rtcSealed(&rtcHistory,  sizeof(rtcHistory),  offsetof(RtcHistory, crc)) &&
+                 rtcHistory.count >= 0 && rtcHistory.count <= MAX_HISTORY;
+    throttleOk = rtcSealed(&rtcThrottle, sizeof(rtcThrottle), offsetof(RtcThrottle, crc)) &&
+                 rtcThrottle.count <= (uint32_t)RTC_THROTTLE_MAX;
+  }
 
+  if (runtimeOk) {
+    const RtcRuntime& r = rtcRuntime;
+    lastRemoteTestTimestampMs = r.testCursorMs;
+    pendingKalkMl = r.pendingMl[0];
+    pendingAfrMl  = r.pendingMl[1];
+    pendingMgMl   = r.pendingMl[2];
+    pendingTbdMl  = r.pendingMl[3];
+    memcpy(catchUpMl, r.catchUpMl, sizeof(catchUpMl));
+    memcpy(catchUpPerSlotMl, r.catchUpPerSlotMl, sizeof(catchUpPerSlotMl));
+    lastSlotEpoch = r.lastSlotEpoch;
+    memcpy(doseJournalBookedSeq, r.bookedSeq, sizeof(doseJournalBookedSeq));
+    if (r.slotCount == DOSE_SLOTS_PER_DAY) {   // same schedule: slots carry over
+      for (int i = 0; i < DOSE_SLOTS_PER_DAY; i++) slotDone[i] = (r.slotDone[i / 8] >> (i % 8)) & 1;
+      lastDoseWindowDay = r.lastDoseWindowDay;
+      doseSlotsPrimed   = r.slotsPrimed != 0;
+    }
+    rtcRuntimeRestored = true;
+  }
 
-void updateChemistryMath() {
-    // If volume is 0, default to 300g (1135.6L) to prevent math errors
-    if (TANK_VOLUME_L <= 0) TANK_VOLUME_L = 1135.6f;
+  if (historyOk) {
+    HistoryLock lock;
+    memcpy(historyBuf, rtcHistory.buf, sizeof(historyBuf));
+    historyCount = rtcHistory.count;
+    historyHead  = rtcHistory.head;
+    lastTest     = rtcHistory.last;
+    currentTest  = rtcHistory.current;
+  }
+  // History is only complete if both came back; otherwise backfill from RTDB
+  testSyncNeedsBackfill = !(runtimeOk && historyOk && rtcRuntime.historyComplete);
 
-    // This creates a ratio: (Original 300g size / New size)
-    // If the tank gets smaller, this number gets larger, making the chemicals more "potent"
-    float scaleFactor = 1135.6f / TANK_VOLUME_L;
+  if (throttleOk) {
+    for (uint32_t j = 0; j < rtcThrottle.count; j++) {
+      for (size_t i = 0; i < gThrottleCount; i++) {
+        if (rtcThrottleKey(gThrottle[i].key) == rtcThrottle.keyCrc[j]) gThrottle[i].lastTs = rtcThrottle.lastTs[j];
+      }
+    }
+  }
 
-    // Update your global chemistry variables based on the new size
-    DKH_PER_ML_KALK_TANK    = 0.0103f * scaleFactor; 
-    CA_PPM_PER_ML_KALK_TANK = 0.0720f * scaleFactor;
-    DKH_PER_ML_AFR_TANK     = 0.0052f * scaleFactor;
+  if (rtcWarmBoot) {
+    Serial.printf("RTC snapshot: runtime %s, history %s (%d tests), throttle %s\n",
+                  runtimeOk ? "restored" : "invalid", historyOk ? "restored" : "invalid",
+                  historyOk ? historyCount : 0, throttleOk ? "restored" : "invalid");
+  }
 
-    Serial.printf("Tank updated to %.1fL. New Kalk impact: %.6f dKH/ml\n", TANK_VOLUME_L, DKH_PER_ML_KALK_TANK);
+  rtcSnapshotReady = true;
+  rtcSaveRuntime();
+  rtcSaveHistory();
+  rtcSaveThrottle();
 }
 
 
@@ -2232,8 +7354,14 @@ void updateChemistryMath() {
 
 void setup(){
   Serial.begin(115200);
-  delay(1000);
+  if (esp_reset_reason() == ESP_RST_POWERON) delay(1000);  // give a serial monitor time to attach
   Serial.println("=== RUNNING FW " + String(FW_VERSION) + " on " + String(DEVICE_ID) + " ===");
+  rtcWarmBoot = rtcResetKeepsMemory();
+  Serial.printf("Reset reason %d (%s boot)\n", (int)esp_reset_reason(), rtcWarmBoot ? "warm" : "cold");
+
+  historyMutex  = xSemaphoreCreateMutex();
+  firebaseMutex = xSemaphoreCreateRecursiveMutex();
+  localCmdQueue = xQueueCreate(LOCAL_CMD_QUEUE_LEN, sizeof(LocalCmd));
 
   pinMode(PIN_PUMP_KALK, OUTPUT);
   pinMode(PIN_PUMP_AFR,  OUTPUT);
@@ -2244,78 +7372,94 @@ void setup(){
   digitalWrite(PIN_PUMP_MG,   LOW);
   digitalWrite(PIN_PUMP_TBD,  LOW);
 
+  // E-stop button + RTDB stream (the stream task waits for WiFi on its own)
+  estopFastPathBegin();
+
   ///////////////////////clean memory//////////////////////
   //nvs_flash_erase();
   //nvs_flash_init();
   //////////////////////////////////////////////////
-  // Load last saved AI dosing plan from NVS (if any)
-  loadDosingFromPrefs();
-  loadFlowFromPrefs();
+  // Load saved plan, flows, schedule, tank, buckets and test cursor (one NVS blob,
+  // or its RTC copy after a warm reset), then the runtime state kept in RTC
+  configLoad();
+  reagentLoad();
+  applyTankVolumeScaling();
+  rebuildScheduleSlots();
+  rtcSnapshotRestore();
+  doseJournalReconcile();
+  profInit();
+  loadLocalApiTokenFromPrefs();
   // Sanity-check stored flow rates (bad values can cause hour-long pump runs)
 validateFlow("KALK", FLOW_KALK_ML_PER_MIN, 675.0f);
 validateFlow("AFR",  FLOW_AFR_ML_PER_MIN,  645.0f);
 validateFlow("MG",   FLOW_MG_ML_PER_MIN,    50.0f);
 validateFlow("TBD",  FLOW_TBD_ML_PER_MIN,   50.0f);
+  pumpGuardBegin();
+  pumpDriverBegin();
   updatePumpSchedules();
-  doseSlotsPrimed = false; // re-prime after time sync
 
   lastSafetyBackoffTs = nowSeconds();
 
-  // Connect to home Wi-Fi
-  //WiFi.mode(WIFI_STA);
-  //WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-
-  //wm.resetSettings();
-  Serial.print("Connecting to WiFi");
-      if(!wm.autoConnect("ESP32_Config")) {
-        Serial.println("Failed to connect, waiting for user config...");
-    } else {
-        Serial.println("Connected to WiFi!");
-    }
-  /*while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }*/
-  Serial.println();
-  Serial.print("Connected, IP address: ");
-  Serial.println(WiFi.localIP());
+  // WiFi, NTP and Firebase all finish in the background (see FAST BOOT)
+  wifiFastBegin();
 
   // Allow insecure HTTPS for Firebase
   secureClient.setInsecure();
-  initBucketPrefs();
 
-  // NTP time sync
+  // NTP time sync (asynchronous). After a warm reset the clock is still set.
   configTime(GMT_OFFSET_SEC, DST_OFFSET_SEC, NTP_SERVER);
   struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
-    Serial.println("Failed to obtain time from NTP");
+  if (doseSlotsPrimed) {
+    Serial.println("Dose slots resumed from RTC");
+  } else if (!getLocalTime(&timeinfo, 0) || !isTimeValid(timeinfo)) {
+    Serial.println("Clock not set yet, dose slots prime after the first NTP sync");
   } else {
-    Serial.println("Time synchronized from NTP");
-    // Option A: do NOT catch up on missed slots after a reboot
+    Serial.println("Clock valid at boot");
+    // Missed slots are written off here and replayed, rate-limited, by the catch-up
     primeDoseSlotsForToday();
-    clearPendingBuckets("boot prime");
+    catchUpAfterPrime();
   }
+  doseJournalRestoreRemainder();
 
-  // Web server routes
-  server.on("/", handleRoot);
-  server.on("/submit_test", handleSubmitTest);
-  server.on("/api/history", handleApiHistory);
-  server.begin();
-  Serial.println("HTTP server started");
-
-  // Firebase: send ONE push at boot (Cloud Function will deliver to iPhone)
-  firebasePushNotificationThrottled("boot_push", 30ULL*60ULL*1000ULL,
-    "critical",
-    "ReefDoser Online",
-    String(DEVICE_ID) + " booted. IP " + WiFi.localIP().toString());
+  // Web assets and the dose ledger live on the LittleFS partition (format it on first boot)
+  fsMounted = LittleFS.begin(true);
+  if (!fsMounted) Serial.println("LittleFS: mount failed");
+  loadWebAssetManifest();
+  ledgerBegin();
+  governorSeedFromLedger();
 
+  // Web server routes
+  registerWebAssetRoutes();
+  server.on("/submit_test", HTTP_ANY, handleSubmitTest);
+  server.on("/api/history", HTTP_GET, handleApiHistory);
+  server.on("/api/ledger", HTTP_GET, handleApiLedger);
+  server.on("/metrics", HTTP_GET, handleMetrics);
+  registerLocalApiRoutes();
+  registerWebSocket();
+  // server.begin() waits for wifiBootConnected(): the config portal listens on port 80 too
+
+  // Boot push; test history is rebuilt by the first poll in loop()
+  bootNetworkBegin();
+  Serial.printf("Boot: ready in %lu ms\n", (unsigned long)millis());
 }
 
 void loop(){
-  server.handleClient();
+  const uint32_t loopStartMs = millis();
+
+  serviceEstopEvents();
+  servicePumpGuard();
+  serviceDoseJournal();
+
+  // Work queued by the async HTTP handlers (tests submitted from the local page, ...)
+  { ProfScope p(PROF_LOCAL_CMDS); serviceLocalCommands(); }
+  { ProfScope p(PROF_WS_FLUSH);   wsFlush(); }
+  serviceSerialConsole();
 
   // Push notification only when device goes OFFLINE (WiFi down for >2 minutes).
   // This avoids spam and relies on your Cloud Function to deliver iPhone push.
+  {
+  ProfScope p(PROF_WIFI_WATCH);
+  serviceFastBoot();
   static unsigned long wifiDownSinceMs = 0;
   static bool offlineNotified = false;
   if (WiFi.status() != WL_CONNECTED) {
@@ -2332,12 +7476,20 @@ void loop(){
     wifiDownSinceMs = 0;
     offlineNotified = false; // allow a future offline push if it drops again
   }
+  }
 
 
-  safetyBackoffIfNoTests();
+  { ProfScope p(PROF_SAFETY_BACKOFF); safetyBackoffIfNoTests(); }
 
   // Dose at 3 scheduled time slots per day
-  maybeDosePumpsRealTime();
+  { ProfScope p(PROF_PUMP_DRIVER); pumpDriverService(); slotRunnerService(); }
+  serviceGovernorAlert();
+  { ProfScope p(PROF_DOSING); maybeDosePumpsRealTime(); }
+  { ProfScope p(PROF_LEDGER); serviceLedger(); }
+
+  // OTA: keep/roll back a fresh image; restart into a staged one between slots
+  otaServiceValidation();
+  otaServiceActivation();
 
   unsigned long nowMs = millis();
 
@@ -2346,22 +7498,26 @@ void loop(){
 if (nowMs - lastFirebasePollMs >= 10000UL) { // every ~10s
   lastFirebasePollMs = nowMs;
 
-  firebaseCheckAndHandleResetAi();
-  firebaseCheckAndHandleLiveDose();
-  firebaseCheckAndHandleOtaRequest();
-  firebaseCheckAndHandleCalibrate();
-
-  firebaseSyncDoseScheduleOnce();
-  firebaseSyncDosingPlanOnce();
-  firebaseSyncTankSize();
-  checkEmergencyStop();
-  checkForNewTest();
+  // Push local API setting changes first so the pulls below don't revert them
+  { ProfScope p(PROF_CLOUD_MIRROR);  serviceCloudMirror(); }
+  { ProfScope p(PROF_RESET_AI);      firebaseCheckAndHandleResetAi(); }
+  { ProfScope p(PROF_LIVE_DOSE);     firebaseCheckAndHandleLiveDose(); }
+  { ProfScope p(PROF_OTA_REQUEST);   firebaseCheckAndHandleOtaRequest(); }
+  { ProfScope p(PROF_CALIBRATE);     firebaseCheckAndHandleCalibrate(); }
+  { ProfScope p(PROF_PROFILE_CMD);   firebaseCheckAndHandleProfileRequest(); }
+
+  { ProfScope p(PROF_SCHEDULE_SYNC); firebaseSyncDoseScheduleOnce(); }
+  { ProfScope p(PROF_PLAN_SYNC);     firebaseSyncDosingPlanOnce(); }
+  { ProfScope p(PROF_TANK_SYNC);     firebaseSyncTankSize(); }
+  { ProfScope p(PROF_ESTOP);         checkEmergencyStop(); }
+  { ProfScope p(PROF_TEST_SYNC);     checkForNewTest(); }
+  { ProfScope p(PROF_ROLLUPS);       serviceDoseRollups(); }
 
   // NOW publish state after you've applied any new settings
-  firebaseSendStateHeartbeat();
+  { ProfScope p(PROF_POLL_HEARTBEAT); firebaseSendStateHeartbeat(); }
 
   struct tm timeinfo;
-  if (getLocalTime(&timeinfo)) {
+  if (getLocalTime(&timeinfo, 0)) {
     Serial.println(&timeinfo, "--- CLOCK CHECK: %A, %B %d %Y %I:%M:%S %p ---");
   } else {
     Serial.println("--- CLOCK CHECK: Time NOT SET (Still 1970) ---");
@@ -2373,7 +7529,9 @@ if (nowMs - lastFirebasePollMs >= 10000UL) { // every ~10s
   static unsigned long lastFlowSyncMs = 0;
   if (nowMs - lastFlowSyncMs >= 30000UL) { // every 30s
     lastFlowSyncMs = nowMs;
-    firebaseSyncFlowCalibrationOnce();
+    { ProfScope p(PROF_FLOW_SYNC);  firebaseSyncFlowCalibrationOnce(); }
+    { ProfScope p(PROF_REAGENT_SYNC); firebaseSyncReagentsOnce(); }
+    { ProfScope p(PROF_TOKEN_SYNC); firebaseSyncLocalApiTokenOnce(); }
   }
 
 
@@ -2381,6 +7539,10 @@ if (nowMs - lastFirebasePollMs >= 10000UL) { // every ~10s
   static unsigned long lastStateHeartbeatMs = 0;
   if (nowMs - lastStateHeartbeatMs >= 30000UL) {
     lastStateHeartbeatMs = nowMs;
+    ProfScope p(PROF_HEARTBEAT);
     firebaseSendStateHeartbeat();
   }
-}
\ No newline at end of file
+
+  metrics.loopMs.observe(millis() - loopStartMs);
+  profTick();
+}